@@ -13,6 +13,10 @@ struct system_stats {
 struct device_driver_stats {
 	int blocks_written;
 	int blocks_read;
+	int interrupts;
+	int io_wait_ticks;
+	int io_idle_ticks;
+	int requests_merged;
 };
 
 struct bcache_stats {
@@ -21,6 +25,16 @@ struct bcache_stats {
 	int write_hits;
 	int write_misses;
 	int writebacks;
+	int dirty_blocks;
+	int flush_wakeups;
+	int flush_ratio_triggers;
+	int flush_writes;
+	int flush_blocks;
+	int readahead_blocks;
+	int readahead_hits;
+	int readahead_wasted;
+	int write_errors;
+	int write_abandoned;
 };
 
 struct process_stats {
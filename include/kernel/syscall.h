@@ -50,6 +50,8 @@ typedef enum {
 	SYSCALL_SYSTEM_TIME,
 	SYSCALL_SYSTEM_RTC,
 	SYSCALL_DEVICE_DRIVER_STATS,
+	SYSCALL_PROCESS_PRIORITY,
+	SYSCALL_SYSTEM_CLOCK,
 	MAX_SYSCALL		// must be the last element in the enum
 } syscall_t;
 
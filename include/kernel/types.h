@@ -74,4 +74,10 @@ typedef enum {
 #define KNO_STDWIN  3
 #define KNO_STDDIR  4
 
+/* Process priorities: a higher value runs first. */
+
+#define PROCESS_PRIORITY_MIN     0
+#define PROCESS_PRIORITY_MAX     7
+#define PROCESS_PRIORITY_DEFAULT 4
+
 #endif
@@ -28,6 +28,7 @@ int syscall_process_wait(struct process_info *info, int timeout);
 int syscall_process_sleep(unsigned int ms);
 int syscall_process_stats(struct process_stats *s, unsigned int pid);
 extern void *syscall_process_heap(int a);
+int syscall_process_priority(unsigned int pid, int priority);
 
 /* Syscalls that open or create new kernel objects for this process. */
 
@@ -61,6 +62,7 @@ int syscall_bcache_flush();
 
 int syscall_system_time( uint32_t *t );
 int syscall_system_rtc( struct rtc_time *t );
+int syscall_system_clock( uint32_t *millis );
 
 int syscall_device_driver_stats(char * name, struct device_driver_stats * stats);
 
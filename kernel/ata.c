@@ -13,6 +13,9 @@ See the file LICENSE for details.
 #include "device.h"
 #include "process.h"
 #include "mutex.h"
+#include "pci.h"
+#include "page.h"
+#include "memorylayout.h"
 
 #define ATA_IRQ0	32+14
 #define ATA_IRQ1	32+15
@@ -27,6 +30,15 @@ See the file LICENSE for details.
 #define ATA_TIMEOUT 5000
 #define ATA_IDENTIFY_TIMEOUT 1000
 
+/*
+A channel falls back to polling after ATA_INTERRUPT_MISSES interrupts
+in a row fail to arrive, and tries interrupts again after polling
+ATA_INTERRUPT_RETRY steps, going back to polling at the next miss.
+*/
+
+#define ATA_INTERRUPT_MISSES 3
+#define ATA_INTERRUPT_RETRY 256
+
 #define ATA_DATA	0	/* data register */
 #define ATA_ERROR	1	/* error register */
 #define ATA_COUNT	2	/* sectors to transfer */
@@ -56,6 +68,39 @@ See the file LICENSE for details.
 #define ATA_COMMAND_READ		0x20	/* read data */
 #define ATA_COMMAND_WRITE		0x30	/* write data */
 #define ATA_COMMAND_IDENTIFY		0xec
+#define ATA_COMMAND_READ_DMA		0xc8
+#define ATA_COMMAND_WRITE_DMA		0xca
+#define ATA_COMMAND_READ_MULTIPLE	0xc4
+#define ATA_COMMAND_WRITE_MULTIPLE	0xc5
+#define ATA_COMMAND_SET_MULTIPLE	0xc6
+#define ATA_COMMAND_READ_EXT		0x24	/* 48-bit forms of the above */
+#define ATA_COMMAND_WRITE_EXT		0x34
+#define ATA_COMMAND_READ_DMA_EXT	0x25
+#define ATA_COMMAND_WRITE_DMA_EXT	0x35
+#define ATA_COMMAND_READ_MULTIPLE_EXT	0x29
+#define ATA_COMMAND_WRITE_MULTIPLE_EXT	0x39
+
+#define ATA_IDENTIFY_MULTIPLE_MAX	47
+#define ATA_IDENTIFY_CAPABILITIES	49
+#define ATA_IDENTIFY_LBA28_SECTORS	60
+#define ATA_IDENTIFY_COMMAND_SETS	83
+#define ATA_IDENTIFY_LBA48_SECTORS	100
+#define ATA_CAPABILITY_DMA		0x0100
+#define ATA_CAPABILITY_LBA		0x0200
+#define ATA_COMMAND_SET_LBA48		0x0400
+
+/*
+28-bit commands address the first 2^28 sectors, and move up to
+256 sectors.  Beyond that, units that support it use 48-bit commands,
+which are limited here to what one descriptor table can describe.
+With multiple mode, a PIO command moves ATA_MULTIPLE sectors for
+each data request, rather than one.
+*/
+
+#define ATA_LBA28_LIMIT		0x10000000
+#define ATA_LBA28_MAX_SECTORS	256
+#define ATA_LBA48_MAX_SECTORS	8192
+#define ATA_MULTIPLE		8
 
 #define ATAPI_COMMAND_IDENTIFY 0xa1
 #define ATAPI_COMMAND_PACKET   0xa0
@@ -73,13 +118,103 @@ See the file LICENSE for details.
 #define ATA_CONTROL_RESET	0x04
 #define ATA_CONTROL_DISABLEINT	0x02
 
+/* Bus master IDE registers, relative to the base of each channel. */
+#define ATA_BM_COMMAND	0
+#define ATA_BM_STATUS	2
+#define ATA_BM_PRDT	4
+
+#define ATA_BM_COMMAND_START	0x01
+#define ATA_BM_COMMAND_READ	0x08	/* transfer from the device to memory */
+
+#define ATA_BM_STATUS_ACTIVE	0x01
+#define ATA_BM_STATUS_ERROR	0x02
+#define ATA_BM_STATUS_INTR	0x04
+
+#define ATA_PROGIF_BUS_MASTER	0x80
+
+/*
+A physical region descriptor names one physically contiguous piece
+of a DMA transfer, which may not cross a 64KB boundary.  The last
+descriptor of a table is marked with ATA_PRD_EOT.  A count of zero
+means 64KB.
+*/
+
+struct ata_prd {
+	uint32_t addr;
+	uint16_t count;
+	uint16_t flags;
+};
+
+#define ATA_PRD_EOT		0x8000
+#define ATA_PRD_BOUNDARY	0x10000
+
 static const int ata_base[4] = { ATA_BASE0, ATA_BASE0, ATA_BASE1, ATA_BASE1 };
 
-static int ata_interrupt_active = 0;
-static struct list queue = { 0, 0 };
+/*
+If the PCI IDE controller can act as a bus master, disk transfers
+are done by DMA on units that support it, with one table of region
+descriptors per channel.  Otherwise, all transfers use PIO.
+*/
+
+static int ata_bm_base[2] = { 0, 0 };
+static struct ata_prd *ata_prdt[2] = { 0, 0 };
+static int ata_dma_capable[4] = { 0, 0, 0, 0 };
+static int ata_dma_enabled = 1;
+
+static int ata_lba48[4] = { 0, 0, 0, 0 };
+static int ata_multiple[4] = { 1, 1, 1, 1 };
 
-static struct mutex ata_mutex = MUTEX_INIT;
-static int identify_in_progress = 0;
+/*
+Requests for each channel are queued and carried out by a kernel
+worker process for that channel, so that the primary and secondary
+channels proceed in parallel, while the two units on a channel, which
+share one cable, take turns.  The worker serves requests in C-LOOK
+order by (unit, sector), and gathers queued requests that continue
+the one being served into a single command, using a bounce buffer of
+ATA_MERGE_MAX sectors.  The channel mutex is held whenever the
+hardware is in use, by the worker or by a process probing the unit.
+
+A transfer to or from a user-space buffer is copied through the
+channel's user_bounce page by the calling process, outside of the
+channel mutex, so that a page fault on the buffer (which may itself
+need to read from this channel) is taken normally.  user_mutex
+serializes the processes sharing that page.
+
+Each channel also raises its own interrupt when a command needs
+attention.  interrupt_pending records that the interrupt has arrived,
+so that it is not lost if it comes before the issuing process gets
+around to sleeping on interrupt_queue.  If the channel fails to
+deliver interrupts, it falls back to polling for a while (interrupt_mode
+is cleared), counting consecutive misses in interrupt_misses and polled
+steps in interrupt_polled.  identify_in_progress shortens the timeouts while a unit on
+the channel is being probed, since absent units never respond.
+*/
+
+#define ATA_MERGE_MAX		128
+#define ATA_MERGE_ORDER		4	/* bounce buffer of 2^4 pages */
+
+struct ata_channel {
+	struct list requests;
+	struct list waitqueue;
+	struct mutex mutex;
+	struct process *worker;
+	char *bounce;
+	char *user_bounce;
+	struct mutex user_mutex;
+	int cursor_unit;
+	int cursor_sector;
+	struct list interrupt_queue;
+	int interrupt_pending;
+	int interrupt_mode;
+	int interrupt_misses;
+	int interrupt_polled;
+	int identify_in_progress;
+};
+
+static struct ata_channel ata_channels[2] = {
+	{ LIST_INIT, LIST_INIT, MUTEX_INIT, 0, 0, 0, MUTEX_INIT, 0, 0, LIST_INIT, 0, 1, 0, 0, 0 },
+	{ LIST_INIT, LIST_INIT, MUTEX_INIT, 0, 0, 0, MUTEX_INIT, 0, 0, LIST_INIT, 0, 1, 0, 0, 0 },
+};
 
 static struct ata_count counters = {{0}};
 
@@ -88,10 +223,19 @@ struct ata_count ata_stats()
 	return counters;
 }
 
+static struct device_driver ata_driver;
+static struct device_driver atapi_driver;
+
 static void ata_interrupt(int intr, int code)
 {
-	ata_interrupt_active = 1;
-	process_wakeup_all(&queue);
+	int channel = (intr == ATA_IRQ1) ? 1 : 0;
+	struct ata_channel *ch = &ata_channels[channel];
+
+	/* Reading the status register acknowledges the interrupt. */
+	inb(ata_base[channel * 2] + ATA_STATUS);
+
+	ch->interrupt_pending = 1;
+	process_wakeup_all(&ch->interrupt_queue);
 }
 
 void ata_reset(int id)
@@ -104,12 +248,11 @@ void ata_reset(int id)
 
 static int ata_wait(int id, int mask, int state)
 {
-	clock_t start, elapsed;
+	struct ata_channel *ch = &ata_channels[id / 2];
 	int t;
 
-	int timeout_millis = identify_in_progress ? ATA_IDENTIFY_TIMEOUT : ATA_TIMEOUT;
-
-	start = clock_read();
+	int timeout_millis = ch->identify_in_progress ? ATA_IDENTIFY_TIMEOUT : ATA_TIMEOUT;
+	uint32_t deadline = clock_ticks() + clock_millis_to_ticks(timeout_millis);
 
 	while(1) {
 		t = inb(ata_base[id] + ATA_STATUS);
@@ -121,10 +264,8 @@ static int ata_wait(int id, int mask, int state)
 			ata_reset(id);
 			return 0;
 		}
-		elapsed = clock_diff(start, clock_read());
-		int elapsed_millis = elapsed.seconds * 1000 + elapsed.millis;
-		if(elapsed_millis > timeout_millis) {
-			if(!identify_in_progress) {
+		if((int32_t) (clock_ticks() - deadline) > 0) {
+			if(!ch->identify_in_progress) {
 				printf("ata: timeout\n");
 			}
 			ata_reset(id);
@@ -134,6 +275,58 @@ static int ata_wait(int id, int mask, int state)
 	}
 }
 
+/*
+Sleep until the interrupt for the current step of a command on
+unit id arrives.  The pending flag is cleared when the command is
+issued, and tested with interrupts blocked, so there is no window
+in which the interrupt can slip by.  The time spent waiting, and
+how much of it the processor was idle, are charged to the driver.
+Either way, the caller then checks the status register with ata_wait.
+*/
+
+static void ata_wait_interrupt(int id, struct device_driver_stats *stats)
+{
+	struct ata_channel *ch = &ata_channels[id / 2];
+
+	if(ch->identify_in_progress || !current)
+		return;
+
+	if(!ch->interrupt_mode) {
+		if(++ch->interrupt_polled < ATA_INTERRUPT_RETRY)
+			return;
+		ch->interrupt_polled = 0;
+		ch->interrupt_mode = 1;
+	}
+
+	uint32_t start = clock_ticks();
+	uint32_t idle = process_idle_ticks();
+	uint32_t deadline = start + clock_millis_to_ticks(ATA_TIMEOUT);
+	int arrived = 1;
+
+	interrupt_block();
+	while(!ch->interrupt_pending) {
+		if(!clock_wait_until(&ch->interrupt_queue, deadline)) {
+			arrived = 0;
+			break;
+		}
+		interrupt_block();
+	}
+	ch->interrupt_pending = 0;
+	interrupt_unblock();
+
+	stats->io_wait_ticks += clock_ticks() - start;
+	stats->io_idle_ticks += process_idle_ticks() - idle;
+
+	if(arrived) {
+		stats->interrupts++;
+		ch->interrupt_misses = 0;
+	} else if(++ch->interrupt_misses >= ATA_INTERRUPT_MISSES) {
+		if(ch->interrupt_misses == ATA_INTERRUPT_MISSES)
+			printf("ata: no interrupts from unit %d, falling back to polling\n", id);
+		ch->interrupt_mode = 0;
+	}
+}
+
 static void ata_pio_read(int id, void *buffer, int size)
 {
 	uint16_t *wbuffer = (uint16_t *) buffer;
@@ -154,10 +347,26 @@ static void ata_pio_write(int id, const void *buffer, int size)
 	}
 }
 
+static int ata_command_is_ext(int command)
+{
+	switch (command) {
+	case ATA_COMMAND_READ_EXT:
+	case ATA_COMMAND_WRITE_EXT:
+	case ATA_COMMAND_READ_DMA_EXT:
+	case ATA_COMMAND_WRITE_DMA_EXT:
+	case ATA_COMMAND_READ_MULTIPLE_EXT:
+	case ATA_COMMAND_WRITE_MULTIPLE_EXT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 static int ata_begin(int id, int command, int nblocks, int offset)
 {
 	int base = ata_base[id];
 	int sector, clow, chigh, flags;
+	int ext = ata_command_is_ext(command);
 
 	// enable error correction and linear addressing
 	flags = ATA_FLAGS_ECC | ATA_FLAGS_LBA | ATA_FLAGS_SEC;
@@ -170,7 +379,10 @@ static int ata_begin(int id, int command, int nblocks, int offset)
 	sector = (offset >> 0) & 0xff;
 	clow = (offset >> 8) & 0xff;
 	chigh = (offset >> 16) & 0xff;
-	flags |= (offset >> 24) & 0x0f;
+
+	// 48-bit commands take no address bits in the head register
+	if(!ext)
+		flags |= (offset >> 24) & 0x0f;
 
 	// wait for the disk to calm down
 	if(!ata_wait(id, ATA_STATUS_BSY, 0))
@@ -192,8 +404,14 @@ static int ata_begin(int id, int command, int nblocks, int offset)
 	if(!ready)
 		return 0;
 
-	// send the arguments
+	// send the arguments, high order bytes first for 48-bit commands
 	outb(0, base + ATA_CONTROL);
+	if(ext) {
+		outb((nblocks >> 8) & 0xff, base + ATA_COUNT);
+		outb((offset >> 24) & 0xff, base + ATA_SECTOR);
+		outb(0, base + ATA_CYL_LO);
+		outb(0, base + ATA_CYL_HI);
+	}
 	outb(nblocks, base + ATA_COUNT);
 	outb(sector, base + ATA_SECTOR);
 	outb(clow, base + ATA_CYL_LO);
@@ -201,47 +419,184 @@ static int ata_begin(int id, int command, int nblocks, int offset)
 	outb(flags, base + ATA_FDH);
 
 	// execute the command
+	ata_channels[id / 2].interrupt_pending = 0;
 	outb(command, base + ATA_COMMAND);
 
 	return 1;
 }
 
-static int ata_read_unlocked(int id, void *buffer, int nblocks, int offset)
+void ata_set_dma( int enable )
 {
-	int i;
-	if(!ata_begin(id, ATA_COMMAND_READ, nblocks, offset))
+	ata_dma_enabled = enable;
+}
+
+int ata_get_dma()
+{
+	return ata_dma_enabled;
+}
+
+/*
+DMA works on physical addresses, so it is only used for buffers
+in kernel memory, which is identity mapped.  Other transfers,
+such as those directly into user memory, fall back to PIO.
+*/
+
+static int ata_dma_usable(int id, const void *buffer, int length)
+{
+	uint32_t addr = (uint32_t) buffer;
+	return ata_dma_enabled && ata_dma_capable[id] && ata_bm_base[id / 2]
+		&& !(addr & 1) && addr + length <= PROCESS_ENTRY_POINT;
+}
+
+static void ata_dma_setup(int id, const void *buffer, int length, int direction)
+{
+	int bm = ata_bm_base[id / 2];
+	struct ata_prd *prd = ata_prdt[id / 2];
+	uint32_t addr = (uint32_t) buffer;
+	int n = 0;
+
+	while(length > 0) {
+		uint32_t chunk = ATA_PRD_BOUNDARY - (addr & (ATA_PRD_BOUNDARY - 1));
+		if(chunk > length)
+			chunk = length;
+		prd[n].addr = addr;
+		prd[n].count = chunk & 0xffff;
+		prd[n].flags = 0;
+		addr += chunk;
+		length -= chunk;
+		n++;
+	}
+	prd[n - 1].flags = ATA_PRD_EOT;
+
+	outl((uint32_t) prd, bm + ATA_BM_PRDT);
+	outb(direction, bm + ATA_BM_COMMAND);
+	outb(inb(bm + ATA_BM_STATUS) | ATA_BM_STATUS_ERROR | ATA_BM_STATUS_INTR, bm + ATA_BM_STATUS);
+}
+
+/*
+Transfer nblocks by DMA.  The command is issued, the bus master
+is started, and the process sleeps until the drive interrupts at the
+end of the whole transfer.  Returns nblocks, or zero on failure.
+*/
+
+static int ata_dma_transfer(int id, int command, const void *buffer, int nblocks, int offset)
+{
+	int bm = ata_bm_base[id / 2];
+	int direction = (command == ATA_COMMAND_READ_DMA || command == ATA_COMMAND_READ_DMA_EXT) ? ATA_BM_COMMAND_READ : 0;
+	uint32_t deadline;
+	int status;
+
+	ata_dma_setup(id, buffer, nblocks * ATA_BLOCKSIZE, direction);
+
+	if(!ata_begin(id, command, nblocks, offset))
 		return 0;
 
-	// XXX On fast virtual hardware, waiting for the interrupt
-	// doesn't work b/c it has already arrived before we get here.
-	// For now, busy wait until a fix is in place.
+	outb(direction | ATA_BM_COMMAND_START, bm + ATA_BM_COMMAND);
 
-	// if(ata_interrupt_active) process_wait(&queue);
+	ata_wait_interrupt(id, &ata_driver.stats);
 
-	for(i = 0; i < nblocks; i++) {
+	deadline = clock_ticks() + clock_millis_to_ticks(ATA_TIMEOUT);
+	while(!((status = inb(bm + ATA_BM_STATUS)) & ATA_BM_STATUS_INTR)) {
+		if((int32_t) (clock_ticks() - deadline) > 0)
+			break;
+		process_yield();
+	}
+
+	outb(direction, bm + ATA_BM_COMMAND);
+	outb(status | ATA_BM_STATUS_ERROR | ATA_BM_STATUS_INTR, bm + ATA_BM_STATUS);
+
+	if(!(status & ATA_BM_STATUS_INTR) || (status & ATA_BM_STATUS_ERROR))
+		return 0;
+	if(!ata_wait(id, ATA_STATUS_BSY, 0))
+		return 0;
+	if(inb(ata_base[id] + ATA_STATUS) & (ATA_STATUS_ERR | ATA_STATUS_WF))
+		return 0;
+
+	return nblocks;
+}
+
+/*
+Run a DMA transfer if possible, returning zero if PIO must be used.
+A unit on which DMA fails is reset and switched to PIO for good.
+*/
+
+static int ata_dma_try(int id, int command, const void *buffer, int nblocks, int offset)
+{
+	if(!ata_dma_usable(id, buffer, nblocks * ATA_BLOCKSIZE))
+		return 0;
+
+	int result = ata_dma_transfer(id, command, buffer, nblocks, offset);
+	if(!result) {
+		printf("ata: dma failed on unit %d, falling back to pio\n", id);
+		ata_dma_capable[id] = 0;
+		ata_reset(id);
+	}
+	return result;
+}
+
+/*
+Decide whether a transfer of nblocks at offset needs a 48-bit
+command, and how many blocks a single command may move.
+*/
+
+static int ata_use_lba48(int id, int nblocks, int offset)
+{
+	return ata_lba48[id] && (nblocks > ATA_LBA28_MAX_SECTORS || (uint32_t) offset + nblocks > ATA_LBA28_LIMIT);
+}
+
+static int ata_max_sectors(int id)
+{
+	return ata_lba48[id] ? ATA_LBA48_MAX_SECTORS : ATA_LBA28_MAX_SECTORS;
+}
+
+static int ata_read_command(int id, void *buffer, int nblocks, int offset)
+{
+	int lba48 = ata_use_lba48(id, nblocks, offset);
+	int multiple = ata_multiple[id];
+	int command, i, n;
+
+	if(ata_dma_try(id, lba48 ? ATA_COMMAND_READ_DMA_EXT : ATA_COMMAND_READ_DMA, buffer, nblocks, offset))
+		return nblocks;
+
+	if(multiple > 1) {
+		command = lba48 ? ATA_COMMAND_READ_MULTIPLE_EXT : ATA_COMMAND_READ_MULTIPLE;
+	} else {
+		command = lba48 ? ATA_COMMAND_READ_EXT : ATA_COMMAND_READ;
+	}
+
+	if(!ata_begin(id, command, nblocks, offset))
+		return 0;
+
+	// the drive interrupts as each group of up to multiple blocks is ready
+	for(i = 0; i < nblocks; i += n) {
+		n = nblocks - i;
+		if(n > multiple)
+			n = multiple;
+		ata_wait_interrupt(id, &ata_driver.stats);
 		if(!ata_wait(id, ATA_STATUS_DRQ, ATA_STATUS_DRQ))
 			return 0;
-		ata_pio_read(id, buffer, ATA_BLOCKSIZE);
-		buffer = ((char *) buffer) + ATA_BLOCKSIZE;
-		offset++;
+		ata_pio_read(id, buffer, n * ATA_BLOCKSIZE);
+		buffer = ((char *) buffer) + n * ATA_BLOCKSIZE;
 	}
 	if(!ata_wait(id, ATA_STATUS_BSY, 0))
 		return 0;
 	return nblocks;
 }
 
-int ata_read(int id, void *buffer, int nblocks, int offset)
+static int ata_read_unlocked(int id, void *buffer, int nblocks, int offset)
 {
-	int result;
-	mutex_lock(&ata_mutex);
-	result = ata_read_unlocked(id, buffer, nblocks, offset);
-	mutex_unlock(&ata_mutex);
-	counters.blocks_read[id] += nblocks;
-	if (current) {
-		current->stats.blocks_read += nblocks;
-		current->stats.bytes_read += nblocks*ATA_BLOCKSIZE;
+	int max = ata_max_sectors(id);
+	int done = 0;
+
+	while(done < nblocks) {
+		int n = nblocks - done;
+		if(n > max)
+			n = max;
+		if(!ata_read_command(id, (char *) buffer + done * ATA_BLOCKSIZE, n, offset + done))
+			return 0;
+		done += n;
 	}
-	return result;
+	return nblocks;
 }
 
 static int atapi_begin(int id, void *data, int length)
@@ -275,6 +630,7 @@ static int atapi_begin(int id, void *data, int length)
 	outb(length >> 8, base + ATAPI_COUNT_HI);
 
 	// execute the command
+	ata_channels[id / 2].interrupt_pending = 0;
 	outb(ATAPI_COMMAND_PACKET, base + ATA_COMMAND);
 
 	// wait for ready
@@ -282,6 +638,7 @@ static int atapi_begin(int id, void *data, int length)
 		return 0;
 
 	// send the ATAPI packet
+	ata_channels[id / 2].interrupt_pending = 0;
 	ata_pio_write(id, data, length);
 
 	return 1;
@@ -309,11 +666,9 @@ static int atapi_read_unlocked(int id, void *buffer, int nblocks, int offset)
 	if(!atapi_begin(id, packet, length))
 		return 0;
 
-	// XXX On fast virtual hardware, waiting for the interrupt
-	// doesn't work b/c it has already arrived before we get here.
-	// For now, busy wait until a fix is in place.
-
-	// if(ata_interrupt_active) process_wait(&queue);
+	// sleep until the drive has the data ready, which may
+	// involve a long seek, then transfer the blocks as they come
+	ata_wait_interrupt(id, &atapi_driver.stats);
 
 	for(i = 0; i < nblocks; i++) {
 		if(!ata_wait(id, ATA_STATUS_DRQ, ATA_STATUS_DRQ))
@@ -326,50 +681,317 @@ static int atapi_read_unlocked(int id, void *buffer, int nblocks, int offset)
 	return 1;
 }
 
-int atapi_read(int id, void *buffer, int nblocks, int offset)
+static int ata_write_command(int id, const void *buffer, int nblocks, int offset)
 {
-	int result;
-	mutex_lock(&ata_mutex);
-	result = atapi_read_unlocked(id, buffer, nblocks, offset);
-	mutex_unlock(&ata_mutex);
-	counters.blocks_read[id] += nblocks;
-	if (current) {
-		current->stats.blocks_read += nblocks;
-		current->stats.bytes_read += nblocks * ATAPI_BLOCKSIZE;
+	int lba48 = ata_use_lba48(id, nblocks, offset);
+	int multiple = ata_multiple[id];
+	int command, i, n;
+
+	if(ata_dma_try(id, lba48 ? ATA_COMMAND_WRITE_DMA_EXT : ATA_COMMAND_WRITE_DMA, buffer, nblocks, offset))
+		return nblocks;
+
+	if(multiple > 1) {
+		command = lba48 ? ATA_COMMAND_WRITE_MULTIPLE_EXT : ATA_COMMAND_WRITE_MULTIPLE;
+	} else {
+		command = lba48 ? ATA_COMMAND_WRITE_EXT : ATA_COMMAND_WRITE;
 	}
-	return result;
-}
 
-static int ata_write_unlocked(int id, const void *buffer, int nblocks, int offset)
-{
-	int i;
-	if(!ata_begin(id, ATA_COMMAND_WRITE, nblocks, offset))
+	if(!ata_begin(id, command, nblocks, offset))
 		return 0;
-	for(i = 0; i < nblocks; i++) {
+
+	// the drive interrupts as each group of up to multiple blocks is written
+	for(i = 0; i < nblocks; i += n) {
+		n = nblocks - i;
+		if(n > multiple)
+			n = multiple;
+		if(i > 0)
+			ata_wait_interrupt(id, &ata_driver.stats);
 		if(!ata_wait(id, ATA_STATUS_DRQ, ATA_STATUS_DRQ))
 			return 0;
-		ata_pio_write(id, buffer, ATA_BLOCKSIZE);
-		buffer = ((char *) buffer) + ATA_BLOCKSIZE;
-		offset++;
+		ata_pio_write(id, buffer, n * ATA_BLOCKSIZE);
+		buffer = ((char *) buffer) + n * ATA_BLOCKSIZE;
 	}
-	// XXX On fast virtual hardware, waiting for the interrupt
-	// doesn't work b/c it has already arrived before we get here.
-	// For now, busy wait until a fix is in place.
-
-	// if(ata_interrupt_active) process_wait(&queue);
+	ata_wait_interrupt(id, &ata_driver.stats);
 
 	if(!ata_wait(id, ATA_STATUS_BSY, 0))
 		return 0;
 	return nblocks;
 }
 
+static int ata_write_unlocked(int id, const void *buffer, int nblocks, int offset)
+{
+	int max = ata_max_sectors(id);
+	int done = 0;
+
+	while(done < nblocks) {
+		int n = nblocks - done;
+		if(n > max)
+			n = max;
+		if(!ata_write_command(id, (const char *) buffer + done * ATA_BLOCKSIZE, n, offset + done))
+			return 0;
+		done += n;
+	}
+	return nblocks;
+}
+
+/* Carry out a single request on a channel whose mutex is held. */
+
+static int ata_request_perform(struct device_request *r)
+{
+	if(r->driver == &atapi_driver) {
+		return atapi_read_unlocked(r->unit, r->buffer, r->count, r->sector) ? r->count : 0;
+	} else if(r->write) {
+		return ata_write_unlocked(r->unit, r->buffer, r->count, r->sector);
+	} else {
+		return ata_read_unlocked(r->unit, r->buffer, r->count, r->sector);
+	}
+}
+
+static void ata_request_finish(struct device_request *r, int count)
+{
+	if(r->write) {
+		counters.blocks_written[r->unit] += r->count;
+	} else {
+		counters.blocks_read[r->unit] += r->count;
+	}
+	device_request_complete(r, count);
+}
+
+static uint64_t ata_request_key(int unit, int sector)
+{
+	return ((uint64_t) unit << 32) | (uint32_t) sector;
+}
+
+/*
+C-LOOK: take the queued request nearest at or beyond the position
+where the last command ended, or else the lowest one, starting the
+next sweep.
+*/
+
+static struct device_request *ata_channel_next(struct ata_channel *ch)
+{
+	uint64_t cursor = ata_request_key(ch->cursor_unit, ch->cursor_sector);
+	struct device_request *best = 0;
+	struct device_request *lowest = 0;
+	struct list_node *n;
+
+	for(n = ch->requests.head; n; n = n->next) {
+		struct device_request *r = (struct device_request *) n;
+		uint64_t key = ata_request_key(r->unit, r->sector);
+		if(!lowest || key < ata_request_key(lowest->unit, lowest->sector))
+			lowest = r;
+		if(key >= cursor && (!best || key < ata_request_key(best->unit, best->sector)))
+			best = r;
+	}
+
+	return best ? best : lowest;
+}
+
+/* Find a queued disk request that begins where r ends, if the merged command would fit. */
+
+static struct device_request *ata_channel_follower(struct ata_channel *ch, struct device_request *r, int total)
+{
+	struct list_node *n;
+
+	if(r->driver != &ata_driver)
+		return 0;
+
+	for(n = ch->requests.head; n; n = n->next) {
+		struct device_request *f = (struct device_request *) n;
+		if(f->driver == &ata_driver && f->unit == r->unit && f->write == r->write && f->sector == r->sector + r->count && total + f->count <= ATA_MERGE_MAX)
+			return f;
+	}
+
+	return 0;
+}
+
+/*
+Take the next request from the queue, along with any that follow on
+from it, and carry them out with one command.  Merged requests are
+gathered into (or scattered from) the bounce buffer.
+*/
+
+static void ata_channel_dispatch(struct ata_channel *ch)
+{
+	struct device_request *batch[ATA_MERGE_MAX];
+	struct device_request *r;
+	int count = 0;
+	int total, result, i;
+	char *data;
+
+	r = ata_channel_next(ch);
+	list_remove(&r->node);
+	batch[count++] = r;
+	total = r->count;
+
+	if(ch->bounce) {
+		while((r = ata_channel_follower(ch, batch[count - 1], total))) {
+			list_remove(&r->node);
+			batch[count++] = r;
+			total += r->count;
+		}
+	}
+
+	r = batch[0];
+
+	mutex_lock(&ch->mutex);
+	if(count == 1) {
+		result = ata_request_perform(r);
+	} else {
+		ata_driver.stats.requests_merged += count - 1;
+		if(r->write) {
+			for(i = 0, data = ch->bounce; i < count; data += batch[i]->count * ATA_BLOCKSIZE, i++)
+				memcpy(data, batch[i]->buffer, batch[i]->count * ATA_BLOCKSIZE);
+			result = ata_write_unlocked(r->unit, ch->bounce, total, r->sector);
+		} else {
+			result = ata_read_unlocked(r->unit, ch->bounce, total, r->sector);
+			for(i = 0, data = ch->bounce; result && i < count; data += batch[i]->count * ATA_BLOCKSIZE, i++)
+				memcpy(batch[i]->buffer, data, batch[i]->count * ATA_BLOCKSIZE);
+		}
+	}
+	mutex_unlock(&ch->mutex);
+
+	ch->cursor_unit = r->unit;
+	ch->cursor_sector = r->sector + total;
+
+	for(i = 0; i < count; i++)
+		ata_request_finish(batch[i], result ? batch[i]->count : 0);
+}
+
+static void ata_channel_work(struct ata_channel *ch)
+{
+	while(1) {
+		interrupt_block();
+		while(!ch->requests.head) {
+			process_wait(&ch->waitqueue);
+			interrupt_block();
+		}
+		interrupt_unblock();
+		ata_channel_dispatch(ch);
+	}
+}
+
+static void ata_channel0_worker()
+{
+	ata_channel_work(&ata_channels[0]);
+}
+
+static void ata_channel1_worker()
+{
+	ata_channel_work(&ata_channels[1]);
+}
+
+/*
+Queue a request for the worker.  Until the worker is running,
+the request is carried out directly instead.
+*/
+
+static int ata_request_queue(struct device_request *r)
+{
+	struct ata_channel *ch = &ata_channels[r->unit / 2];
+
+	if(!ch->worker || !current) {
+		mutex_lock(&ch->mutex);
+		int result = ata_request_perform(r);
+		mutex_unlock(&ch->mutex);
+		ata_request_finish(r, result);
+		return 0;
+	}
+
+	interrupt_block();
+	list_push_tail(&ch->requests, &r->node);
+	process_wakeup(&ch->waitqueue);
+	interrupt_unblock();
+
+	return 0;
+}
+
+int ata_submit(int id, struct device_request *r)
+{
+	return ata_request_queue(r);
+}
+
+static int ata_request(struct device_driver *driver, int id, void *buffer, int nblocks, int offset, int write)
+{
+	struct device_request r;
+
+	r.buffer = buffer;
+	r.nblocks = r.count = nblocks;
+	r.offset = r.sector = offset;
+	r.write = write;
+	r.complete = 0;
+	r.arg = 0;
+	r.driver = driver;
+	r.unit = id;
+	r.multiplier = 1;
+	r.result = 0;
+	r.done = 0;
+
+	ata_request_queue(&r);
+	device_request_wait(&r);
+
+	return r.result;
+}
+
+/*
+A synchronous transfer sleeps until its request completes.
+User-space buffers are copied through the channel's user_bounce
+page by the calling process, so that any page faults are taken
+without holding the channel.
+*/
+
+static int ata_transfer(struct device_driver *driver, int id, void *buffer, int nblocks, int offset, int write)
+{
+	struct ata_channel *ch = &ata_channels[id / 2];
+	int bs = driver == &atapi_driver ? ATAPI_BLOCKSIZE : ATA_BLOCKSIZE;
+	int done, n;
+
+	if((uint32_t) buffer < PROCESS_ENTRY_POINT)
+		return ata_request(driver, id, buffer, nblocks, offset, write);
+
+	if(!ch->user_bounce)
+		return 0;
+
+	mutex_lock(&ch->user_mutex);
+	for(done = 0; done < nblocks; done += n) {
+		n = nblocks - done;
+		if(n > PAGE_SIZE / bs)
+			n = PAGE_SIZE / bs;
+		if(write)
+			memcpy(ch->user_bounce, (char *) buffer + done * bs, n * bs);
+		if(ata_request(driver, id, ch->user_bounce, n, offset + done, write) < n)
+			break;
+		if(!write)
+			memcpy((char *) buffer + done * bs, ch->user_bounce, n * bs);
+	}
+	mutex_unlock(&ch->user_mutex);
+
+	return done == nblocks ? nblocks : 0;
+}
+
+int ata_read(int id, void *buffer, int nblocks, int offset)
+{
+	int result = ata_transfer(&ata_driver, id, buffer, nblocks, offset, 0);
+	if (current) {
+		current->stats.blocks_read += nblocks;
+		current->stats.bytes_read += nblocks*ATA_BLOCKSIZE;
+	}
+	return result;
+}
+
+int atapi_read(int id, void *buffer, int nblocks, int offset)
+{
+	int result = ata_transfer(&atapi_driver, id, buffer, nblocks, offset, 0);
+	if (current) {
+		current->stats.blocks_read += nblocks;
+		current->stats.bytes_read += nblocks * ATAPI_BLOCKSIZE;
+	}
+	return result;
+}
+
 int ata_write(int id, const void *buffer, int nblocks, int offset)
 {
-	int result;
-	mutex_lock(&ata_mutex);
-	result = ata_write_unlocked(id, buffer, nblocks, offset);
-	mutex_unlock(&ata_mutex);
-	counters.blocks_written[id] += nblocks;
+	int result = ata_transfer(&ata_driver, id, (void *) buffer, nblocks, offset, 1);
 	if (current) {
 		current->stats.blocks_written += nblocks;
 		current->stats.bytes_written += nblocks * ATA_BLOCKSIZE;
@@ -387,18 +1009,43 @@ the the device is simply not connected.
 
 static int ata_identify(int id, int command, void *buffer)
 {
+	struct ata_channel *ch = &ata_channels[id / 2];
 	int result;
-	identify_in_progress = 1;
+	ch->identify_in_progress = 1;
 	if(ata_begin(id, command, 0, 0) && ata_wait(id, ATA_STATUS_DRQ, ATA_STATUS_DRQ)) {
 		ata_pio_read(id, buffer, 512);
 		result = 1;
 	} else {
 		result = 0;
 	}
-	identify_in_progress = 0;
+	ch->identify_in_progress = 0;
 	return result;
 }
 
+/*
+Ask the drive to move up to ATA_MULTIPLE blocks per data request
+for the READ/WRITE MULTIPLE commands, within the limit that it
+reports in the identify data.  Returns the setting in effect.
+*/
+
+static int ata_set_multiple(int id, int max)
+{
+	int count = max & 0xff;
+
+	if(count > ATA_MULTIPLE)
+		count = ATA_MULTIPLE;
+	if(count < 2)
+		return 1;
+
+	if(!ata_begin(id, ATA_COMMAND_SET_MULTIPLE, count, 0))
+		return 1;
+	if(!ata_wait(id, ATA_STATUS_BSY, 0))
+		return 1;
+	if(inb(ata_base[id] + ATA_STATUS) & ATA_STATUS_ERR)
+		return 1;
+
+	return count;
+}
 
 static int ata_probe_internal( int id, int kind, int *nblocks, int *blocksize, char *name )
 {
@@ -429,11 +1076,21 @@ static int ata_probe_internal( int id, int kind, int *nblocks, int *blocksize, c
 	if(kind==ATA_COMMAND_IDENTIFY || kind==0) {
 		result = ata_identify(id, ATA_COMMAND_IDENTIFY, cbuffer);
 		if(result) {
-			*nblocks = buffer[1] * buffer[3] * buffer[6];
+			ata_dma_capable[id] = (buffer[ATA_IDENTIFY_CAPABILITIES] & ATA_CAPABILITY_DMA) ? 1 : 0;
+			ata_lba48[id] = (buffer[ATA_IDENTIFY_COMMAND_SETS] & ATA_COMMAND_SET_LBA48) ? 1 : 0;
+			if(ata_lba48[id]) {
+				// the upper 32 bits of the 48-bit count are ignored, as nblocks is an int
+				*nblocks = buffer[ATA_IDENTIFY_LBA48_SECTORS] | (buffer[ATA_IDENTIFY_LBA48_SECTORS + 1] << 16);
+			} else if(buffer[ATA_IDENTIFY_CAPABILITIES] & ATA_CAPABILITY_LBA) {
+				*nblocks = buffer[ATA_IDENTIFY_LBA28_SECTORS] | (buffer[ATA_IDENTIFY_LBA28_SECTORS + 1] << 16);
+			} else {
+				*nblocks = buffer[1] * buffer[3] * buffer[6];
+			}
 			printf("%d logical cylinders\n", buffer[1]);
 			printf("%d logical heads\n", buffer[3]);
 			printf("%d logical sectors/track\n", buffer[6]);
 			*blocksize = ATA_BLOCKSIZE;
+			ata_multiple[id] = ata_set_multiple(id, buffer[ATA_IDENTIFY_MULTIPLE_MAX]);
 		}
 	}
 
@@ -467,22 +1124,35 @@ static int ata_probe_internal( int id, int kind, int *nblocks, int *blocksize, c
 	/* Get disk size in megabytes*/
 	uint32_t mbytes = (*nblocks) / KILO * (*blocksize) / KILO;
 
-	printf("%s unit %d: %s %u sectors %u MB %s\n",
+	printf("%s unit %d: %s %u sectors %u MB %s %s %s multiple %d\n",
 	       (*blocksize)==512 ? "ata" : "atapi",
 	       id,
 	       (*blocksize)==512 ? "disk" : "cdrom",
-	       *nblocks, mbytes, name);
+	       *nblocks, mbytes, name,
+	       (ata_dma_capable[id] && ata_bm_base[id / 2]) ? "dma" : "pio",
+	       ata_lba48[id] ? "lba48" : "lba28",
+	       ata_multiple[id]);
 	return 1;
 }
 
+static int ata_probe_locked( int id, int kind, int *nblocks, int *blocksize, char *name )
+{
+	struct ata_channel *ch = &ata_channels[id / 2];
+	int result;
+	mutex_lock(&ch->mutex);
+	result = ata_probe_internal(id,kind,nblocks,blocksize,name);
+	mutex_unlock(&ch->mutex);
+	return result;
+}
+
 int ata_probe( int id, int *nblocks, int *blocksize, char *name )
 {
-	return ata_probe_internal(id,ATA_COMMAND_IDENTIFY,nblocks,blocksize,name);
+	return ata_probe_locked(id,ATA_COMMAND_IDENTIFY,nblocks,blocksize,name);
 }
 
 int atapi_probe( int id, int *nblocks, int *blocksize, char *name )
 {
-	return ata_probe_internal(id,ATAPI_COMMAND_IDENTIFY,nblocks,blocksize,name);
+	return ata_probe_locked(id,ATAPI_COMMAND_IDENTIFY,nblocks,blocksize,name);
 }
 
 static struct device_driver ata_driver = {
@@ -491,6 +1161,7 @@ static struct device_driver ata_driver = {
 	.read          = ata_read,
 	.read_nonblock = ata_read,
 	.write         = ata_write,
+	.submit        = ata_submit,
 	.multiplier    = 8
 };
 
@@ -499,8 +1170,40 @@ static struct device_driver atapi_driver = {
 	.probe         = atapi_probe,
 	.read          = atapi_read,
 	.read_nonblock = atapi_read,
+	.submit        = ata_submit,
 };
 
+/*
+Find the PCI IDE controller, and if it supports bus mastering,
+enable it and allocate a descriptor table for each channel.
+*/
+
+static void ata_dma_init()
+{
+	struct pci_device *d = pci_find(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE);
+	if(!d) {
+		printf("ata: no pci ide controller\n");
+		return;
+	}
+
+	uint32_t bar = pci_config_read(d, PCI_CONFIG_BAR4);
+	if(!(d->progif & ATA_PROGIF_BUS_MASTER) || !(bar & 1) || !(bar & 0xfffc)) {
+		printf("ata: ide controller does not support dma\n");
+		return;
+	}
+
+	uint32_t command = pci_config_read(d, PCI_CONFIG_COMMAND) & 0xffff;
+	pci_config_write(d, PCI_CONFIG_COMMAND, command | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+	int c;
+	for(c = 0; c < 2; c++) {
+		ata_prdt[c] = page_alloc(1);
+		ata_bm_base[c] = (bar & 0xfffc) + c * 8;
+	}
+
+	printf("ata: bus master dma at port %x\n", bar & 0xfffc);
+}
+
 void ata_init()
 {
 	int i;
@@ -522,12 +1225,28 @@ void ata_init()
 	interrupt_register(ATA_IRQ1, ata_interrupt);
 	interrupt_enable(ATA_IRQ1);
 
+	ata_dma_init();
+
 	printf("ata: probing devices\n");
 
 	for(i = 0; i < 4; i++) {
 		ata_probe_internal(i, 0, &nblocks, &blocksize, longname);
 	}
 
+	for(i = 0; i < 2; i++) {
+		ata_channels[i].bounce = page_alloc_n(ATA_MERGE_ORDER, 0);
+		if(!ata_channels[i].bounce)
+			printf("ata: couldn't allocate merge buffer for channel %d\n", i);
+		ata_channels[i].user_bounce = page_alloc(0);
+		if(!ata_channels[i].user_bounce)
+			printf("ata: couldn't allocate bounce buffer for channel %d\n", i);
+	}
+
+	ata_channels[0].worker = process_create_kthread(ata_channel0_worker);
+	ata_channels[1].worker = process_create_kthread(ata_channel1_worker);
+	process_launch(ata_channels[0].worker);
+	process_launch(ata_channels[1].worker);
+
 	device_driver_register(&ata_driver);
 	device_driver_register(&atapi_driver);
 }
@@ -29,4 +29,9 @@ int ata_write(int unit, const void *buffer, int nblocks, int offset);
 int atapi_probe(int unit, int *nblocks, int *blocksize, char *name);
 int atapi_read(int unit, void *buffer, int nblocks, int offset);
 
+int ata_submit(int unit, struct device_request *r);
+
+void ata_set_dma(int enable);
+int  ata_get_dma();
+
 #endif
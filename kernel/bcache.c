@@ -7,32 +7,179 @@ See the file LICENSE for details.
 #include "bcache.h"
 #include "list.h"
 #include "page.h"
-#include "kmalloc.h"
+#include "slab.h"
 #include "string.h"
+#include "interrupt.h"
+#include "process.h"
+#include "mutex.h"
+#include "clock.h"
 #include "kernel/error.h"
 
+/*
+The buffer cache keeps each cached block on two structures at once:
+an LRU list ordered from most-recently-used (head) to least (tail),
+and a hash table indexed by (device,block) that makes lookups O(1).
+A hit moves the entry to the head of the list, and eviction takes
+from the tail, so the cache can be made large without lookups
+dominating the cost of each block access.
+*/
+
+#define BCACHE_HASH_BITS 12
+#define BCACHE_HASH_BUCKETS (1<<BCACHE_HASH_BITS)
+#define BCACHE_HASH_GOLDEN_RATIO 0x61C88647
+
+#define BCACHE_MIN_SIZE 100
+#define BCACHE_MAX_SIZE 4096
+
+/*
+Dirty blocks are written back in the background by a kernel flusher
+process, which wakes up every BCACHE_FLUSH_INTERVAL milliseconds.
+It writes any block that has been dirty for longer than
+BCACHE_DIRTY_EXPIRE milliseconds, and if more than BCACHE_DIRTY_RATIO
+percent of the cache is dirty, it writes least-recently-used dirty
+blocks until half that ratio remains.  The flusher submits each
+block as an asynchronous device request, leaving the driver to merge
+adjacent blocks and order the writes.  An explicit flush instead
+gathers contiguous dirty blocks on the same device into a single
+device_write of up to BCACHE_FLUSH_BATCH blocks.
+*/
+
+#define BCACHE_FLUSH_INTERVAL 250
+#define BCACHE_DIRTY_EXPIRE 3000
+#define BCACHE_DIRTY_RATIO 10
+#define BCACHE_FLUSH_BATCH 16
+
+/*
+A multi-block read (see bcache_read) reads each run of missing blocks
+with a single device_read of up to BCACHE_FILL_BATCH blocks.
+*/
+
+#define BCACHE_FILL_BATCH 16
+
+/*
+A block whose write-back fails is kept dirty and retried, but after
+BCACHE_WRITE_RETRIES consecutive failures it is reported and treated
+as clean, so that a failing device cannot pin it in the cache forever.
+*/
+
+#define BCACHE_WRITE_RETRIES 3
+
+/* The fill and flush buffers are each 2^BCACHE_BUFFER_ORDER pages. */
+
+#define BCACHE_BUFFER_ORDER 4
+
 struct bcache_entry {
 	struct list_node node;
+	struct bcache_entry *hash_next;
 	struct device *device;
 	int block;
+	int refcount;
 	int dirty;
+	uint32_t dirty_time;
+	int valid;
+	int busy;
+	int readahead;
+	int write_errors;
 	char *data;
+	struct device_request request;
 };
 
+static struct slab_cache bcache_entry_cache = SLAB_CACHE_INIT("bcache_entry", sizeof(struct bcache_entry), 0);
+
 static struct list cache = LIST_INIT;
+static struct list bcache_queue = LIST_INIT;
+static struct bcache_entry *hash_table[BCACHE_HASH_BUCKETS] = {0};
 static struct bcache_stats stats = {0};
-static int max_cache_size = 100;
+static int max_cache_size = BCACHE_MIN_SIZE;
+
+static char *flush_buffer = 0;
+static struct mutex flush_mutex = MUTEX_INIT;
+
+static char *fill_buffer = 0;
+static struct mutex fill_mutex = MUTEX_INIT;
+
+static void bcache_flusher();
+
+/*
+Size the cache as a fraction of physical memory at startup,
+so that small machines are not starved of pages by the cache.
+*/
+
+void bcache_init()
+{
+	uint32_t nfree, ntotal;
+	page_stats(&nfree,&ntotal);
+
+	max_cache_size = nfree/4;
+	if(max_cache_size<BCACHE_MIN_SIZE) max_cache_size = BCACHE_MIN_SIZE;
+	if(max_cache_size>BCACHE_MAX_SIZE) max_cache_size = BCACHE_MAX_SIZE;
+
+	printf("bcache: %d blocks max\n",max_cache_size);
+
+	fill_buffer = page_alloc_n(BCACHE_BUFFER_ORDER,0);
+	if(!fill_buffer) {
+		printf("bcache: couldn't allocate fill buffer!\n");
+	}
+
+	flush_buffer = page_alloc_n(BCACHE_BUFFER_ORDER,0);
+	if(flush_buffer) {
+		process_launch(process_create_kthread(bcache_flusher));
+	} else {
+		printf("bcache: couldn't start flusher!\n");
+	}
+}
+
+static uint32_t bcache_millis()
+{
+	clock_t t = clock_read();
+	return t.seconds*1000 + t.millis;
+}
+
+static unsigned bcache_hash( struct device *device, int block )
+{
+	unsigned key = ((unsigned)device>>4) + block;
+	return (key*BCACHE_HASH_GOLDEN_RATIO) >> (32-BCACHE_HASH_BITS);
+}
+
+static void bcache_hash_insert( struct bcache_entry *e )
+{
+	unsigned h = bcache_hash(e->device,e->block);
+	e->hash_next = hash_table[h];
+	hash_table[h] = e;
+}
+
+static void bcache_hash_remove( struct bcache_entry *e )
+{
+	struct bcache_entry **p = &hash_table[bcache_hash(e->device,e->block)];
+
+	while(*p) {
+		if(*p==e) {
+			*p = e->hash_next;
+			e->hash_next = 0;
+			return;
+		}
+		p = &(*p)->hash_next;
+	}
+}
 
 struct bcache_entry * bcache_entry_create( struct device *device, int block )
 {
-	struct bcache_entry *e = kmalloc(sizeof(*e));
+	struct bcache_entry *e = slab_alloc(&bcache_entry_cache);
 	if(!e) return 0;
 
 	e->device = device;
 	e->block = block;
+	e->dirty = 0;
+	e->dirty_time = 0;
+	e->valid = 0;
+	e->busy = 0;
+	e->readahead = 0;
+	e->write_errors = 0;
+	e->refcount = 0;
+	e->hash_next = 0;
 	e->data = page_alloc(1);
 	if(!e->data) {
-		kfree(e);
+		slab_free(&bcache_entry_cache,e);
 		return 0;
 	}
 
@@ -44,39 +191,135 @@ void bcache_entry_delete( struct bcache_entry *e )
 {
 	if(e) {
 		if(e->data) page_free(e->data);
-		kfree(e);
+		slab_free(&bcache_entry_cache,e);
 	}
 }
 
-void bcache_entry_clean( struct bcache_entry *e )
+/* Track the number of dirty entries and when each became dirty. */
+
+static void bcache_entry_set_dirty( struct bcache_entry *e )
+{
+	if(!e->dirty) {
+		e->dirty = 1;
+		e->dirty_time = bcache_millis();
+		stats.dirty_blocks++;
+	}
+}
+
+static void bcache_entry_set_clean( struct bcache_entry *e )
 {
 	if(e->dirty) {
-		device_write(e->device,e->data,1,e->block);
-		// XXX How to deal with failure here?
 		e->dirty = 0;
-		stats.writebacks++;
+		stats.dirty_blocks--;
 	}
+}
+
+/*
+Record the outcome of writing back an entry that was marked clean
+when the write began.  A failed entry is dirtied again to be retried,
+unless it has already failed BCACHE_WRITE_RETRIES times in a row.
+Returns true if the entry is left dirty.
+*/
 
+static int bcache_entry_written( struct bcache_entry *e, int result )
+{
+	if(result>0) {
+		e->write_errors = 0;
+		return 0;
+	}
+
+	stats.write_errors++;
+	e->write_errors++;
+
+	if(e->write_errors>=BCACHE_WRITE_RETRIES) {
+		printf("bcache: giving up writing block %d of %s unit %d\n",e->block,device_name(e->device),device_unit(e->device));
+		stats.write_abandoned++;
+		e->write_errors = 0;
+		return 0;
+	}
+
+	bcache_entry_set_dirty(e);
+	return 1;
+}
+
+/*
+Write back a dirty entry.  The dirty bit is cleared before the write
+begins, so that a modification made while the device is busy leaves
+the entry dirty for the next writeback rather than being lost.
+Returns false if the write failed and the entry remains dirty.
+*/
+
+int bcache_entry_clean( struct bcache_entry *e )
+{
+	if(e->dirty) {
+		bcache_entry_set_clean(e);
+		int result = device_write(e->device,e->data,1,e->block);
+		if(bcache_entry_written(e,result)) return 0;
+		if(result>0) stats.writebacks++;
+	}
+
+	return 1;
 }
 
+/* Remove an entry from both the LRU list and the hash table, then free it. */
+
+static void bcache_entry_evict( struct bcache_entry *e )
+{
+	if(e->readahead) stats.readahead_wasted++;
+	list_remove(&e->node);
+	bcache_hash_remove(e);
+	bcache_entry_delete(e);
+}
+
+/* Wait until any I/O filling this entry has completed. */
+
+static void bcache_entry_wait( struct bcache_entry *e )
+{
+	interrupt_block();
+	while(e->busy) {
+		process_wait(&bcache_queue);
+		interrupt_block();
+	}
+	interrupt_unblock();
+}
+
+/*
+Evict least-recently-used entries until the cache is within bounds.
+Pinned entries are skipped.  Writing back a dirty entry may block,
+so the entry is pinned during the write and the scan starts over
+from the tail afterwards, since the list may have changed meanwhile.
+If every entry is pinned, or a write-back fails, the cache is allowed
+to grow temporarily rather than retrying at once.
+*/
+
 void bcache_trim()
 {
+	struct list_node *n;
 	struct bcache_entry *e;
 
 	while(list_size(&cache)>max_cache_size) {
-		e = (struct bcache_entry *) list_pop_tail(&cache);
-		bcache_entry_clean(e);
-		bcache_entry_delete(e);
+		for(n=cache.tail;n;n=n->prev) {
+			e = (struct bcache_entry *) n;
+			if(e->refcount==0) break;
+		}
+		if(!n) break;
+
+		if(e->dirty) {
+			e->refcount++;
+			int ok = bcache_entry_clean(e);
+			e->refcount--;
+			if(!ok) break;
+		} else {
+			bcache_entry_evict(e);
+		}
 	}
 }
 
 struct bcache_entry * bcache_find( struct device *device, int block )
 {
-	struct list_node *n;
 	struct bcache_entry *e;
 
-	for(n=cache.head;n;n=n->next) {
-		e = (struct bcache_entry *)n;
+	for(e=hash_table[bcache_hash(device,block)];e;e=e->hash_next) {
 		if(e->device==device && e->block==block) {
 			return e;
 		}
@@ -85,74 +328,324 @@ struct bcache_entry * bcache_find( struct device *device, int block )
 	return 0;
 }
 
+/*
+Find or create the entry for a block, and return it pinned.
+The entry is pinned before trimming, so that a newly created
+entry cannot be chosen as the victim of its own insertion.
+*/
+
 struct bcache_entry * bcache_find_or_create( struct device *device, int block, int *was_a_hit )
 {
 	struct bcache_entry *e = bcache_find(device,block);
 	if(e) {
 		*was_a_hit = 1;
+		/* Promote the entry to most-recently-used. */
+		list_remove(&e->node);
+		list_push_head(&cache,&e->node);
 	} else {
 		*was_a_hit = 0;
 		e = bcache_entry_create(device,block);
 		if(!e) return 0;
 		list_push_head(&cache,&e->node);
+		bcache_hash_insert(e);
 	}
 
+	e->refcount++;
+
 	bcache_trim();
 
 	return e;
 }
 
-int bcache_read_block( struct device *device, char *data, int block )
+/*
+Return a pinned entry for the given block.  If fill is true, the
+block contents are read from the device if not already present.
+If another process is already filling the entry, wait for it.
+If the device read fails, the entry is unhashed so that it will
+not be found again, and is freed when its last pin is released.
+So, after waiting, an entry that is no longer in the hash table is
+released and the lookup is repeated, rather than filled again.
+*/
+
+static struct bcache_entry * bcache_acquire( struct device *device, int block, int fill, int *was_a_hit )
 {
-	int hit=0;
-	int result;
+	struct bcache_entry *e;
 
-	struct bcache_entry *e = bcache_find_or_create(device,block,&hit);
-	if(!e) return KERROR_OUT_OF_MEMORY;
+	while(1) {
+		e = bcache_find_or_create(device,block,was_a_hit);
+		if(!e) return 0;
+
+		bcache_entry_wait(e);
+		if(bcache_find(device,block)==e) break;
+
+		bcache_put(e);
+	}
+
+	if(fill && !e->valid) {
+		e->busy = 1;
+		int result = device_read(device,e->data,1,block);
+		e->busy = 0;
+		process_wakeup_all(&bcache_queue);
+
+		if(result>0) {
+			e->valid = 1;
+		} else {
+			bcache_hash_remove(e);
+			bcache_put(e);
+			return 0;
+		}
+	}
+
+	return e;
+}
+
+struct bcache_entry * bcache_get( struct device *device, int block )
+{
+	int hit;
+
+	struct bcache_entry *e = bcache_acquire(device,block,1,&hit);
+	if(!e) return 0;
 
 	if(hit) {
 		stats.read_hits++;
-		result = 1;
 	} else {
 		stats.read_misses++;
-		result = device_read(device,e->data,1,block);
 	}
 
-	if(result>0) {
-		memcpy(data,e->data,device_block_size(device));
+	if(e->readahead) {
+		stats.readahead_hits++;
+		e->readahead = 0;
+	}
+
+	return e;
+}
+
+void * bcache_data( struct bcache_entry *e )
+{
+	return e->data;
+}
+
+void bcache_mark_dirty( struct bcache_entry *e )
+{
+	bcache_entry_set_dirty(e);
+}
+
+void bcache_put( struct bcache_entry *e )
+{
+	e->refcount--;
+	if(e->refcount==0 && !e->valid) {
+		bcache_entry_evict(e);
+	}
+}
+
+/*
+Read a run of consecutive entries, which the caller has pinned and
+marked busy, with a single device_read, then scatter the data into
+the entries (and into data, if not null) and release them.
+Returns the number of blocks read.
+*/
+
+static int bcache_fill_run( struct device *device, struct bcache_entry **run, int start, int count, char *data )
+{
+	int bs = device_block_size(device);
+	int i;
+
+	mutex_lock(&fill_mutex);
+
+	int result = device_read(device,fill_buffer,count,start);
+
+	if(result>0 && data) {
+		memcpy(data,fill_buffer,count*bs);
+	}
+
+	for(i=0;i<count;i++) {
+		struct bcache_entry *e = run[i];
+		if(result>0) {
+			memcpy(e->data,&fill_buffer[i*bs],bs);
+			e->valid = 1;
+			e->readahead = 0;
+		} else {
+			bcache_hash_remove(e);
+		}
+		e->busy = 0;
+	}
+
+	mutex_unlock(&fill_mutex);
+
+	process_wakeup_all(&bcache_queue);
+
+	for(i=0;i<count;i++) {
+		bcache_put(run[i]);
+	}
+
+	return result>0 ? count : 0;
+}
+
+/*
+Asynchronous I/O on a single entry, which the caller has pinned and
+marked busy.  The completion functions run when the device finishes,
+possibly in another process, and release the entry.
+*/
+
+static void bcache_fill_complete( struct device_request *r )
+{
+	struct bcache_entry *e = r->arg;
+
+	if(r->result>0) {
+		e->valid = 1;
+		e->readahead = 1;
 	} else {
-		list_remove(&e->node);
-		bcache_entry_delete(e);
+		bcache_hash_remove(e);
 	}
+	e->busy = 0;
 
-	return result;
+	process_wakeup_all(&bcache_queue);
+	bcache_put(e);
 }
 
+static void bcache_writeback_complete( struct device_request *r )
+{
+	struct bcache_entry *e = r->arg;
+
+	if(r->result>0) stats.writebacks++;
+	bcache_entry_written(e,r->result);
+	e->busy = 0;
+
+	process_wakeup_all(&bcache_queue);
+	bcache_put(e);
+}
+
+static void bcache_entry_submit( struct bcache_entry *e, int write, void (*complete)( struct device_request *r ) )
+{
+	struct device_request *r = &e->request;
+
+	r->buffer = e->data;
+	r->nblocks = 1;
+	r->offset = e->block;
+	r->write = write;
+	r->complete = complete;
+	r->arg = e;
+
+	if(device_submit(e->device,r)<0) {
+		r->result = 0;
+		complete(r);
+	}
+}
+
+/*
+Start bringing the blocks [block,block+nblocks) into the cache,
+skipping any that are already present or being read by someone else.
+Each missing block is submitted as an asynchronous request, and the
+driver merges adjacent requests, so this returns without waiting.
+Blocks brought in this way are counted as a read-ahead hit when
+first used, or as wasted if evicted before being used.
+*/
+
+int bcache_readahead( struct device *device, int block, int nblocks )
+{
+	int total = 0;
+	int hit, i;
+
+	if(device_block_size(device)>PAGE_SIZE) return 0;
+
+	if(block+nblocks>device_nblocks(device)) {
+		nblocks = device_nblocks(device)-block;
+	}
+
+	for(i=0;i<nblocks;i++) {
+		struct bcache_entry *e = bcache_find_or_create(device,block+i,&hit);
+		if(!e) break;
+
+		if(e->valid || e->busy) {
+			bcache_put(e);
+			continue;
+		}
+
+		e->busy = 1;
+		bcache_entry_submit(e,0,bcache_fill_complete);
+		total++;
+	}
+
+	stats.readahead_blocks += total;
+
+	return total;
+}
+
+int bcache_read_block( struct device *device, char *data, int block )
+{
+	struct bcache_entry *e = bcache_get(device,block);
+	if(!e) return 0;
+
+	memcpy(data,e->data,device_block_size(device));
+	bcache_put(e);
+
+	return 1;
+}
+
+/*
+Read a range of blocks, issuing one device_read for each run of
+blocks missing from the cache.  Blocks that are already cached are
+copied out directly; a block being filled by another process ends
+the current run and is waited for via bcache_read_block.
+*/
+
 int bcache_read( struct device *device, char *data, int blocks, int offset )
 {
-	int i,r;
-	int count = 0;
+	struct bcache_entry *run[BCACHE_FILL_BATCH];
 	int bs = device_block_size(device);
+	int total = 0;
+	int count = 0;
+	int hit, i, r;
+
+	if(blocks==1 || !fill_buffer || bs>PAGE_SIZE) {
+		for(i=0;i<blocks;i++) {
+			if(bcache_read_block(device,&data[i*bs],offset+i)<1) break;
+		}
+		return i;
+	}
 
 	for(i=0;i<blocks;i++) {
-		r = bcache_read_block(device,&data[i*bs],offset+i);
-		if(r<1) break;
-		count++;
+		struct bcache_entry *e = bcache_find_or_create(device,offset+i,&hit);
+		if(!e) break;
+
+		if(!e->valid && !e->busy) {
+			stats.read_misses++;
+			e->busy = 1;
+			run[count++] = e;
+			if(count==BCACHE_FILL_BATCH) {
+				r = bcache_fill_run(device,run,offset+i+1-count,count,&data[(i+1-count)*bs]);
+				if(r<count) return total;
+				total += r;
+				count = 0;
+			}
+			continue;
+		}
+
+		bcache_put(e);
+
+		if(count>0) {
+			r = bcache_fill_run(device,run,offset+i-count,count,&data[(i-count)*bs]);
+			if(r<count) return total;
+			total += r;
+			count = 0;
+		}
+
+		if(bcache_read_block(device,&data[i*bs],offset+i)<1) return total;
+		total++;
 	}
 
 	if(count>0) {
-		return count;
-	} else {
-		return r;
+		total += bcache_fill_run(device,run,offset+i-count,count,&data[(i-count)*bs]);
 	}
-}
 
+	return total;
+}
 
 int bcache_write_block( struct device *device, const char *data, int block )
 {
 	int hit;
 
-	struct bcache_entry *e = bcache_find_or_create(device,block,&hit);
+	struct bcache_entry *e = bcache_acquire(device,block,0,&hit);
 	if(!e) return KERROR_OUT_OF_MEMORY;
 
 	if(hit) {
@@ -162,59 +655,322 @@ int bcache_write_block( struct device *device, const char *data, int block )
 	}
 
 	memcpy(e->data,data,device_block_size(device));
-	e->dirty = 1;
+	e->readahead = 0;
+	e->valid = 1;
+	bcache_entry_set_dirty(e);
+	bcache_put(e);
 
 	return 1;
 }
 
+/*
+Write a run of consecutive entries, which the caller has pinned,
+marked busy, and filled with new data, using a single device_write.
+If the write fails, the entries are left dirty for the flusher to
+retry, as bcache_entry_written allows.  Either way, the entries are
+released.
+*/
+
+static void bcache_write_run( struct device *device, struct bcache_entry **run, int start, int count )
+{
+	int bs = device_block_size(device);
+	int i;
+
+	mutex_lock(&flush_mutex);
+
+	for(i=0;i<count;i++) {
+		memcpy(&flush_buffer[i*bs],run[i]->data,bs);
+		bcache_entry_set_clean(run[i]);
+	}
+
+	int result = device_write(device,flush_buffer,count,start);
+
+	for(i=0;i<count;i++) {
+		bcache_entry_written(run[i],result);
+		run[i]->busy = 0;
+	}
+
+	if(result>0) {
+		stats.writebacks += count;
+		stats.flush_writes++;
+	}
+
+	mutex_unlock(&flush_mutex);
+
+	process_wakeup_all(&bcache_queue);
+
+	for(i=0;i<count;i++) {
+		bcache_put(run[i]);
+	}
+}
+
+/*
+Write a range of blocks.  A single block is simply cached and marked
+dirty, but a multi-block write goes through the cache to the device
+with one device_write per run of up to BCACHE_FLUSH_BATCH blocks,
+rather than leaving each block for the flusher.  Returns the number
+of blocks accepted into the cache.
+*/
+
 int bcache_write( struct device *device, const char *data, int blocks, int offset )
 {
-	int i,r;
-	int count = 0;
+	struct bcache_entry *run[BCACHE_FLUSH_BATCH];
 	int bs = device_block_size(device);
+	int count = 0;
+	int hit, i;
+
+	if(blocks==1 || !flush_buffer || bs>PAGE_SIZE) {
+		for(i=0;i<blocks;i++) {
+			if(bcache_write_block(device,&data[i*bs],offset+i)<1) break;
+		}
+		return i;
+	}
 
 	for(i=0;i<blocks;i++) {
-		r = bcache_write_block(device,&data[i*bs],offset+i);
-		if(r<1) break;
-		count++;
+		struct bcache_entry *e = bcache_find_or_create(device,offset+i,&hit);
+		if(!e) break;
+
+		if(!e->busy) {
+			if(hit) {
+				stats.write_hits++;
+			} else {
+				stats.write_misses++;
+			}
+			e->busy = 1;
+			memcpy(e->data,&data[i*bs],bs);
+			e->readahead = 0;
+			e->valid = 1;
+			run[count++] = e;
+			if(count==BCACHE_FLUSH_BATCH) {
+				bcache_write_run(device,run,offset+i+1-count,count);
+				count = 0;
+			}
+			continue;
+		}
+
+		bcache_put(e);
+
+		if(count>0) {
+			bcache_write_run(device,run,offset+i-count,count);
+			count = 0;
+		}
+
+		if(bcache_write_block(device,&data[i*bs],offset+i)<1) break;
 	}
 
 	if(count>0) {
-		return count;
-	} else {
-		return r;
+		bcache_write_run(device,run,offset+i-count,count);
 	}
+
+	return i;
+}
+
+static int bcache_entry_flushable( struct bcache_entry *e )
+{
+	return e && e->dirty && e->valid && !e->busy;
 }
 
+/*
+Write back the dirty entry e together with any dirty neighbors
+that form a contiguous run of blocks on the same device, using a
+single device_write.  All entries in the run are pinned while the
+write is in progress.  Returns the number of blocks written.
+*/
+
+static int bcache_flush_run( struct bcache_entry *e )
+{
+	struct bcache_entry *run[BCACHE_FLUSH_BATCH];
+	struct device *device = e->device;
+	int bs = device_block_size(device);
+	int start, count, i;
+
+	if(!flush_buffer || bs>PAGE_SIZE) {
+		e->refcount++;
+		bcache_entry_clean(e);
+		bcache_put(e);
+		return 1;
+	}
+
+	mutex_lock(&flush_mutex);
+
+	/* The entry may have been cleaned while waiting for the buffer. */
+	if(!bcache_entry_flushable(e)) {
+		mutex_unlock(&flush_mutex);
+		return 0;
+	}
+
+	start = e->block;
+	while(start>0 && start>e->block-(BCACHE_FLUSH_BATCH-1) && bcache_entry_flushable(bcache_find(device,start-1))) {
+		start--;
+	}
+
+	for(count=0;count<BCACHE_FLUSH_BATCH;count++) {
+		struct bcache_entry *f = bcache_find(device,start+count);
+		if(!bcache_entry_flushable(f)) break;
+		run[count] = f;
+	}
+
+	for(i=0;i<count;i++) {
+		run[i]->refcount++;
+		memcpy(&flush_buffer[i*bs],run[i]->data,bs);
+		bcache_entry_set_clean(run[i]);
+	}
+
+	int result = device_write(device,flush_buffer,count,start);
+
+	for(i=0;i<count;i++) {
+		bcache_entry_written(run[i],result);
+		bcache_put(run[i]);
+	}
+
+	if(result>0) {
+		stats.writebacks += count;
+		stats.flush_writes++;
+	}
+
+	mutex_unlock(&flush_mutex);
+
+	return result>0 ? count : 0;
+}
 
 void bcache_flush_block( struct device *device, int block )
 {
 	struct bcache_entry *e;
 	e = bcache_find(device,block);
-	if(e) bcache_entry_clean(e);
+	if(e) {
+		e->refcount++;
+		bcache_entry_wait(e);
+		bcache_entry_clean(e);
+		bcache_put(e);
+	}
 }
 
+/*
+Each entry is pinned while it is written back, so that it remains
+on the list (and its successor pointer remains meaningful) even if
+the write blocks and other processes use the cache in the meantime.
+An entry with a background write in progress is waited for, since
+it may have been dirtied again in the meantime.
+*/
+
 void bcache_flush_device( struct device *device )
 {
-	struct list_node *n;
+	struct list_node *n, *next;
+	struct bcache_entry *e;
+
+	for(n=cache.head;n;n=next) {
+		e = (struct bcache_entry *) n;
+		e->refcount++;
+		if(e->device==device) bcache_entry_wait(e);
+		if(e->device==device && bcache_entry_flushable(e)) {
+			bcache_flush_run(e);
+		}
+		next = n->next;
+		bcache_put(e);
+	}
+}
+
+/*
+Write back and then drop every cached block of a device, after any
+I/O in progress on them completes, so that no entry refers to the
+device once it is closed.  An entry that is still pinned is unhashed,
+so that it is not found again, and is freed when released.
+*/
+
+void bcache_invalidate_device( struct device *device )
+{
+	struct list_node *n, *next;
 	struct bcache_entry *e;
 
-	for(n=cache.head;n;n=n->next) {
+	bcache_flush_device(device);
+
+	for(n=cache.head;n;n=next) {
 		e = (struct bcache_entry *) n;
+		e->refcount++;
 		if(e->device==device) {
-			bcache_entry_clean(e);
+			bcache_entry_wait(e);
+			bcache_entry_set_clean(e);
+			bcache_hash_remove(e);
+			e->valid = 0;
 		}
+		next = n->next;
+		bcache_put(e);
 	}
 }
 
 void bcache_flush_all()
 {
-	struct list_node *n;
+	struct list_node *n, *next;
 	struct bcache_entry *e;
 
-	for(n=cache.head;n;n=n->next) {
+	for(n=cache.head;n;n=next) {
 		e = (struct bcache_entry *) n;
-		bcache_entry_clean(e);
+		e->refcount++;
+		bcache_entry_wait(e);
+		if(bcache_entry_flushable(e)) {
+			bcache_flush_run(e);
+		}
+		next = n->next;
+		bcache_put(e);
+	}
+}
+
+/*
+Start an asynchronous write of a dirty entry.  As with a synchronous
+write, the dirty bit is cleared first, and set again on failure.
+*/
+
+static void bcache_entry_writeback( struct bcache_entry *e )
+{
+	e->refcount++;
+	e->busy = 1;
+	bcache_entry_set_clean(e);
+	stats.flush_writes++;
+	bcache_entry_submit(e,1,bcache_writeback_complete);
+}
+
+/*
+One pass of the background flusher, working from the least recently
+used end of the cache, where blocks are closest to being evicted.
+*/
+
+static void bcache_flush_background()
+{
+	struct list_node *n, *prev;
+	struct bcache_entry *e;
+
+	uint32_t now = bcache_millis();
+	int low_water = max_cache_size*BCACHE_DIRTY_RATIO/200;
+	int over_ratio = stats.dirty_blocks > max_cache_size*BCACHE_DIRTY_RATIO/100;
+
+	if(over_ratio) stats.flush_ratio_triggers++;
+
+	for(n=cache.tail;n && stats.dirty_blocks>0;n=prev) {
+		e = (struct bcache_entry *) n;
+		e->refcount++;
+
+		if(over_ratio && stats.dirty_blocks<=low_water) {
+			over_ratio = 0;
+		}
+
+		if(bcache_entry_flushable(e) && (over_ratio || now-e->dirty_time>=BCACHE_DIRTY_EXPIRE)) {
+			bcache_entry_writeback(e);
+			stats.flush_blocks++;
+		}
+
+		prev = n->prev;
+		bcache_put(e);
+	}
+}
+
+static void bcache_flusher()
+{
+	while(1) {
+		clock_wait(BCACHE_FLUSH_INTERVAL);
+		stats.flush_wakeups++;
+		if(stats.dirty_blocks>0) {
+			bcache_flush_background();
+		}
 	}
 }
 
@@ -10,14 +10,34 @@ See the file LICENSE for details.
 #include "device.h"
 #include "kernel/stats.h"
 
+struct bcache_entry;
+
+void bcache_init();
+
+/*
+bcache_get returns a pinned entry for a block, reading it from the
+device if needed, and bcache_data gives a pointer directly into
+the cached contents.  The entry cannot be evicted until released
+with bcache_put.  A caller that modifies the data must call
+bcache_mark_dirty before releasing it.
+*/
+
+struct bcache_entry * bcache_get( struct device *d, int block );
+void * bcache_data( struct bcache_entry *e );
+void bcache_mark_dirty( struct bcache_entry *e );
+void bcache_put( struct bcache_entry *e );
+
 int  bcache_read( struct device *d, char *data, int blocks, int offset );
 int  bcache_write( struct device *d, const char *data, int blocks, int offset );
 
+int  bcache_readahead( struct device *d, int block, int nblocks );
+
 int  bcache_read_block( struct device *d, char *data, int block );
 int  bcache_write_block( struct device *d, const char *data, int block );
 
 void bcache_flush_block( struct device *d, int block );
 void bcache_flush_device( struct device *d  );
+void bcache_invalidate_device( struct device *d );
 void bcache_flush_all();
 
 void bcache_get_stats( struct bcache_stats *s );
@@ -8,7 +8,6 @@ See the file LICENSE for details.
 #include "kernel/types.h"
 #include "kernel/error.h"
 #include "string.h"
-#include "page.h"
 #include "fs.h"
 #include "fs_internal.h"
 #include "cdromfs.h"
@@ -18,13 +17,14 @@ See the file LICENSE for details.
 
 static struct fs_dirent *cdrom_dirent_create(struct fs_volume *volume, int sector, int length, int isdir)
 {
-	struct fs_dirent *d = kmalloc(sizeof(*d));
+	struct fs_dirent *d = slab_alloc(&fs_dirent_cache);
 	if(!d) return 0;
 
 	d->volume = volume;
 	d->refcount = 1;
 	d->size = length;
 	d->isdir = isdir;
+	d->inumber = sector;
 	d->cdrom.sector = sector;
 
 	return d;
@@ -40,6 +40,11 @@ static int cdrom_dirent_read_block(struct fs_dirent *d, char *buffer, uint32_t b
 	}
 }
 
+static int cdrom_dirent_readahead(struct fs_dirent *d, uint32_t blocknum, uint32_t nblocks)
+{
+	return bcache_readahead(d->volume->device, d->cdrom.sector + blocknum, nblocks);
+}
+
 static void fix_filename(char *name, int length)
 {
 	// Plain files typically end with a semicolon and version, remove it.
@@ -57,38 +62,59 @@ static void fix_filename(char *name, int length)
 	strtolower(name);
 }
 
+/*
+Copy the name of a directory entry into a local buffer, so that
+it can be fixed up without modifying the cached sector itself.
+*/
+
+static const char * cdrom_dirent_name(struct iso_9660_directory_entry *d, char *name, int *name_length)
+{
+	if(d->ident[0] == 0) {
+		*name_length = 2;
+		return ".";
+	} else if(d->ident[0] == 1) {
+		*name_length = 3;
+		return "..";
+	} else {
+		memcpy(name, d->ident, d->ident_length);
+		fix_filename(name, d->ident_length);
+		*name_length = strlen(name) + 1;
+		return name;
+	}
+}
+
+/*
+Directory entries never span sectors, and the remainder of a sector
+after the last entry is zero-filled.  Stop at whichever comes first.
+*/
+
+static struct iso_9660_directory_entry *cdrom_next_entry(char *sector, struct iso_9660_directory_entry *d)
+{
+	if(d->descriptor_length == 0) return 0;
+	d = (struct iso_9660_directory_entry *) ((char *) d + d->descriptor_length);
+	if((char *) d >= sector + CDROMFS_BLOCK_SIZE || d->descriptor_length == 0) return 0;
+	return d;
+}
+
 static struct fs_dirent *cdrom_dirent_lookup(struct fs_dirent *dir, const char *name)
 {
 	if(!dir->isdir) return 0;
 
-	char *temp = page_alloc(0);
-	if(!temp) return 0;
-
+	char dname_buffer[256];
 	int nsectors = dir->size / CDROMFS_BLOCK_SIZE + (dir->size % CDROMFS_BLOCK_SIZE ? 1 : 0);
 
 	int i;
 	for(i=0;i<nsectors;i++) {
-		cdrom_dirent_read_block(dir,temp,i);
-		// XXX check result here!
-
-		struct iso_9660_directory_entry *d = (struct iso_9660_directory_entry *) temp;
+		struct bcache_entry *e = bcache_get(dir->volume->device, dir->cdrom.sector + i);
+		if(!e) return 0;
 
-		while(d->descriptor_length > 0) {
+		char *sector = bcache_data(e);
+		struct iso_9660_directory_entry *d = (struct iso_9660_directory_entry *) sector;
+		if(d->descriptor_length == 0) d = 0;
 
-			const char *dname;
+		while(d) {
 			int dname_length;
-
-			if(d->ident[0] == 0) {
-				dname = ".";
-				dname_length = 2;
-			} else if(d->ident[0] == 1) {
-				dname = "..";
-				dname_length = 3;
-			} else {
-				fix_filename(d->ident, d->ident_length);
-				dname = d->ident;
-				dname_length = strlen(dname) + 1;
-			}
+			const char *dname = cdrom_dirent_name(d, dname_buffer, &dname_length);
 
 			if(!strncmp(name,dname,dname_length)) {
 				struct fs_dirent *r;
@@ -97,14 +123,14 @@ static struct fs_dirent *cdrom_dirent_lookup(struct fs_dirent *dir, const char *
 					d->first_sector_little,
 					d->length_little,
 					d->flags & ISO_9660_EXTENT_FLAG_DIRECTORY);
-				page_free(temp);
+				bcache_put(e);
 				return r;
 			}
-			d = (struct iso_9660_directory_entry *) ((char *) d + d->descriptor_length);
+			d = cdrom_next_entry(sector, d);
 		}
-	}
 
-	page_free(temp);
+		bcache_put(e);
+	}
 
 	return 0;
 }
@@ -118,34 +144,22 @@ static int cdrom_dirent_list(struct fs_dirent *dir, char *buffer, int buffer_len
 {
 	if(!dir->isdir) return KERROR_NOT_A_DIRECTORY;
 
-	char *temp = page_alloc(0);
-	if(!temp) return KERROR_OUT_OF_MEMORY;
-
+	char dname_buffer[256];
 	int nsectors = dir->size / CDROMFS_BLOCK_SIZE + (dir->size % CDROMFS_BLOCK_SIZE ? 1 : 0);
 	int total = 0;
 
 	int i;
 	for(i=0;i<nsectors;i++) {
-		cdrom_dirent_read_block(dir,temp,i);
+		struct bcache_entry *e = bcache_get(dir->volume->device, dir->cdrom.sector + i);
+		if(!e) break;
 
-		struct iso_9660_directory_entry *d = (struct iso_9660_directory_entry *) temp;
+		char *sector = bcache_data(e);
+		struct iso_9660_directory_entry *d = (struct iso_9660_directory_entry *) sector;
+		if(d->descriptor_length == 0) d = 0;
 
-		while(d->descriptor_length > 0 && buffer_length > 0) {
-
-			const char *dname;
+		while(d && buffer_length > 0) {
 			int dname_length;
-
-			if(d->ident[0] == 0) {
-				dname = ".";
-				dname_length = 2;
-			} else if(d->ident[0] == 1) {
-				dname = "..";
-				dname_length = 3;
-			} else {
-				fix_filename(d->ident, d->ident_length);
-				dname = d->ident;
-				dname_length = strlen(dname) + 1;
-			}
+			const char *dname = cdrom_dirent_name(d, dname_buffer, &dname_length);
 
 			// If there is enough space, keep copying items.
 			// If not, count them up to return the value.
@@ -158,11 +172,11 @@ static int cdrom_dirent_list(struct fs_dirent *dir, char *buffer, int buffer_len
 
 			total += dname_length;
 
-			d = (struct iso_9660_directory_entry *) ((char *) d + d->descriptor_length);
+			d = cdrom_next_entry(sector, d);
 		}
-	}
 
-	page_free(temp);
+		bcache_put(e);
+	}
 
 	return total;
 }
@@ -188,12 +202,7 @@ static int cdrom_volume_close(struct fs_volume *v)
 static struct fs_volume *cdrom_volume_open( struct device *device )
 {
 	struct fs_volume *v = cdrom_volume_create(device);
-
-	struct iso_9660_volume_descriptor *d = page_alloc(0);
-	if(!d) {
-		kfree(v);
-		return 0;
-	}
+	if(!v) return 0;
 
 	printf("cdromfs: scanning %s unit %d...\n",device_name(device),device_unit(device));
 
@@ -202,11 +211,15 @@ static struct fs_volume *cdrom_volume_open( struct device *device )
 	for(j = 0; j < 16; j++) {
 		printf("cdromfs: checking volume %d\n", j);
 
-		bcache_read(device, (char*)d, 1, j + 16);
-		// XXX check reuslt
+		struct bcache_entry *e = bcache_get(device, j + 16);
+		if(!e) break;
 
-		if(strncmp(d->magic, "CD001", 5))
+		struct iso_9660_volume_descriptor *d = bcache_data(e);
+
+		if(strncmp(d->magic, "CD001", 5)) {
+			bcache_put(e);
 			continue;
+		}
 
 		if(d->type == ISO_9660_VOLUME_TYPE_PRIMARY) {
 			v->cdrom.root_sector = d->root.first_sector_little;
@@ -216,19 +229,21 @@ static struct fs_volume *cdrom_volume_open( struct device *device )
 
 			printf("cdromfs: mounted filesystem on %s-%d\n", device_name(v->device), device_unit(v->device));
 
-			page_free(d);
+			bcache_put(e);
 
 			return v;
 
 		} else if(d->type == ISO_9660_VOLUME_TYPE_TERMINATOR) {
+			bcache_put(e);
 			break;
 		} else {
+			bcache_put(e);
 			continue;
 		}
 	}
 
-	page_free(d);
 	cdrom_volume_close(v);
+	kfree(v);
 
 	printf("cdromfs: no filesystem found\n");
 	return 0;
@@ -248,6 +263,7 @@ const static struct fs_ops cdrom_ops = {
 	.mkdir = 0,
 	.mkfile = 0,
 	.read_block = cdrom_dirent_read_block,
+	.readahead = cdrom_dirent_readahead,
 	.write_block = 0,
 	.list = cdrom_dirent_list,
 	.remove = 0,
@@ -10,7 +10,7 @@ See the file LICENSE for details.
 #include "process.h"
 
 // Minimum PIT frequency is 18.2Hz.
-#define CLICKS_PER_SECOND 20
+#define CLICKS_PER_SECOND 100
 
 #define TIMER0		0x40
 #define TIMER_MODE	0x43
@@ -20,18 +20,65 @@ See the file LICENSE for details.
 
 static uint32_t clicks = 0;
 static uint32_t seconds = 0;
+static uint32_t ticks = 0;
 
-static struct list queue = { 0, 0 };
+/*
+Sleeping processes are kept in a timer wheel: each pending timer
+is placed in the slot of the tick on which it expires, modulo the
+number of slots.  On each tick, only the timers in the current slot
+are examined, and only those that have expired wake up their process.
+Timers more than one revolution away are simply skipped until then.
+*/
+
+#define CLOCK_WHEEL_SLOTS 64
+
+static struct list wheel[CLOCK_WHEEL_SLOTS];
+
+static void clock_wheel_expire()
+{
+	struct list *slot = &wheel[ticks % CLOCK_WHEEL_SLOTS];
+	struct list_node *n = slot->head;
+
+	while(n) {
+		struct list_node *next = n->next;
+		struct clock_timer *t = (struct clock_timer *) n;
+		if((int32_t) (ticks - t->expires) >= 0) {
+			list_remove(&t->node);
+			if(t->process->state == PROCESS_STATE_BLOCKED) {
+				t->fired = 1;
+				process_wakeup_process(t->process);
+			}
+		}
+		n = next;
+	}
+}
 
 static void clock_interrupt(int i, int code)
 {
 	clicks++;
-	process_wakeup_all(&queue);
+	ticks++;
 	if(clicks >= CLICKS_PER_SECOND) {
 		clicks = 0;
 		seconds++;
-		process_preempt();
 	}
+	clock_wheel_expire();
+	process_tick();
+}
+
+uint32_t clock_ticks()
+{
+	return ticks;
+}
+
+uint32_t clock_millis_to_ticks(uint32_t millis)
+{
+	uint32_t t = (millis * CLICKS_PER_SECOND + 999) / 1000;
+	return t ? t : 1;
+}
+
+uint32_t clock_ticks_per_second()
+{
+	return CLICKS_PER_SECOND;
 }
 
 clock_t clock_read()
@@ -54,17 +101,43 @@ clock_t clock_diff(clock_t start, clock_t stop)
 	return result;
 }
 
+/*
+Block the current process on queue q until it is woken up,
+or until the clock reaches the given deadline, in ticks.
+Returns 1 if woken up, or 0 if the deadline passed.
+*/
+
+int clock_wait_until(struct list *q, uint32_t deadline)
+{
+	struct clock_timer *t = &current->timer;
+
+	if((int32_t) (deadline - ticks) <= 0)
+		return 0;
+
+	t->expires = deadline;
+	t->process = current;
+	t->fired = 0;
+
+	interrupt_block();
+	list_push_tail(&wheel[t->expires % CLOCK_WHEEL_SLOTS], &t->node);
+	process_wait(q);
+
+	interrupt_block();
+	list_remove(&t->node);
+	interrupt_unblock();
+
+	return !t->fired;
+}
+
+int clock_wait_queue(struct list *q, uint32_t millis)
+{
+	return clock_wait_until(q, ticks + clock_millis_to_ticks(millis));
+}
+
 void clock_wait(uint32_t millis)
 {
-	clock_t start, elapsed;
-	uint32_t total;
-
-	start = clock_read();
-	do {
-		process_wait(&queue);
-		elapsed = clock_diff(start, clock_read());
-		total = elapsed.millis + elapsed.seconds * 1000;
-	} while(total < millis);
+	struct list q = LIST_INIT;
+	clock_wait_queue(&q, millis);
 }
 
 void clock_init()
@@ -8,15 +8,33 @@ See the file LICENSE for details.
 #define CLOCK_H
 
 #include "kernel/types.h"
+#include "list.h"
 
 typedef struct {
 	uint32_t seconds;
 	uint32_t millis;
 } clock_t;
 
+/*
+Each process has one timer, used by clock_wait_queue to wake it up
+after a deadline, measured in clock ticks since boot.
+*/
+
+struct clock_timer {
+	struct list_node node;
+	uint32_t expires;
+	struct process *process;
+	int fired;
+};
+
 void clock_init();
 clock_t clock_read();
 clock_t clock_diff(clock_t start, clock_t stop);
 void clock_wait(uint32_t millis);
+int  clock_wait_queue(struct list *q, uint32_t millis);
+int  clock_wait_until(struct list *q, uint32_t deadline);
+uint32_t clock_ticks();
+uint32_t clock_millis_to_ticks(uint32_t millis);
+uint32_t clock_ticks_per_second();
 
 #endif
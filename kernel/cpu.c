@@ -0,0 +1,192 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "cpu.h"
+#include "console.h"
+#include "string.h"
+
+/*
+The MP floating pointer structure is found on a 16-byte boundary
+in the first KB of the extended BIOS data area, in the last KB of
+base memory, or in the BIOS ROM.  It points to the MP configuration
+table, which lists one entry for each processor, bus, I/O APIC,
+and interrupt assignment in the system.
+*/
+
+struct mp_floating {
+	char signature[4];
+	uint32_t config;
+	uint8_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	uint8_t type;
+	uint8_t features[4];
+} __attribute__ ((packed));
+
+struct mp_config {
+	char signature[4];
+	uint16_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem[8];
+	char product[12];
+	uint32_t oem_table;
+	uint16_t oem_length;
+	uint16_t entries;
+	uint32_t lapic;
+	uint16_t ext_length;
+	uint8_t ext_checksum;
+	uint8_t reserved;
+} __attribute__ ((packed));
+
+struct mp_processor {
+	uint8_t type;
+	uint8_t apic_id;
+	uint8_t apic_version;
+	uint8_t flags;
+	uint32_t signature;
+	uint32_t features;
+	uint32_t reserved[2];
+} __attribute__ ((packed));
+
+struct mp_ioapic {
+	uint8_t type;
+	uint8_t id;
+	uint8_t version;
+	uint8_t flags;
+	uint32_t addr;
+} __attribute__ ((packed));
+
+#define MP_ENTRY_PROCESSOR 0
+#define MP_ENTRY_BUS       1
+#define MP_ENTRY_IOAPIC    2
+#define MP_ENTRY_IOINT     3
+#define MP_ENTRY_LOCALINT  4
+
+#define MP_PROCESSOR_ENABLED 0x01
+#define MP_PROCESSOR_BOOT    0x02
+
+#define BIOS_EBDA_SEGMENT 0x40e
+#define BIOS_BASE_MEMORY  0x413
+
+static struct cpu cpus[CPU_MAX];
+static int ncpus = 0;
+static uint32_t lapic_addr = 0;
+static uint32_t ioapic_addr = 0;
+
+static int cpu_checksum( const uint8_t *data, int length )
+{
+	uint8_t sum = 0;
+	int i;
+	for(i = 0; i < length; i++) sum += data[i];
+	return sum == 0;
+}
+
+static struct mp_floating *cpu_search( uint32_t addr, uint32_t length )
+{
+	uint32_t a;
+	for(a = addr; a < addr + length; a += 16) {
+		struct mp_floating *f = (struct mp_floating *) a;
+		if(!strncmp(f->signature, "_MP_", 4) && cpu_checksum((uint8_t *) f, sizeof(*f))) {
+			return f;
+		}
+	}
+	return 0;
+}
+
+static struct mp_floating *cpu_find_floating()
+{
+	struct mp_floating *f;
+
+	uint32_t ebda = (*(uint16_t *) BIOS_EBDA_SEGMENT) << 4;
+	if(ebda && (f = cpu_search(ebda, 1024))) return f;
+
+	uint32_t base = (*(uint16_t *) BIOS_BASE_MEMORY) * 1024;
+	if(base && (f = cpu_search(base - 1024, 1024))) return f;
+
+	return cpu_search(0xf0000, 0x10000);
+}
+
+/* Record a processor, keeping the boot processor in the first slot. */
+
+static void cpu_add( uint8_t apic_id, int boot )
+{
+	if(ncpus >= CPU_MAX) return;
+	struct cpu *c = &cpus[ncpus];
+	if(boot && ncpus > 0) {
+		cpus[ncpus] = cpus[0];
+		cpus[ncpus].id = ncpus;
+		c = &cpus[0];
+	}
+	c->id = boot ? 0 : ncpus;
+	c->apic_id = apic_id;
+	c->boot = boot;
+	ncpus++;
+}
+
+void cpu_init()
+{
+	struct mp_floating *f = cpu_find_floating();
+	struct mp_config *c = f ? (struct mp_config *) f->config : 0;
+
+	if(!c || f->type != 0 || strncmp(c->signature, "PCMP", 4) || !cpu_checksum((uint8_t *) c, c->length)) {
+		cpu_add(0, 1);
+		printf("cpu: no multiprocessor table, using 1 cpu\n");
+		return;
+	}
+
+	lapic_addr = c->lapic;
+
+	uint8_t *e = (uint8_t *) (c + 1);
+	uint8_t *end = (uint8_t *) c + c->length;
+
+	while(e < end) {
+		if(*e == MP_ENTRY_PROCESSOR) {
+			struct mp_processor *p = (struct mp_processor *) e;
+			if(p->flags & MP_PROCESSOR_ENABLED) {
+				cpu_add(p->apic_id, (p->flags & MP_PROCESSOR_BOOT) ? 1 : 0);
+			}
+			e += sizeof(*p);
+		} else if(*e == MP_ENTRY_IOAPIC) {
+			struct mp_ioapic *io = (struct mp_ioapic *) e;
+			if(!ioapic_addr) ioapic_addr = io->addr;
+			e += sizeof(*io);
+		} else if(*e == MP_ENTRY_BUS || *e == MP_ENTRY_IOINT || *e == MP_ENTRY_LOCALINT) {
+			e += 8;
+		} else {
+			break;
+		}
+	}
+
+	if(ncpus == 0) cpu_add(0, 1);
+
+	printf("cpu: %d cpus, local apic %x, io apic %x\n", ncpus, lapic_addr, ioapic_addr);
+	if(ncpus > 1) {
+		printf("cpu: running on the boot cpu only\n");
+	}
+}
+
+int cpu_count()
+{
+	return ncpus;
+}
+
+struct cpu *cpu_get( int id )
+{
+	if(id < 0 || id >= ncpus) return 0;
+	return &cpus[id];
+}
+
+/*
+Only the boot processor runs kernel code, so it is always the
+running one.  It is valid even before cpu_init, so that the state
+of the running process can be used from the very start.
+*/
+
+struct cpu *cpu_self()
+{
+	return &cpus[0];
+}
@@ -0,0 +1,40 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef CPU_H
+#define CPU_H
+
+#include "kernel/types.h"
+
+#define CPU_MAX 8
+
+struct process;
+
+/*
+cpu_init discovers the processors and interrupt controllers
+described by the BIOS in the Intel MultiProcessor tables,
+with the boot processor always first.  Each processor has its own
+running process and idle tick count, found through cpu_self.
+The kernel still runs only on the boot processor: the others
+are recorded here, but not started, so cpu_self always returns
+the boot processor.  With no tables, the boot processor is the
+only one recorded.
+*/
+
+struct cpu {
+	int id;
+	uint8_t apic_id;
+	uint8_t boot;
+	struct process *current;
+	uint32_t idle_ticks;
+};
+
+void cpu_init();
+int  cpu_count();
+struct cpu *cpu_get( int id );
+struct cpu *cpu_self();
+
+#endif
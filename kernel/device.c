@@ -7,12 +7,15 @@ See the file LICENSE for details.
 #include "string.h"
 #include "page.h"
 #include "kmalloc.h"
+#include "process.h"
+#include "interrupt.h"
 
 #include "kernel/stats.h"
 #include "kernel/types.h"
 #include "kernel/error.h"
 
 static struct device_driver *driver_list = 0;
+static struct list request_queue = LIST_INIT;
 
 struct device {
 	struct device_driver *driver;
@@ -133,6 +136,65 @@ int device_write(struct device *d, const void *data, int size, int offset)
 	}
 }
 
+/*
+Translate the request into driver units and hand it to the driver.
+A driver without a submit method is simply called synchronously.
+*/
+
+int device_submit(struct device *d, struct device_request *r)
+{
+	int status;
+
+	r->driver = d->driver;
+	r->unit = d->unit;
+	r->count = r->nblocks*d->multiplier;
+	r->sector = r->offset*d->multiplier;
+	r->multiplier = d->multiplier;
+	r->result = 0;
+	r->done = 0;
+
+	if(r->write) {
+		d->driver->stats.blocks_written += r->count;
+	} else {
+		d->driver->stats.blocks_read += r->count;
+	}
+
+	if(d->driver->submit) {
+		return d->driver->submit(d->unit,r);
+	}
+
+	if(r->write && d->driver->write) {
+		status = d->driver->write(r->unit,r->buffer,r->count,r->sector);
+	} else if(!r->write && d->driver->read) {
+		status = d->driver->read(r->unit,r->buffer,r->count,r->sector);
+	} else {
+		return KERROR_NOT_IMPLEMENTED;
+	}
+
+	device_request_complete(r,status>0 ? r->count : 0);
+	return 0;
+}
+
+/* Called by the driver when count blocks (in driver units) have been transferred. */
+
+void device_request_complete(struct device_request *r, int count)
+{
+	r->result = count/r->multiplier;
+	r->done = 1;
+	if(r->complete) r->complete(r);
+	process_wakeup_all(&request_queue);
+}
+
+void device_request_wait(struct device_request *r)
+{
+	interrupt_block();
+	while(!r->done) {
+		process_wait(&request_queue);
+		interrupt_block();
+	}
+	interrupt_unblock();
+}
+
 int device_block_size( struct device *d )
 {
 	return d->block_size*d->multiplier;
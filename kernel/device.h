@@ -9,6 +9,9 @@ See the file LICENSE for details.
 
 #include "kernel/stats.h"
 #include "kernel/types.h"
+#include "list.h"
+
+struct device_request;
 
 struct device_driver {
 	const char *name;
@@ -16,11 +19,41 @@ struct device_driver {
 	int (*read) ( int unit, void *buffer, int nblocks, int block_offset);
 	int (*read_nonblock) ( int unit, void *buffer, int nblocks, int block_offset);
 	int (*write) ( int unit, const void *buffer, int nblocks, int block_offset);
+	int (*submit) ( int unit, struct device_request *r );
 	int multiplier;
 	struct device_driver_stats stats;
 	struct device_driver *next;
 };
 
+/*
+An asynchronous request to read or write nblocks at offset, both in
+units of the device block size, to or from a buffer in kernel memory.
+device_submit queues the request with the driver and returns at once,
+or performs it synchronously if the driver cannot queue requests.
+When the request finishes, result is set to the number of blocks
+transferred (zero on failure), done is set, and complete is called,
+possibly from another process.  The remaining fields are private to
+the device layer and driver.
+*/
+
+struct device_request {
+	struct list_node node;
+	void *buffer;
+	int nblocks;
+	int offset;
+	int write;
+	int result;
+	int done;
+	void (*complete) ( struct device_request *r );
+	void *arg;
+
+	struct device_driver *driver;
+	int unit;
+	int count;
+	int sector;
+	int multiplier;
+};
+
 void device_driver_register( struct device_driver *d );
 
 struct device *device_open(const char *name, int unit);
@@ -30,6 +63,9 @@ void device_close( struct device *d );
 int device_read(struct device *d, void *buffer, int size, int offset);
 int device_read_nonblock(struct device *d, void *buffer, int size, int offset);
 int device_write(struct device *d, const void *buffer, int size, int offset);
+int device_submit(struct device *d, struct device_request *r);
+void device_request_complete(struct device_request *r, int count);
+void device_request_wait(struct device_request *r);
 int device_block_size( struct device *d );
 int device_nblocks( struct device *d );
 int device_unit( struct device *d );
@@ -26,35 +26,37 @@ static int diskfs_block_write(struct device *d, struct diskfs_block *b, uint32_t
 	return bcache_write(d, b->data, 1, blockno) ? DISKFS_BLOCK_SIZE : -1;
 }
 
-/* Read or write a bitmap block, starting from the bitmap offset. */
-
-static int diskfs_bitmap_block_read(struct fs_volume *v, struct diskfs_block *b, uint32_t blockno )
-{
-	if(blockno>=v->disk.bitmap_blocks) return KERROR_OUT_OF_SPACE;
-	return diskfs_block_read(v->device,b,v->disk.bitmap_start+blockno);
-}
+/*
+Pin a block from the raw device in the buffer cache and return
+a pointer directly to its contents, or null on failure.
+The caller must release it with bcache_put(*e) when done, and
+call bcache_mark_dirty(*e) first if the contents were changed.
+*/
 
-static int diskfs_bitmap_block_write(struct fs_volume *v, struct diskfs_block *b, uint32_t blockno )
+static struct diskfs_block * diskfs_block_get(struct device *d, uint32_t blockno, struct bcache_entry **e )
 {
-	if(blockno>=v->disk.bitmap_blocks) return KERROR_OUT_OF_SPACE;
-	return diskfs_block_write(v->device,b,v->disk.bitmap_start+blockno);
+	*e = bcache_get(d, blockno);
+	if(!*e) return 0;
+	return bcache_data(*e);
 }
 
-/* Read or write an inode block, starting from the inode block offset. */
+/* Pin a bitmap block, starting from the bitmap offset. */
 
-static int diskfs_inode_block_read(struct fs_volume *v, struct diskfs_block *b, uint32_t blockno )
+static struct diskfs_block * diskfs_bitmap_block_get(struct fs_volume *v, uint32_t blockno, struct bcache_entry **e )
 {
-	if(blockno>=v->disk.inode_blocks) return KERROR_OUT_OF_SPACE;
-	return diskfs_block_read(v->device,b,v->disk.inode_start+blockno);
+	if(blockno>=v->disk.bitmap_blocks) return 0;
+	return diskfs_block_get(v->device,v->disk.bitmap_start+blockno,e);
 }
 
-static int diskfs_inode_block_write(struct fs_volume *v, struct diskfs_block *b, uint32_t blockno )
+/* Pin an inode block, starting from the inode block offset. */
+
+static struct diskfs_block * diskfs_inode_block_get(struct fs_volume *v, uint32_t blockno, struct bcache_entry **e )
 {
-	if(blockno>=v->disk.inode_blocks) return KERROR_OUT_OF_SPACE;
-	return diskfs_block_write(v->device,b,v->disk.inode_start+blockno);
+	if(blockno>=v->disk.inode_blocks) return 0;
+	return diskfs_block_get(v->device,v->disk.inode_start+blockno,e);
 }
 
-/* Read or write a data block, starting from the data block offset. */
+/* Read, write, or pin a data block, starting from the data block offset. */
 
 static int diskfs_data_block_read(struct fs_volume *v, struct diskfs_block *b, uint32_t blockno )
 {
@@ -68,191 +70,818 @@ static int diskfs_data_block_write(struct fs_volume *v, struct diskfs_block *b,
 	return diskfs_block_write(v->device,b,v->disk.data_start+blockno);
 }
 
+static struct diskfs_block * diskfs_data_block_get(struct fs_volume *v, uint32_t blockno, struct bcache_entry **e )
+{
+	if(blockno>=v->disk.data_blocks) return 0;
+	return diskfs_block_get(v->device,v->disk.data_start+blockno,e);
+}
+
+/* Number of bits of bitmap block i that describe actual data blocks. */
+
+static uint32_t diskfs_bitmap_block_bits( struct fs_volume *v, uint32_t i )
+{
+	uint32_t first = i*DISKFS_BITS_PER_BLOCK;
+	if(first>=v->disk.data_blocks) return 0;
+	return MIN(v->disk.data_blocks-first,DISKFS_BITS_PER_BLOCK);
+}
+
+static int diskfs_word_count_ones( uint32_t x )
+{
+	x = x - ((x>>1) & 0x55555555);
+	x = (x & 0x33333333) + ((x>>2) & 0x33333333);
+	x = (x + (x>>4)) & 0x0f0f0f0f;
+	return (x * 0x01010101) >> 24;
+}
+
+/* Count the free blocks described by the first nbits bits of a bitmap block. */
+
+static int32_t diskfs_bitmap_count_free( struct diskfs_block *b, uint32_t nbits )
+{
+	int32_t used = 0;
+	uint32_t i;
+
+	for(i=0;i<nbits/32;i++) {
+		used += diskfs_word_count_ones(b->pointers[i]);
+	}
+	if(nbits%32) {
+		used += diskfs_word_count_ones(b->pointers[i] & ((1u<<(nbits%32))-1));
+	}
+
+	return nbits - used;
+}
+
+/*
+Find the first clear bit in [start,nbits) of a bitmap block, a word
+at a time, returning nbits if there is none.  Bits before start in the
+first word are treated as set.
+*/
+
+static uint32_t diskfs_bitmap_find_zero( struct diskfs_block *b, uint32_t start, uint32_t nbits )
+{
+	uint32_t i, bit;
+
+	for(i=start/32;i*32<nbits;i++) {
+		uint32_t word = b->pointers[i];
+		if(i==start/32) word |= (1u<<(start%32))-1;
+		if(word!=0xffffffff) {
+			bit = i*32 + __builtin_ctz(~word);
+			return bit<nbits ? bit : nbits;
+		}
+	}
+
+	return nbits;
+}
+
 /*
-Allocate a new data block by scanning the bitmap.
+Allocate a new data block by scanning the bitmap, starting from the
+allocation cursor and skipping bitmap blocks known to be full.
 If available, return the block number.
 If nothing available, return zero.
 */
 
 static uint32_t diskfs_data_block_alloc( struct fs_volume *v )
 {
-	struct diskfs_block *b = page_alloc(0);
-	struct diskfs_superblock *s= &v->disk;
-	int i, j, k;
-
-	for(i=0;i<s->bitmap_blocks;i++) {
-		diskfs_bitmap_block_read(v,b,i);
-		for(j=0;j<DISKFS_BLOCK_SIZE;j++) {
-			if(b->data[j]!=0xff) {
-				for(k=0;k<8;k++) {
-					if(!((1<<k) & b->data[j])) {
-						int blockno = i*DISKFS_BLOCK_SIZE+j*8+k;
-
-						// Never allocate block zero;
-						if(blockno==0) continue;
-
-						// Do not exceet the actual number of blocks
-						if(blockno>=v->disk.data_blocks) break;
-
-						b->data[j] |= 1<<k;
-						diskfs_bitmap_block_write(v,b,i);
-						page_free(b);
-						return blockno;
-					}
-				}
-			}		
+	struct diskfs_alloc *a = &v->disk_alloc;
+	struct diskfs_block *b;
+	struct bcache_entry *e;
+	uint32_t n;
+
+	uint32_t nbitmap = v->disk.bitmap_blocks;
+	if(nbitmap==0) return 0;
+
+	if(a->cursor>=v->disk.data_blocks) a->cursor = 0;
+	uint32_t first = a->cursor/DISKFS_BITS_PER_BLOCK;
+
+	/* The first bitmap block is visited again at the end, to search below the cursor. */
+
+	for(n=0;n<=nbitmap;n++) {
+		uint32_t i = (first+n)%nbitmap;
+		uint32_t nbits = diskfs_bitmap_block_bits(v,i);
+		uint32_t start = 0;
+
+		if(a->bitmap_free[i]==0 || nbits==0) continue;
+
+		if(n==0) start = a->cursor%DISKFS_BITS_PER_BLOCK;
+
+		// Never allocate block zero.
+		if(i==0 && start==0) start = 1;
+
+		b = diskfs_bitmap_block_get(v,i,&e);
+		if(!b) break;
+
+		if(a->bitmap_free[i]<0) {
+			a->bitmap_free[i] = diskfs_bitmap_count_free(b,nbits);
+		}
+
+		uint32_t bit = diskfs_bitmap_find_zero(b,start,nbits);
+		if(bit<nbits) {
+			b->pointers[bit/32] |= 1u<<(bit%32);
+			bcache_mark_dirty(e);
+			bcache_put(e);
+			if(a->bitmap_free[i]>0) a->bitmap_free[i]--;
+			uint32_t blockno = i*DISKFS_BITS_PER_BLOCK + bit;
+			a->cursor = blockno+1;
+			return blockno;
 		}
+
+		bcache_put(e);
 	}
 
 	printf("diskfs: warning: out of space!\n");
 
-	page_free(b);
 	return 0;
 }
 
+/* Find the first set bit in [start,nbits) of a bitmap block, or nbits if none. */
+
+static uint32_t diskfs_bitmap_find_one( struct diskfs_block *b, uint32_t start, uint32_t nbits )
+{
+	uint32_t i, bit;
+
+	for(i=start/32;i*32<nbits;i++) {
+		uint32_t word = b->pointers[i];
+		if(i==start/32) word &= ~((1u<<(start%32))-1);
+		if(word!=0) {
+			bit = i*32 + __builtin_ctz(word);
+			return bit<nbits ? bit : nbits;
+		}
+	}
+
+	return nbits;
+}
+
+/*
+Mark the free run of blocks [start,end) within bitmap block i as
+used, and return the first, updating the free summary.
+The caller has pinned the bitmap block, and it is released.
+*/
+
+static uint32_t diskfs_bitmap_take_run( struct fs_volume *v, uint32_t i, struct diskfs_block *b, struct bcache_entry *e, uint32_t start, uint32_t end )
+{
+	uint32_t bit;
+
+	for(bit=start;bit<end;bit++) {
+		b->pointers[bit/32] |= 1u<<(bit%32);
+	}
+	bcache_mark_dirty(e);
+	bcache_put(e);
+
+	if(v->disk_alloc.bitmap_free[i]>=(int32_t)(end-start)) {
+		v->disk_alloc.bitmap_free[i] -= end-start;
+	}
+
+	return i*DISKFS_BITS_PER_BLOCK + start;
+}
+
+/*
+Allocate a run of up to want contiguous data blocks, preferably
+beginning at goal (such as the block following the end of a file),
+and otherwise the first run of want free blocks found from the
+allocation cursor.  Runs do not cross bitmap blocks.  Failing both,
+a single block is allocated.  Returns the first block of the run
+and its length in *got, or zero if the disk is full.
+*/
+
+static uint32_t diskfs_data_block_alloc_run( struct fs_volume *v, uint32_t goal, uint32_t want, uint32_t *got )
+{
+	struct diskfs_alloc *a = &v->disk_alloc;
+	struct diskfs_block *b;
+	struct bcache_entry *e;
+	uint32_t n, pos, end;
+
+	uint32_t nbitmap = v->disk.bitmap_blocks;
+	if(nbitmap==0) return 0;
+
+	if(goal>0 && goal<v->disk.data_blocks) {
+		uint32_t i = goal/DISKFS_BITS_PER_BLOCK;
+		uint32_t nbits = diskfs_bitmap_block_bits(v,i);
+		pos = goal%DISKFS_BITS_PER_BLOCK;
+
+		if(a->bitmap_free[i]!=0 && (b = diskfs_bitmap_block_get(v,i,&e))) {
+			if(a->bitmap_free[i]<0) a->bitmap_free[i] = diskfs_bitmap_count_free(b,nbits);
+			if(!(b->pointers[pos/32] & (1u<<(pos%32)))) {
+				end = diskfs_bitmap_find_one(b,pos,MIN(nbits,pos+want));
+				*got = end-pos;
+				a->cursor = goal+*got;
+				return diskfs_bitmap_take_run(v,i,b,e,pos,end);
+			}
+			bcache_put(e);
+		}
+	}
+
+	if(a->cursor>=v->disk.data_blocks) a->cursor = 0;
+	uint32_t first = a->cursor/DISKFS_BITS_PER_BLOCK;
+
+	for(n=0;n<nbitmap;n++) {
+		uint32_t i = (first+n)%nbitmap;
+		uint32_t nbits = diskfs_bitmap_block_bits(v,i);
+
+		if(nbits==0 || (a->bitmap_free[i]>=0 && a->bitmap_free[i]<(int32_t)want)) continue;
+
+		b = diskfs_bitmap_block_get(v,i,&e);
+		if(!b) break;
+
+		if(a->bitmap_free[i]<0) a->bitmap_free[i] = diskfs_bitmap_count_free(b,nbits);
+
+		// Never allocate block zero.
+		pos = diskfs_bitmap_find_zero(b,i==0 ? 1 : 0,nbits);
+		while(pos<nbits) {
+			end = diskfs_bitmap_find_one(b,pos,MIN(nbits,pos+want));
+			if(end-pos>=want) {
+				*got = end-pos;
+				a->cursor = i*DISKFS_BITS_PER_BLOCK+end;
+				return diskfs_bitmap_take_run(v,i,b,e,pos,end);
+			}
+			pos = diskfs_bitmap_find_zero(b,end,nbits);
+		}
+
+		bcache_put(e);
+	}
+
+	*got = 1;
+	return diskfs_data_block_alloc(v);
+}
+
 static void diskfs_data_block_free( struct fs_volume *v, int blockno )
 {
-	struct diskfs_block *b = page_alloc(0);
+	struct bcache_entry *e;
 
-	int bitmap_block = blockno/DISKFS_BLOCK_SIZE;
-	int bitmap_byte = blockno%DISKFS_BLOCK_SIZE/8;
-	int bitmap_bit = blockno%DISKFS_BLOCK_SIZE%8;
+	if(blockno<=0) return;
 
-	diskfs_bitmap_block_read(v,b,bitmap_block);
-	b->data[bitmap_byte] &= ~(1<<bitmap_bit);
-	diskfs_bitmap_block_write(v,b,bitmap_block);
+	int bitmap_block = blockno/DISKFS_BITS_PER_BLOCK;
+	int bitmap_byte = blockno%DISKFS_BITS_PER_BLOCK/8;
+	int bitmap_bit = blockno%8;
 
-	page_free(b);
+	struct diskfs_block *b = diskfs_bitmap_block_get(v,bitmap_block,&e);
+	if(!b) return;
+
+	if(b->data[bitmap_byte] & (1<<bitmap_bit)) {
+		b->data[bitmap_byte] &= ~(1<<bitmap_bit);
+		if(v->disk_alloc.bitmap_free[bitmap_block]>=0) v->disk_alloc.bitmap_free[bitmap_block]++;
+		bcache_mark_dirty(e);
+	}
+	bcache_put(e);
 }
 
 static int diskfs_inumber_alloc( struct fs_volume *v )
 {
-	struct diskfs_block *b = page_alloc(0);
+	struct diskfs_block *b;
+	struct bcache_entry *e;
 	int i, j;
 
 	for(i=0;i<v->disk.inode_blocks;i++) {
-		diskfs_inode_block_read(v,b,i);
+		b = diskfs_inode_block_get(v,i,&e);
+		if(!b) break;
 		for(j=0;j<DISKFS_INODES_PER_BLOCK;j++) {
 			if(!b->inodes[j].inuse) {
 				int inumber = i * DISKFS_INODES_PER_BLOCK + j;
 				b->inodes[j].inuse = 1;
-				diskfs_inode_block_write(v,b,i);
-				page_free(b);
+				bcache_mark_dirty(e);
+				bcache_put(e);
 				return inumber;
 			}
 		}
+		bcache_put(e);
 	}
 
 	printf("diskfs: warning: out of inodes!\n");
 
-	page_free(b);
 	return 0;
 }
 
 static void diskfs_inumber_free( struct fs_volume *v, int inumber )
 {
-	int inode_block = inumber / DISKFS_INODES_PER_BLOCK;
-	struct diskfs_block *b = page_alloc(0);
-	diskfs_inode_block_read(v,b,inode_block);
+	struct bcache_entry *e;
+	struct diskfs_block *b = diskfs_inode_block_get(v,inumber/DISKFS_INODES_PER_BLOCK,&e);
+	if(!b) return;
+
 	b->inodes[inumber%DISKFS_INODES_PER_BLOCK].inuse = 0;
-	diskfs_inode_block_write(v,b,inode_block);
-	page_free(b);
+	bcache_mark_dirty(e);
+	bcache_put(e);
 }
 
 int diskfs_inode_load( struct fs_volume *v, int inumber, struct diskfs_inode *inode )
 {
-	struct diskfs_block *b = page_alloc(0);
+	struct bcache_entry *e;
 
 	int inode_block = inumber / DISKFS_INODES_PER_BLOCK;
 	int inode_position = inumber % DISKFS_INODES_PER_BLOCK;
 
-	diskfs_inode_block_read(v,b,inode_block);
-	memcpy(inode,&b->inodes[inode_position],sizeof(*inode));
+	struct diskfs_block *b = diskfs_inode_block_get(v,inode_block,&e);
+	if(!b) return 0;
 
-	page_free(b);
+	memcpy(inode,&b->inodes[inode_position],sizeof(*inode));
+	bcache_put(e);
 
 	return 1;
 }
 
 int diskfs_inode_save( struct fs_volume *v, int inumber, struct diskfs_inode *inode )
 {
-	struct diskfs_block *b = page_alloc(0);
+	struct bcache_entry *e;
 
 	int inode_block = inumber / DISKFS_INODES_PER_BLOCK;
 	int inode_position = inumber % DISKFS_INODES_PER_BLOCK;
 
-	diskfs_inode_block_read(v,b,inode_block);
-	memcpy(&b->inodes[inode_position],inode,sizeof(*inode));
-	diskfs_inode_block_write(v,b,inode_block);
+	struct diskfs_block *b = diskfs_inode_block_get(v,inode_block,&e);
+	if(!b) return 0;
 
-	page_free(b);
+	memcpy(&b->inodes[inode_position],inode,sizeof(*inode));
+	bcache_mark_dirty(e);
+	bcache_put(e);
 
 	return 1;
 }
 
-int diskfs_inode_read( struct fs_dirent *d, struct diskfs_block *b, uint32_t block )
+/* Write the inode of an open dirent back to the inode table now. */
+
+static void diskfs_dirent_save( struct fs_dirent *d )
 {
-	int actual;
+	diskfs_inode_save(d->volume,d->inumber,&d->disk);
+	d->disk_dirty = 0;
+}
+
+/* Returns true if the volume uses extents rather than indirect blocks. */
+
+static int diskfs_volume_extents( struct fs_volume *v )
+{
+	return v->disk.magic==DISKFS_MAGIC;
+}
+
+/*
+Map a logical block of an inode in the original format to a data
+block number.  Returns zero if the block is not (yet) allocated.
+*/
+
+static uint32_t diskfs_inode_bmap_indirect( struct fs_dirent *d, uint32_t block )
+{
+	struct bcache_entry *e;
+	uint32_t actual;
 
 	if(block<DISKFS_DIRECT_POINTERS) {
-		actual = d->disk.direct[block];
-	} else {
-		diskfs_data_block_read(d->volume,b,d->disk.indirect);
-		actual = b->pointers[block-DISKFS_DIRECT_POINTERS];
+		return d->disk.direct[block];
+	}
+
+	if(block-DISKFS_DIRECT_POINTERS>=DISKFS_POINTERS_PER_BLOCK || d->disk.indirect==0) {
+		return 0;
 	}
-		
-	return diskfs_data_block_read(d->volume,b,actual);
+
+	struct diskfs_block *iblock = diskfs_data_block_get(d->volume,d->disk.indirect,&e);
+	if(!iblock) return 0;
+
+	actual = iblock->pointers[block-DISKFS_DIRECT_POINTERS];
+	bcache_put(e);
+
+	return actual;
 }
 
-int diskfs_inode_write( struct fs_dirent *d, struct diskfs_block *b, uint32_t block )
-{
-	int actual;
+/*
+Like diskfs_inode_bmap_indirect, but allocate the data block (and the
+indirect block, if needed) when not already present.
+Returns zero if the disk is full.
+*/
 
+static uint32_t diskfs_inode_bmap_alloc_indirect( struct fs_dirent *d, uint32_t block )
+{
 	struct diskfs_inode *i = &d->disk;
+	struct bcache_entry *e;
+	uint32_t actual;
 
 	if(block<DISKFS_DIRECT_POINTERS) {
 		actual = i->direct[block];
 		if(actual==0) {
 			actual = diskfs_data_block_alloc(d->volume);
-			if(actual==0) return KERROR_OUT_OF_SPACE;
+			if(actual==0) return 0;
 			i->direct[block] = actual;
-			diskfs_inode_save(d->volume,d->inumber,i);	
+			diskfs_dirent_save(d);	
+		}
+		return actual;
+	}
+
+	if(block-DISKFS_DIRECT_POINTERS>=DISKFS_POINTERS_PER_BLOCK) {
+		return 0;
+	}
+
+	if(i->indirect==0) {
+		actual = diskfs_data_block_alloc(d->volume);
+		if(actual==0) return 0;
+		i->indirect = actual;
+		diskfs_dirent_save(d);	
+
+		struct diskfs_block *iblock = diskfs_data_block_get(d->volume,i->indirect,&e);
+		if(!iblock) return 0;
+		memset(iblock,0,DISKFS_BLOCK_SIZE);
+		bcache_mark_dirty(e);
+		bcache_put(e);
+	}
+
+	struct diskfs_block *iblock = diskfs_data_block_get(d->volume,i->indirect,&e);
+	if(!iblock) return 0;
+
+	actual = iblock->pointers[block-DISKFS_DIRECT_POINTERS];
+	if(actual==0) {
+		actual = diskfs_data_block_alloc(d->volume);
+		if(actual) {
+			iblock->pointers[block-DISKFS_DIRECT_POINTERS] = actual;
+			bcache_mark_dirty(e);
 		}
+	}
+	bcache_put(e);
+
+	return actual;
+}
+
+/*
+Search the extents of an inode for the one containing a logical
+block, starting from the resume point of the cached mapping if the
+block lies beyond it, and cache the extent found.  Only the extent
+blocks between the resume point and the block are read.
+Returns true if the block is mapped.
+*/
+
+static int diskfs_extent_lookup( struct fs_dirent *d, uint32_t block )
+{
+	struct diskfs_map *m = &d->disk_map;
+	struct diskfs_block *b;
+	struct bcache_entry *e;
+	uint32_t logical = 0;
+	uint32_t eb, i;
+
+	if(m->length>0 && block>=m->logical && block<m->logical+m->length) return 1;
+
+	if(m->resume_block && block>=m->resume_logical) {
+		eb = m->resume_block;
+		logical = m->resume_logical;
 	} else {
-		struct diskfs_block *iblock = page_alloc(0);
+		for(i=0;i<DISKFS_INODE_EXTENTS;i++) {
+			struct diskfs_extent *x = &d->disk.extents[i];
+			if(x->length==0) return 0;
+			if(block<logical+x->length) {
+				m->logical = logical;
+				m->physical = x->start;
+				m->length = x->length;
+				return 1;
+			}
+			logical += x->length;
+		}
+		eb = d->disk.extent_block;
+	}
 
-		if(i->indirect==0) {
-			actual = diskfs_data_block_alloc(d->volume);
-			if(actual==0) {
-				page_free(iblock);
-				return KERROR_OUT_OF_SPACE;
+	while(eb) {
+		b = diskfs_data_block_get(d->volume,eb,&e);
+		if(!b) return 0;
+
+		m->resume_block = eb;
+		m->resume_logical = logical;
+
+		for(i=0;i<b->extent_header.count && i<DISKFS_EXTENTS_PER_BLOCK;i++) {
+			struct diskfs_extent *x = &b->extents[i];
+			if(block<logical+x->length) {
+				m->logical = logical;
+				m->physical = x->start;
+				m->length = x->length;
+				bcache_put(e);
+				return 1;
 			}
-			i->indirect = actual;
-			diskfs_inode_save(d->volume,d->inumber,i);	
-			memset(iblock,0,DISKFS_BLOCK_SIZE);
-			diskfs_data_block_write(d->volume,iblock,i->indirect);
+			logical += x->length;
 		}
 
-		diskfs_data_block_read(d->volume,iblock,i->indirect);
-		actual = iblock->pointers[block-DISKFS_DIRECT_POINTERS];
-		if(actual==0) {
-			actual = diskfs_data_block_alloc(d->volume);
-			if(actual==0) {
-				page_free(iblock);
-				return KERROR_OUT_OF_SPACE;
+		eb = b->extent_header.next;
+		bcache_put(e);
+	}
+
+	return 0;
+}
+
+/* Find the number of blocks mapped by an inode and its last extent block, if not known. */
+
+static int diskfs_extent_tail( struct fs_dirent *d )
+{
+	struct diskfs_map *m = &d->disk_map;
+	struct diskfs_block *b;
+	struct bcache_entry *e;
+	uint32_t eb, next, i;
+
+	if(m->valid) return 1;
+
+	m->mapped = 0;
+	m->tail_block = 0;
+	m->next_physical = 0;
+
+	for(i=0;i<DISKFS_INODE_EXTENTS;i++) {
+		struct diskfs_extent *x = &d->disk.extents[i];
+		m->mapped += x->length;
+		if(x->length>0) m->next_physical = x->start+x->length;
+	}
+
+	for(eb=d->disk.extent_block;eb;eb=next) {
+		b = diskfs_data_block_get(d->volume,eb,&e);
+		if(!b) return 0;
+		for(i=0;i<b->extent_header.count && i<DISKFS_EXTENTS_PER_BLOCK;i++) {
+			struct diskfs_extent *x = &b->extents[i];
+			m->mapped += x->length;
+			if(x->length>0) m->next_physical = x->start+x->length;
+		}
+		m->tail_block = eb;
+		next = b->extent_header.next;
+		bcache_put(e);
+	}
+
+	m->valid = 1;
+	return 1;
+}
+
+/* Allocate a zeroed extent block holding the single extent (physical,1). */
+
+static uint32_t diskfs_extent_block_create( struct fs_dirent *d, uint32_t physical )
+{
+	struct diskfs_block *b;
+	struct bcache_entry *e;
+
+	uint32_t eb = diskfs_data_block_alloc(d->volume);
+	if(eb==0) return 0;
+
+	b = diskfs_data_block_get(d->volume,eb,&e);
+	if(!b) {
+		diskfs_data_block_free(d->volume,eb);
+		return 0;
+	}
+
+	memset(b->data,0,DISKFS_BLOCK_SIZE);
+	b->extent_header.count = 1;
+	b->extents[0].start = physical;
+	b->extents[0].length = 1;
+	bcache_mark_dirty(e);
+	bcache_put(e);
+
+	return eb;
+}
+
+/*
+Add the data block physical to the end of an inode, extending the
+last extent if the block follows on from it, or else starting a new
+extent in the inode, the last extent block, or a new extent block.
+*/
+
+static int diskfs_extent_append( struct fs_dirent *d, uint32_t physical )
+{
+	struct diskfs_map *m = &d->disk_map;
+	struct diskfs_inode *i = &d->disk;
+	struct diskfs_block *b;
+	struct bcache_entry *e;
+	uint32_t k, eb;
+
+	if(!diskfs_extent_tail(d)) return 0;
+
+	if(!m->tail_block) {
+		for(k=0;k<DISKFS_INODE_EXTENTS && i->extents[k].length>0;k++) {}
+
+		if(k>0 && i->extents[k-1].start+i->extents[k-1].length==physical) {
+			i->extents[k-1].length++;
+		} else if(k<DISKFS_INODE_EXTENTS) {
+			i->extents[k].start = physical;
+			i->extents[k].length = 1;
+		} else {
+			eb = diskfs_extent_block_create(d,physical);
+			if(!eb) return 0;
+			i->extent_block = eb;
+			m->tail_block = eb;
+		}
+
+		diskfs_dirent_save(d);
+		m->mapped++;
+		m->next_physical = physical+1;
+		return 1;
+	}
+
+	b = diskfs_data_block_get(d->volume,m->tail_block,&e);
+	if(!b) return 0;
+
+	k = b->extent_header.count;
+
+	if(k>0 && b->extents[k-1].start+b->extents[k-1].length==physical) {
+		b->extents[k-1].length++;
+	} else if(k<DISKFS_EXTENTS_PER_BLOCK) {
+		b->extents[k].start = physical;
+		b->extents[k].length = 1;
+		b->extent_header.count++;
+	} else {
+		eb = diskfs_extent_block_create(d,physical);
+		if(!eb) {
+			bcache_put(e);
+			return 0;
+		}
+		b->extent_header.next = eb;
+		m->tail_block = eb;
+	}
+
+	bcache_mark_dirty(e);
+	bcache_put(e);
+
+	m->mapped++;
+	m->next_physical = physical+1;
+	return 1;
+}
+
+/*
+Take the next block for appending to an inode from its preallocation
+window, refilling the window with a run of up to DISKFS_PREALLOC_BLOCKS
+that continues the file on disk if possible.  Because each file
+draws from its own window, files written at the same time are laid
+out in contiguous runs rather than interleaved block by block.
+*/
+
+static uint32_t diskfs_extent_data_alloc( struct fs_dirent *d )
+{
+	struct diskfs_map *m = &d->disk_map;
+	uint32_t got;
+
+	if(m->prealloc_count==0) {
+		uint32_t start = diskfs_data_block_alloc_run(d->volume,m->next_physical,DISKFS_PREALLOC_BLOCKS,&got);
+		if(start==0) return 0;
+		m->prealloc_start = start;
+		m->prealloc_count = got;
+	}
+
+	m->prealloc_count--;
+	return m->prealloc_start++;
+}
+
+/* Return any unused preallocated blocks to the bitmap. */
+
+static void diskfs_extent_prealloc_release( struct fs_dirent *d )
+{
+	struct diskfs_map *m = &d->disk_map;
+
+	while(m->prealloc_count>0) {
+		diskfs_data_block_free(d->volume,m->prealloc_start++);
+		m->prealloc_count--;
+	}
+}
+
+/*
+Map a logical block of an inode with extents, allocating blocks up
+to and including it if it lies beyond the end of the file.  Since
+extents leave no gaps, any blocks skipped over are allocated and
+zeroed.  Returns zero if the disk is full.
+*/
+
+static uint32_t diskfs_inode_bmap_alloc_extents( struct fs_dirent *d, uint32_t block )
+{
+	struct diskfs_map *m = &d->disk_map;
+	struct diskfs_block *b;
+	struct bcache_entry *e;
+	uint32_t actual = 0;
+
+	if(!diskfs_extent_tail(d)) return 0;
+
+	if(block<m->mapped) {
+		if(!diskfs_extent_lookup(d,block)) return 0;
+		return m->physical + block - m->logical;
+	}
+
+	while(m->mapped<=block) {
+		actual = diskfs_extent_data_alloc(d);
+		if(actual==0) return 0;
+
+		if(!diskfs_extent_append(d,actual)) {
+			diskfs_data_block_free(d->volume,actual);
+			return 0;
+		}
+
+		if(m->mapped<=block) {
+			b = diskfs_data_block_get(d->volume,actual,&e);
+			if(b) {
+				memset(b->data,0,DISKFS_BLOCK_SIZE);
+				bcache_mark_dirty(e);
+				bcache_put(e);
 			}
-			iblock->pointers[block-DISKFS_DIRECT_POINTERS] = actual;
-			diskfs_data_block_write(d->volume,iblock,i->indirect);
 		}
-		page_free(iblock);
 	}
 
+	return actual;
+}
+
+/*
+Map a logical block of an inode to a data block number, and give the
+number of blocks from there that are contiguous on disk in *run.
+Returns zero if the block is not (yet) allocated.
+*/
+
+static uint32_t diskfs_inode_bmap_run( struct fs_dirent *d, uint32_t block, uint32_t *run )
+{
+	struct diskfs_map *m = &d->disk_map;
+
+	if(!diskfs_volume_extents(d->volume)) {
+		*run = 1;
+		return diskfs_inode_bmap_indirect(d,block);
+	}
+
+	if(!diskfs_extent_lookup(d,block)) {
+		*run = 0;
+		return 0;
+	}
+
+	*run = m->logical + m->length - block;
+	return m->physical + block - m->logical;
+}
+
+static uint32_t diskfs_inode_bmap( struct fs_dirent *d, uint32_t block )
+{
+	uint32_t run;
+	return diskfs_inode_bmap_run(d,block,&run);
+}
+
+static uint32_t diskfs_inode_bmap_alloc( struct fs_dirent *d, uint32_t block )
+{
+	if(diskfs_volume_extents(d->volume)) {
+		return diskfs_inode_bmap_alloc_extents(d,block);
+	} else {
+		return diskfs_inode_bmap_alloc_indirect(d,block);
+	}
+}
+
+int diskfs_inode_read( struct fs_dirent *d, struct diskfs_block *b, uint32_t block )
+{
+	return diskfs_data_block_read(d->volume,b,diskfs_inode_bmap(d,block));
+}
+
+int diskfs_inode_write( struct fs_dirent *d, struct diskfs_block *b, uint32_t block )
+{
+	uint32_t actual = diskfs_inode_bmap_alloc(d,block);
+	if(actual==0) return KERROR_OUT_OF_SPACE;
 	return diskfs_data_block_write(d->volume,b,actual);
 }
 
+/* Pin a logical block of an inode, allocating it if necessary. */
+
+static struct diskfs_block * diskfs_inode_get( struct fs_dirent *d, uint32_t block, struct bcache_entry **e )
+{
+	uint32_t actual = diskfs_inode_bmap_alloc(d,block);
+	if(actual==0) return 0;
+	return diskfs_data_block_get(d->volume,actual,e);
+}
+
+/*
+Open dirents are kept in a hash table by (volume,inumber), so that
+opening an inode that is already open shares the same dirent, and
+its inode is neither read again nor seen stale by other handles.
+*/
+
+#define DISKFS_ICACHE_BITS 8
+#define DISKFS_ICACHE_BUCKETS (1<<DISKFS_ICACHE_BITS)
+#define DISKFS_ICACHE_GOLDEN_RATIO 0x61C88647
+
+static struct fs_dirent *diskfs_icache[DISKFS_ICACHE_BUCKETS];
+
+static unsigned diskfs_icache_hash( struct fs_volume *v, int inumber )
+{
+	unsigned key = ((unsigned)v>>4) + inumber;
+	return (key*DISKFS_ICACHE_GOLDEN_RATIO) >> (32-DISKFS_ICACHE_BITS);
+}
+
+static struct fs_dirent * diskfs_icache_lookup( struct fs_volume *v, int inumber )
+{
+	struct fs_dirent *d;
+
+	for(d=diskfs_icache[diskfs_icache_hash(v,inumber)];d;d=d->disk_hash_next) {
+		if(d->volume==v && d->inumber==inumber) return d;
+	}
+
+	return 0;
+}
+
+static void diskfs_icache_insert( struct fs_dirent *d )
+{
+	unsigned h = diskfs_icache_hash(d->volume,d->inumber);
+	d->disk_hash_next = diskfs_icache[h];
+	diskfs_icache[h] = d;
+}
+
+static void diskfs_icache_remove( struct fs_dirent *d )
+{
+	struct fs_dirent **p = &diskfs_icache[diskfs_icache_hash(d->volume,d->inumber)];
+
+	while(*p) {
+		if(*p==d) {
+			*p = d->disk_hash_next;
+			d->disk_hash_next = 0;
+			return;
+		}
+		p = &(*p)->disk_hash_next;
+	}
+}
+
 struct fs_dirent * diskfs_dirent_create( struct fs_volume *volume, int inumber, int type )
 {
-	struct fs_dirent *d = kmalloc(sizeof(*d));
+	struct fs_dirent *d = diskfs_icache_lookup(volume,inumber);
+	if(d) {
+		d->refcount++;
+		return d;
+	}
+
+	d = slab_alloc(&fs_dirent_cache);
+	if(!d) return 0;
 	memset(d,0,sizeof(*d));
 
 	diskfs_inode_load(volume,inumber,&d->disk);
@@ -262,53 +891,149 @@ struct fs_dirent * diskfs_dirent_create( struct fs_volume *volume, int inumber,
 	d->inumber = inumber;
 	d->refcount = 1;
 	d->isdir = type==DISKFS_ITEM_DIR;
+
+	diskfs_icache_insert(d);
 	return d;
 }
 
+/* Returns true if two strings a and b (with lengths) have the same contents. Note that diskfs_item.name is not null-terminated but has diskfs_item.name_length characters. When comparing to a null-terminated string, we must check the length first and then the bytes of the string. */
+
+static int diskfs_name_equals( const char *a, int alength, const char *b, int blength )
+{
+	return alength==blength && !strncmp(a,b,alength);
+}
+
+/* FNV-1a hash of a name, which places it in an indexed directory. */
+
+static uint32_t diskfs_name_hash( const char *name, int length )
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	for(i=0;i<length;i++) {
+		h = (h ^ (uint8_t)name[i]) * 16777619u;
+	}
+
+	return h;
+}
+
+static struct diskfs_index_entry * diskfs_index_entry( struct diskfs_block *b, uint32_t k )
+{
+	return &b->index_slots[k/DISKFS_INDEX_ENTRIES_PER_SLOT].entries[k%DISKFS_INDEX_ENTRIES_PER_SLOT];
+}
+
+/*
+Return the position of the last index entry with a hash no greater
+than h.  The first entry has hash zero, and the hashes increase.
+*/
+
+static uint32_t diskfs_index_search( struct diskfs_block *b, uint32_t h )
+{
+	uint32_t lo = 0;
+	uint32_t hi = b->index_header.count;
+
+	while(hi-lo>1) {
+		uint32_t mid = (lo+hi)/2;
+		if(diskfs_index_entry(b,mid)->hash<=h) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/*
+If d is an indexed directory, set *leaf to the block that should hold
+names with hash h and *flags to the flags of the index, and return true.
+*/
+
+static int diskfs_index_lookup( struct fs_dirent *d, uint32_t h, uint32_t *leaf, uint32_t *flags )
+{
+	struct bcache_entry *e;
+
+	if(d->size<=DISKFS_BLOCK_SIZE) return 0;
+
+	struct diskfs_block *b = diskfs_data_block_get(d->volume,diskfs_inode_bmap(d,0),&e);
+	if(!b) return 0;
+
+	int indexed = b->index_header.magic==DISKFS_INDEX_MAGIC && b->index_header.type==DISKFS_ITEM_BLANK && b->index_header.count>0;
+	if(indexed) {
+		*leaf = diskfs_index_entry(b,diskfs_index_search(b,h))->block;
+		*flags = b->index_header.flags;
+	}
+
+	bcache_put(e);
+	return indexed;
+}
+
+/* Find the item named name in logical block i of directory d, leaving that block pinned in *e. */
 
-int diskfs_dirent_close( struct fs_dirent *d )
+static struct diskfs_item * diskfs_dirent_find_in_block( struct fs_dirent *d, uint32_t i, const char *name, int name_length, struct bcache_entry **e )
 {
-	// XXX check if inode dirty first
-	diskfs_inode_save(d->volume,d->inumber,&d->disk);
-	return 0;
-}
+	int j;
 
-/* Returns true if two strings a and b (with lengths) have the same contents. Note that diskfs_item.name is not null-terminated but has diskfs_item.name_length characters. When comparing to a null-terminated string, we must check the length first and then the bytes of the string. */
+	struct diskfs_block *b = diskfs_data_block_get(d->volume,diskfs_inode_bmap(d,i),e);
+	if(!b) return 0;
 
-static int diskfs_name_equals( const char *a, int alength, const char *b, int blength )
-{
-	return alength==blength && !strncmp(a,b,alength);
+	for(j=0;j<DISKFS_ITEMS_PER_BLOCK;j++) {
+		struct diskfs_item *r = &b->items[j];
+		if(r->type!=DISKFS_ITEM_BLANK && diskfs_name_equals(name,name_length,r->name,r->name_length)) {
+			return r;
+		}
+	}
+
+	bcache_put(*e);
+	return 0;
 }
 
-struct fs_dirent * diskfs_dirent_lookup( struct fs_dirent *d, const char *name )
+/*
+Find the item named name in directory d, leaving the block that holds
+it pinned in *e.  An indexed directory needs only its root and one leaf.
+*/
+
+static struct diskfs_item * diskfs_dirent_find( struct fs_dirent *d, const char *name, struct bcache_entry **e )
 {
-	struct diskfs_block *b = page_alloc(0);
-	int i, j;
+	struct diskfs_item *r;
+	uint32_t i, leaf, flags;
 
-	int nblocks = d->size / DISKFS_BLOCK_SIZE;
+	uint32_t nblocks = d->size / DISKFS_BLOCK_SIZE;
 	if(d->size%DISKFS_BLOCK_SIZE) nblocks++;
 
 	int name_length = strlen(name);
-	
+
+	if(diskfs_index_lookup(d,diskfs_name_hash(name,name_length),&leaf,&flags)) {
+		r = diskfs_dirent_find_in_block(d,leaf,name,name_length,e);
+		if(r || !(flags&DISKFS_INDEX_PARTIAL)) return r;
+	}
+
 	for(i=0;i<nblocks;i++) {
-		diskfs_inode_read(d,b,i);
-		for(j=0;j<DISKFS_ITEMS_PER_BLOCK;j++) {
-			struct diskfs_item *r = &b->items[j];
-			if(r->type!=DISKFS_ITEM_BLANK && diskfs_name_equals(name,name_length,r->name,r->name_length)) {
-				int inumber = r->inumber;
-				page_free(b);
-				return diskfs_dirent_create(d->volume,inumber,r->type);
-			}
-		}
+		r = diskfs_dirent_find_in_block(d,i,name,name_length,e);
+		if(r) return r;
 	}
 
-	page_free(b);
 	return 0;
 }
 
+struct fs_dirent * diskfs_dirent_lookup( struct fs_dirent *d, const char *name )
+{
+	struct bcache_entry *e;
+
+	struct diskfs_item *r = diskfs_dirent_find(d,name,&e);
+	if(!r) return 0;
+
+	int inumber = r->inumber;
+	int type = r->type;
+	bcache_put(e);
+
+	return diskfs_dirent_create(d->volume,inumber,type);
+}
+
 int diskfs_dirent_list( struct fs_dirent *d, char *buffer, int length )
 {
-	struct diskfs_block *b = page_alloc(0);
+	struct diskfs_block *b;
+	struct bcache_entry *e;
 
 	int nblocks = d->size / DISKFS_BLOCK_SIZE;
 	if(d->size%DISKFS_BLOCK_SIZE) nblocks++;
@@ -317,7 +1042,8 @@ int diskfs_dirent_list( struct fs_dirent *d, char *buffer, int length )
 	int total = 0;
 
 	for(i=0;i<nblocks;i++) {
-		diskfs_inode_read(d,b,i);
+		b = diskfs_data_block_get(d->volume,diskfs_inode_bmap(d,i),&e);
+		if(!b) break;
 
 		for(j=0;j<DISKFS_ITEMS_PER_BLOCK;j++) {
 			struct diskfs_item *r = &b->items[j];
@@ -335,9 +1061,9 @@ int diskfs_dirent_list( struct fs_dirent *d, char *buffer, int length )
 					break;
 			}
 		}
-	}
 
-	page_free(b);
+		bcache_put(e);
+	}
 
 	return total;
 }
@@ -345,66 +1071,376 @@ int diskfs_dirent_list( struct fs_dirent *d, char *buffer, int length )
 int diskfs_dirent_resize( struct fs_dirent *d, uint32_t size )
 {
 	d->size = d->disk.size = size;
+	d->disk_dirty = 1;
 	return 0;
 }
 
-static int diskfs_dirent_add( struct fs_dirent *d, const char *name, int type, int inumber )
+static void diskfs_item_set( struct diskfs_item *r, const char *name, int type, int inumber )
 {
-	struct diskfs_block *b = page_alloc(0);
-	int i, j;
+	r->type = type;
+	r->inumber = inumber;
+	r->name_length = strlen(name);
+	memcpy(r->name,name,r->name_length);
+}
 
-	int nblocks = d->size / DISKFS_BLOCK_SIZE;
+/*
+Place a new item in the first blank slot of logical blocks [first,nblocks)
+of directory d.  Returns one if a slot was found, zero if not.
+*/
+
+static int diskfs_dirent_add_free( struct fs_dirent *d, uint32_t first, const char *name, int type, int inumber )
+{
+	struct diskfs_block *b;
+	struct bcache_entry *e;
+	struct diskfs_item *r;
+	uint32_t i;
+	int j;
+
+	uint32_t nblocks = d->size / DISKFS_BLOCK_SIZE;
 	if(d->size%DISKFS_BLOCK_SIZE) nblocks++;
 
-	for(i=0;i<nblocks;i++) {
-		diskfs_inode_read(d,b,i);
+	for(i=first;i<nblocks;i++) {
+		b = diskfs_inode_get(d,i,&e);
+		if(!b) return KERROR_OUT_OF_SPACE;
 		for(j=0;j<DISKFS_ITEMS_PER_BLOCK;j++) {
-			struct diskfs_item *r = &b->items[j];
+			r = &b->items[j];
 			if(r->type==DISKFS_ITEM_BLANK) {
 
-				r->type = type;
-				r->inumber = inumber;
-				r->name_length = strlen(name);
-				memcpy(r->name,name,r->name_length);
+				diskfs_item_set(r,name,type,inumber);
 
 				/* Save the modified data block. */
-				diskfs_inode_write(d,b,i);
+				bcache_mark_dirty(e);
+				bcache_put(e);
 
 				/* If this increased the logical size, update that too. */
 				uint32_t newsize = (i*DISKFS_BLOCK_SIZE) + (j+1)*sizeof(struct diskfs_item);
 				if(newsize>d->size) {
 					diskfs_dirent_resize(d,newsize);
-					diskfs_inode_save(d->volume,d->inumber,&d->disk);
+					diskfs_dirent_save(d);
 				}
-				page_free(b);
-				return 0;
+				return 1;
 			}
 		}
+		bcache_put(e);
 	}
 
+	return 0;
+}
+
+/* Append a new block to directory d holding just one item. */
+
+static int diskfs_dirent_add_block( struct fs_dirent *d, const char *name, int type, int inumber )
+{
+	struct diskfs_block *b;
+	struct bcache_entry *e;
+
+	uint32_t nblocks = d->size / DISKFS_BLOCK_SIZE;
+	if(d->size%DISKFS_BLOCK_SIZE) nblocks++;
+
+	b = diskfs_inode_get(d,nblocks,&e);
+	if(!b) return KERROR_OUT_OF_SPACE;
+
 	memset(b->data,0,DISKFS_BLOCK_SIZE);
-	struct diskfs_item *r = &b->items[0];
+	diskfs_item_set(&b->items[0],name,type,inumber);
 
-	r->inumber = inumber;
-	r->type = type;
-	r->name_length = strlen(name);
-	memcpy(r->name,name,r->name_length);
+	bcache_mark_dirty(e);
+	bcache_put(e);
 
-	diskfs_dirent_resize(d,d->size+sizeof(*r));
-	diskfs_inode_write(d,b,i);
-	diskfs_inode_save(d->volume,d->inumber,&d->disk);
+	diskfs_dirent_resize(d,nblocks*DISKFS_BLOCK_SIZE+sizeof(struct diskfs_item));
+	diskfs_dirent_save(d);
+
+	return 0;
+}
+
+/* An item along with its hash, while a leaf is being split. */
+
+struct diskfs_index_item {
+	uint32_t hash;
+	struct diskfs_item item;
+};
+
+/*
+Return true if the items may be divided before position j: equal
+hashes must stay together, and the hash of items[j] becomes the
+separator of the new leaf, so it must lie strictly between lo and hi
+to keep the root in order.  A hi of zero means there is no upper bound.
+*/
+
+static int diskfs_index_divides( struct diskfs_index_item *items, int j, uint32_t lo, uint32_t hi )
+{
+	uint32_t h = items[j].hash;
+	return h!=items[j-1].hash && h>lo && (hi==0 || h<hi);
+}
+
+/*
+Sort n items by hash, and return the position nearest the middle at
+which they can be divided into leaves covering [lo,h) and [h,hi), or
+zero if they cannot be divided at all.  A partial index may have
+placed items in a leaf outside its range, so not every position will
+do.  n is at most one more than a block holds, so a simple insertion
+sort is enough.
+*/
+
+static int diskfs_index_divide( struct diskfs_index_item *items, int n, uint32_t lo, uint32_t hi )
+{
+	struct diskfs_index_item t;
+	int i, j;
+
+	for(i=1;i<n;i++) {
+		t = items[i];
+		for(j=i;j>0 && items[j-1].hash>t.hash;j--) {
+			items[j] = items[j-1];
+		}
+		items[j] = t;
+	}
+
+	if(n<2) return 0;
+
+	for(j=n/2;j<n;j++) {
+		if(diskfs_index_divides(items,j,lo,hi)) return j;
+	}
+
+	for(j=n/2-1;j>0;j--) {
+		if(diskfs_index_divides(items,j,lo,hi)) return j;
+	}
+
+	return 0;
+}
+
+/* Collect the items of a directory block, returning the number found. */
+
+static int diskfs_index_gather( struct diskfs_block *b, struct diskfs_index_item *items )
+{
+	int j, n = 0;
+
+	for(j=0;j<DISKFS_ITEMS_PER_BLOCK;j++) {
+		struct diskfs_item *r = &b->items[j];
+		if(r->type!=DISKFS_ITEM_BLANK) {
+			items[n].item = *r;
+			items[n].hash = diskfs_name_hash(r->name,r->name_length);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+static void diskfs_index_fill( struct diskfs_block *b, struct diskfs_index_item *items, int n )
+{
+	int j;
+
+	memset(b->data,0,DISKFS_BLOCK_SIZE);
+	for(j=0;j<n;j++) {
+		b->items[j] = items[j].item;
+	}
+}
+
+/*
+Convert a linear directory of one full block into an indexed one, by
+moving its items into one or two new leaves divided by hash, and then
+turning block zero into the root.  The leaves are written first, so
+the directory is still linear if this fails.
+*/
+
+static int diskfs_index_create( struct fs_dirent *d )
+{
+	struct diskfs_block *root, *b;
+	struct bcache_entry *re, *e;
+	int i;
+
+	struct diskfs_index_item *items = kmalloc(DISKFS_ITEMS_PER_BLOCK*sizeof(*items));
+	if(!items) return KERROR_OUT_OF_MEMORY;
+
+	root = diskfs_data_block_get(d->volume,diskfs_inode_bmap(d,0),&re);
+	if(!root) {
+		kfree(items);
+		return KERROR_OUT_OF_SPACE;
+	}
+
+	int n = diskfs_index_gather(root,items);
+	int split = diskfs_index_divide(items,n,0,0);
+	int nleaves = split ? 2 : 1;
+
+	for(i=0;i<nleaves;i++) {
+		b = diskfs_inode_get(d,i+1,&e);
+		if(!b) {
+			bcache_put(re);
+			kfree(items);
+			return KERROR_OUT_OF_SPACE;
+		}
+		if(i==0) {
+			diskfs_index_fill(b,items,split ? split : n);
+		} else {
+			diskfs_index_fill(b,items+split,n-split);
+		}
+		bcache_mark_dirty(e);
+		bcache_put(e);
+	}
+
+	memset(root->data,0,DISKFS_BLOCK_SIZE);
+	root->index_header.magic = DISKFS_INDEX_MAGIC;
+	root->index_header.type = DISKFS_ITEM_BLANK;
+	root->index_header.count = nleaves;
+	diskfs_index_entry(root,0)->hash = 0;
+	diskfs_index_entry(root,0)->block = 1;
+	if(split) {
+		diskfs_index_entry(root,1)->hash = items[split].hash;
+		diskfs_index_entry(root,1)->block = 2;
+	}
+	bcache_mark_dirty(re);
+	bcache_put(re);
+
+	kfree(items);
+
+	diskfs_dirent_resize(d,(nleaves+1)*DISKFS_BLOCK_SIZE);
+	diskfs_dirent_save(d);
+
+	return 0;
+}
+
+/*
+Split the full leaf b, found at position k of the root, into itself
+and a new leaf appended to the directory, and place the new item in
+whichever half its hash falls.  Fails if the names cannot be divided.
+*/
+
+static int diskfs_index_split( struct fs_dirent *d, struct diskfs_block *root, uint32_t k, struct diskfs_block *b, const char *name, int type, int inumber )
+{
+	struct diskfs_block *nb;
+	struct bcache_entry *ne;
+	uint32_t i;
+
+	uint32_t nblocks = d->size / DISKFS_BLOCK_SIZE;
+	if(d->size%DISKFS_BLOCK_SIZE) nblocks++;
+
+	struct diskfs_index_item *items = kmalloc((DISKFS_ITEMS_PER_BLOCK+1)*sizeof(*items));
+	if(!items) return KERROR_OUT_OF_MEMORY;
+
+	int n = diskfs_index_gather(b,items);
+	memset(&items[n].item,0,sizeof(items[n].item));
+	diskfs_item_set(&items[n].item,name,type,inumber);
+	items[n].hash = diskfs_name_hash(name,strlen(name));
+	n++;
+
+	uint32_t lo = diskfs_index_entry(root,k)->hash;
+	uint32_t hi = k+1<root->index_header.count ? diskfs_index_entry(root,k+1)->hash : 0;
+
+	int split = diskfs_index_divide(items,n,lo,hi);
+	if(!split) {
+		kfree(items);
+		return KERROR_OUT_OF_SPACE;
+	}
+
+	nb = diskfs_inode_get(d,nblocks,&ne);
+	if(!nb) {
+		kfree(items);
+		return KERROR_OUT_OF_SPACE;
+	}
+
+	diskfs_index_fill(b,items,split);
+	diskfs_index_fill(nb,items+split,n-split);
+	bcache_mark_dirty(ne);
+	bcache_put(ne);
+
+	for(i=root->index_header.count;i>k+1;i--) {
+		*diskfs_index_entry(root,i) = *diskfs_index_entry(root,i-1);
+	}
+	diskfs_index_entry(root,k+1)->hash = items[split].hash;
+	diskfs_index_entry(root,k+1)->block = nblocks;
+	root->index_header.count++;
+
+	kfree(items);
+
+	diskfs_dirent_resize(d,(nblocks+1)*DISKFS_BLOCK_SIZE);
+	diskfs_dirent_save(d);
 
-       	page_free(b);
 	return 0;
 }
 
+/*
+Add an item to an indexed directory, in the leaf chosen by its hash,
+splitting that leaf if it is full.  If it cannot be split, the item
+goes anywhere and the index is marked partial.
+*/
+
+static int diskfs_index_add( struct fs_dirent *d, const char *name, int type, int inumber )
+{
+	struct diskfs_block *root, *b;
+	struct bcache_entry *re, *e;
+	int j, result;
+
+	uint32_t h = diskfs_name_hash(name,strlen(name));
+
+	root = diskfs_data_block_get(d->volume,diskfs_inode_bmap(d,0),&re);
+	if(!root) return KERROR_OUT_OF_SPACE;
+
+	uint32_t k = diskfs_index_search(root,h);
+
+	b = diskfs_data_block_get(d->volume,diskfs_inode_bmap(d,diskfs_index_entry(root,k)->block),&e);
+	if(!b) {
+		bcache_put(re);
+		return KERROR_OUT_OF_SPACE;
+	}
+
+	for(j=0;j<DISKFS_ITEMS_PER_BLOCK;j++) {
+		struct diskfs_item *r = &b->items[j];
+		if(r->type==DISKFS_ITEM_BLANK) {
+			diskfs_item_set(r,name,type,inumber);
+			bcache_mark_dirty(e);
+			bcache_put(e);
+			bcache_put(re);
+			return 0;
+		}
+	}
+
+	if(root->index_header.count<DISKFS_INDEX_MAX && diskfs_index_split(d,root,k,b,name,type,inumber)==0) {
+		bcache_mark_dirty(e);
+		bcache_put(e);
+		bcache_mark_dirty(re);
+		bcache_put(re);
+		return 0;
+	}
+
+	bcache_put(e);
+	root->index_header.flags |= DISKFS_INDEX_PARTIAL;
+	bcache_mark_dirty(re);
+	bcache_put(re);
+
+	result = diskfs_dirent_add_free(d,1,name,type,inumber);
+	if(result!=0) return result<0 ? result : 0;
+
+	return diskfs_dirent_add_block(d,name,type,inumber);
+}
+
+static int diskfs_dirent_add( struct fs_dirent *d, const char *name, int type, int inumber )
+{
+	uint32_t leaf, flags;
+	int result;
+
+	if(diskfs_index_lookup(d,0,&leaf,&flags)) {
+		return diskfs_index_add(d,name,type,inumber);
+	}
+
+	result = diskfs_dirent_add_free(d,0,name,type,inumber);
+	if(result!=0) return result<0 ? result : 0;
+
+	/* Index a directory once its first block fills, if the volume has extents. */
+	if(d->size==DISKFS_BLOCK_SIZE && diskfs_volume_extents(d->volume)) {
+		result = diskfs_index_create(d);
+		if(result<0) return result;
+		return diskfs_index_add(d,name,type,inumber);
+	}
+
+	return diskfs_dirent_add_block(d,name,type,inumber);
+}
+
 struct fs_dirent * diskfs_dirent_create_file_or_dir( struct fs_dirent *d, const char *name, int type )
 {
 	if(strlen(name)>DISKFS_NAME_MAX) return 0; // KERROR_NAME_TOO_LONG
 	
-	struct fs_dirent *t = diskfs_dirent_lookup(d,name);
-	if(t) {
-		diskfs_dirent_close(t);
+	struct bcache_entry *e;
+	if(diskfs_dirent_find(d,name,&e)) {
+		bcache_put(e);
 		return 0;
 	}
 
@@ -432,72 +1468,132 @@ struct fs_dirent * diskfs_dirent_create_dir( struct fs_dirent *d, const char *na
 	return diskfs_dirent_create_file_or_dir(d,name,DISKFS_ITEM_DIR);
 }
 
-void diskfs_inode_delete( struct fs_volume *v, struct diskfs_inode *node, int inumber )
+static void diskfs_extent_free( struct fs_volume *v, struct diskfs_extent *x )
+{
+	uint32_t i;
+	for(i=0;i<x->length;i++) {
+		diskfs_data_block_free(v,x->start+i);
+	}
+}
+
+static void diskfs_inode_free_extents( struct fs_volume *v, struct diskfs_inode *node )
+{
+	struct diskfs_block *b;
+	struct bcache_entry *e;
+	uint32_t eb, next, i;
+
+	for(i=0;i<DISKFS_INODE_EXTENTS;i++) {
+		diskfs_extent_free(v,&node->extents[i]);
+	}
+
+	for(eb=node->extent_block;eb;eb=next) {
+		b = diskfs_data_block_get(v,eb,&e);
+		if(!b) break;
+		for(i=0;i<b->extent_header.count && i<DISKFS_EXTENTS_PER_BLOCK;i++) {
+			diskfs_extent_free(v,&b->extents[i]);
+		}
+		next = b->extent_header.next;
+		bcache_put(e);
+		diskfs_data_block_free(v,eb);
+	}
+}
+
+static void diskfs_inode_free_indirect( struct fs_volume *v, struct diskfs_inode *node )
 {
+	struct bcache_entry *e;
 	int size = 0;
 	int i;
 
-
-	// XXX check for errors in here
 	for(i=0;i<DISKFS_DIRECT_POINTERS;i++) {
+		if(size>=node->size) break;
 		diskfs_data_block_free(v,node->direct[i]);
 		size += v->block_size;
-		if(size>=node->size) break;
 	}
 
 	if(size<node->size) {
-		struct diskfs_block *b = page_alloc(0);
-		diskfs_data_block_read(v,b,node->indirect);
-		for(i=0;i<DISKFS_POINTERS_PER_BLOCK;i++) {
-			diskfs_data_block_free(v,b->pointers[i]);
-			size += v->block_size;
-			if(size>=node->size) break;
+		struct diskfs_block *b = diskfs_data_block_get(v,node->indirect,&e);
+		if(b) {
+			for(i=0;i<DISKFS_POINTERS_PER_BLOCK;i++) {
+				if(size>=node->size) break;
+				diskfs_data_block_free(v,b->pointers[i]);
+				size += v->block_size;
+			}
+			bcache_put(e);
 		}
-		page_free(b);
+		diskfs_data_block_free(v,node->indirect);
+	}
+}
+
+void diskfs_inode_delete( struct fs_volume *v, struct diskfs_inode *node, int inumber )
+{
+	// XXX check for errors in here
+	if(diskfs_volume_extents(v)) {
+		diskfs_inode_free_extents(v,node);
+	} else {
+		diskfs_inode_free_indirect(v,node);
 	}
 
-	memset(node,sizeof(*node),0);
+	memset(node,0,sizeof(*node));
 	diskfs_inode_save(v,inumber,node);
 	diskfs_inumber_free(v,inumber);
 }
 
 int diskfs_dirent_remove( struct fs_dirent *d, const char *name )
 {
-	struct diskfs_block *b = page_alloc(0);
+	struct bcache_entry *e;
+	struct diskfs_inode inode;
 
-	int name_length = strlen(name);
+	struct diskfs_item *r = diskfs_dirent_find(d,name,&e);
+	if(!r) return KERROR_NOT_FOUND;
 
-	int i, j;
-	int nblocks = d->size / DISKFS_BLOCK_SIZE;
-	if(d->size%DISKFS_BLOCK_SIZE) nblocks++;
+	int inumber = r->inumber;
 
-	for(i=0;i<nblocks;i++) {
-		diskfs_inode_read(d,b,i);
-		for(j=0;j<DISKFS_ITEMS_PER_BLOCK;j++) {
-			struct diskfs_item *r = &b->items[j];
+	/* If the inode is open, its cached copy is the current one. */
+	struct fs_dirent *t = diskfs_icache_lookup(d->volume,inumber);
+	if(t) {
+		inode = t->disk;
+	} else {
+		diskfs_inode_load(d->volume,inumber,&inode);
+	}
 
-			if(r->type!=DISKFS_ITEM_BLANK && r->name_length==name_length && diskfs_name_equals(name,name_length,r->name,r->name_length)) {
+	if(r->type==DISKFS_ITEM_DIR && inode.size>0) {
+		bcache_put(e);
+		return KERROR_NOT_EMPTY;
+	}
 
-				if(r->type==DISKFS_ITEM_DIR) {
-					struct diskfs_inode inode;
-					diskfs_inode_load(d->volume,r->inumber,&inode);
-					if(inode.size>0) {
-						page_free(b);
-						return KERROR_NOT_EMPTY;
-					}
-				}
+	r->type = DISKFS_ITEM_BLANK;
+	bcache_mark_dirty(e);
+	bcache_put(e);
 
-				int inumber = r->inumber;
-				r->type = DISKFS_ITEM_BLANK;
-				diskfs_inode_write(d,b,i);
-				diskfs_inode_delete(d->volume,&d->disk,inumber);
-				page_free(b);
-				return 0;
-			}
-		}
+	/*
+	If the inode is still open, it stays allocated, along with its
+	blocks, so that the open handles keep working on blocks that are
+	still their own.  It is deleted by the last close.
+	*/
+	if(t) {
+		diskfs_icache_remove(t);
+		t->disk_unlinked = 1;
+		t->generation++;
+		return 0;
 	}
 
-	return KERROR_NOT_FOUND;
+	diskfs_inode_delete(d->volume,&inode,inumber);
+	return 0;
+}
+
+/* Called on the last close of a dirent, before it is freed. */
+
+int diskfs_dirent_close( struct fs_dirent *d )
+{
+	diskfs_extent_prealloc_release(d);
+	diskfs_icache_remove(d);
+
+	if(d->disk_unlinked) {
+		diskfs_inode_delete(d->volume,&d->disk,d->inumber);
+	} else if(d->disk_dirty) {
+		diskfs_dirent_save(d);
+	}
+	return 0;
 }
 
 int diskfs_dirent_write_block( struct fs_dirent *d, const char *data, uint32_t blockno )
@@ -510,21 +1606,67 @@ int diskfs_dirent_read_block( struct fs_dirent *d, char *data, uint32_t blockno
 	return diskfs_inode_read(d,(void*)data,blockno);
 }
 
+/*
+Prefetch logical blocks [blockno,blockno+nblocks) of an inode,
+issuing one read-ahead per run of physically contiguous blocks.
+With extents, each lookup maps a whole run at once.
+Stops at the first unallocated block.
+*/
+
+int diskfs_dirent_readahead( struct fs_dirent *d, uint32_t blockno, uint32_t nblocks )
+{
+	uint32_t run_start = 0;
+	uint32_t run_length = 0;
+	int total = 0;
+	uint32_t i, n;
+
+	for(i=0;i<nblocks;i+=n) {
+		uint32_t actual = diskfs_inode_bmap_run(d,blockno+i,&n);
+		if(actual==0) break;
+		n = MIN(n,nblocks-i);
+		if(run_length>0 && actual==run_start+run_length) {
+			run_length += n;
+			continue;
+		}
+		if(run_length>0) {
+			total += bcache_readahead(d->volume->device,d->volume->disk.data_start+run_start,run_length);
+		}
+		run_start = actual;
+		run_length = n;
+	}
+
+	if(run_length>0) {
+		total += bcache_readahead(d->volume->device,d->volume->disk.data_start+run_start,run_length);
+	}
+
+	return total;
+}
+
 extern struct fs disk_fs;
 
 struct fs_volume * diskfs_volume_open( struct device *device )
 {
-	struct diskfs_block *b = page_alloc(0);
+	struct bcache_entry *e;
 
 	printf("diskfs: opening device %s unit %d\n",device_name(device),device_unit(device));
 
-	diskfs_block_read(device,b,0);
+	struct diskfs_block *b = diskfs_block_get(device,0,&e);
+	if(!b) {
+		printf("diskfs: couldn't read superblock!\n");
+		return 0;
+	}
 
 	struct diskfs_superblock *sb = &b->superblock;
 
-	if(sb->magic!=DISKFS_MAGIC) {
+	if(sb->magic!=DISKFS_MAGIC && sb->magic!=DISKFS_MAGIC_INDIRECT) {
 		printf("diskfs: no filesystem found!\n");
-		page_free(b);
+		bcache_put(e);
+		return 0;
+	}
+
+	if(sb->bitmap_blocks==0 || sb->data_blocks>sb->bitmap_blocks*DISKFS_BITS_PER_BLOCK) {
+		printf("diskfs: invalid bitmap in superblock!\n");
+		bcache_put(e);
 		return 0;
 	}
 
@@ -535,12 +1677,25 @@ struct fs_volume * diskfs_volume_open( struct device *device )
 	v->refcount = 1;
 	v->disk = *sb;
 
-	page_free(b);
+	bcache_put(e);
+
+	v->disk_alloc.cursor = 0;
+	v->disk_alloc.bitmap_free = kmalloc(v->disk.bitmap_blocks*sizeof(int32_t));
+	if(!v->disk_alloc.bitmap_free) {
+		kfree(v);
+		return 0;
+	}
+
+	uint32_t i;
+	for(i=0;i<v->disk.bitmap_blocks;i++) {
+		v->disk_alloc.bitmap_free[i] = -1;
+	}
 
-	printf("diskfs: %d bitmap blocks, %d inode blocks, %d data blocks\n",
+	printf("diskfs: %d bitmap blocks, %d inode blocks, %d data blocks, %s\n",
 		v->disk.bitmap_blocks,
 		v->disk.inode_blocks,
-		v->disk.data_blocks);
+		v->disk.data_blocks,
+		diskfs_volume_extents(v) ? "extents" : "indirect blocks");
 
 	return v;
 }
@@ -552,6 +1707,7 @@ struct fs_dirent * diskfs_volume_root( struct fs_volume *v )
 
 int diskfs_volume_close( struct fs_volume *v )
 {
+	kfree(v->disk_alloc.bitmap_free);
 	return 0;
 }
 
@@ -607,11 +1763,12 @@ int diskfs_volume_format( struct device *device )
 	b->data[0] = 0x03;
 	diskfs_block_write(device,b,sb.bitmap_start);
 
-	// Set up the zeroth inode as the root directory with a single direct block.
+	// Set up the zeroth inode as the root directory with a single extent of one block.
 	memset(b,0,DISKFS_BLOCK_SIZE);
 	b->inodes[0].inuse = 1;
 	b->inodes[0].size = sizeof(struct diskfs_item);
-	b->inodes[0].direct[0] = 1;
+	b->inodes[0].extents[0].start = 1;
+	b->inodes[0].extents[0].length = 1;
 	diskfs_block_write(device,b,sb.inode_start);
 
 	// Create the first directory entry as dot and write it to the first block.
@@ -640,6 +1797,7 @@ struct fs_ops diskfs_ops = {
 	.mkdir = diskfs_dirent_create_dir,
 	.mkfile = diskfs_dirent_create_file,
 	.read_block = diskfs_dirent_read_block,
+	.readahead = diskfs_dirent_readahead,
 	.write_block = diskfs_dirent_write_block,
 	.list = diskfs_dirent_list,
 	.remove = diskfs_dirent_remove,
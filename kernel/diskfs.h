@@ -9,12 +9,26 @@ See the file LICENSE for details.
 
 #include "kernel/types.h"
 
-#define DISKFS_MAGIC 0xabcd4321
+/*
+DISKFS_MAGIC marks the current format, in which an inode maps its
+blocks with extents.  Volumes in the original format, with direct
+and indirect block pointers, are marked with DISKFS_MAGIC_INDIRECT
+and remain mountable, but new volumes are always formatted with
+extents.
+*/
+
+#define DISKFS_MAGIC 0xabcd4322
+#define DISKFS_MAGIC_INDIRECT 0xabcd4321
 #define DISKFS_BLOCK_SIZE 4096
 #define DISKFS_DIRECT_POINTERS 6
 #define DISKFS_INODES_PER_BLOCK (DISKFS_BLOCK_SIZE/sizeof(struct diskfs_inode))
 #define DISKFS_ITEMS_PER_BLOCK (DISKFS_BLOCK_SIZE/sizeof(struct diskfs_item))
 #define DISKFS_POINTERS_PER_BLOCK (DISKFS_BLOCK_SIZE/sizeof(uint32_t))
+#define DISKFS_BITS_PER_BLOCK (DISKFS_BLOCK_SIZE*8)
+#define DISKFS_WORDS_PER_BLOCK (DISKFS_BLOCK_SIZE/sizeof(uint32_t))
+#define DISKFS_INODE_EXTENTS 3
+#define DISKFS_PREALLOC_BLOCKS 16
+#define DISKFS_EXTENTS_PER_BLOCK ((DISKFS_BLOCK_SIZE-sizeof(struct diskfs_extent_header))/sizeof(struct diskfs_extent))
 
 struct diskfs_superblock {
 	uint32_t magic;
@@ -27,11 +41,79 @@ struct diskfs_superblock {
 	uint32_t data_blocks;
 };
 
+/*
+In-memory allocation state of a mounted volume, not stored on disk.
+bitmap_free gives the number of free blocks described by each bitmap
+block, or -1 if that block has not been counted yet, so that full
+bitmap blocks are skipped without being read.  The search for a free
+block begins at cursor, where the last one was found.
+*/
+
+struct diskfs_alloc {
+	int32_t *bitmap_free;
+	uint32_t cursor;
+};
+
+/*
+An extent maps length logical blocks onto consecutive data blocks
+beginning at start.  The extents of a file are kept in logical order,
+with no gaps, so each begins where the previous one ends.  The first
+DISKFS_INODE_EXTENTS are held in the inode, and any more in a chain
+of extent blocks beginning at extent_block.  An unused extent has
+length zero.
+*/
+
+struct diskfs_extent {
+	uint32_t start;
+	uint32_t length;
+};
+
+struct diskfs_extent_header {
+	uint32_t next;
+	uint32_t count;
+};
+
 struct diskfs_inode {
 	uint32_t inuse; // reserve for broader use.
 	uint32_t size;
-	uint32_t direct[DISKFS_DIRECT_POINTERS];
-	uint32_t indirect;
+	union {
+		struct {
+			uint32_t direct[DISKFS_DIRECT_POINTERS];
+			uint32_t indirect;
+		};
+		struct {
+			struct diskfs_extent extents[DISKFS_INODE_EXTENTS];
+			uint32_t extent_block;
+		};
+	};
+};
+
+/*
+In-memory mapping state of an open inode with extents.  The extent
+last found is cached as (logical, physical, length), with length zero
+if none, along with the extent block where that search ended and the
+logical block at which that extent block begins, so that a search
+further into the file resumes from there.  Once valid is set, mapped
+is the number of logical blocks mapped, tail_block the last extent
+block (or zero), and next_physical the data block following the last
+one mapped (or zero), so that blocks can be appended without a search.
+Blocks for appending are taken from a preallocation window of
+prealloc_count blocks at prealloc_start, which are marked in use in
+the bitmap but not yet part of the file, and are released on close.
+*/
+
+struct diskfs_map {
+	uint32_t logical;
+	uint32_t physical;
+	uint32_t length;
+	uint32_t resume_block;
+	uint32_t resume_logical;
+	uint32_t mapped;
+	uint32_t tail_block;
+	uint32_t next_physical;
+	uint32_t valid;
+	uint32_t prealloc_start;
+	uint32_t prealloc_count;
 };
 
 #define DISKFS_ITEM_BLANK 0
@@ -50,12 +132,60 @@ struct diskfs_item {
 };
 #pragma pack()
 
+/*
+A directory that outgrows one block on a volume with extents is
+indexed: block zero becomes an index root, and the other blocks are
+leaves of ordinary items.  The root lists leaves in order of hash,
+each holding the names whose hash is at least that of its entry and
+less than that of the next.  Every slot of the root has the type of
+a blank item, so a linear scan skips it and still finds every name.
+A name that cannot be placed in its leaf, because the root is full,
+goes in any free slot, and the root is marked DISKFS_INDEX_PARTIAL so
+that lookups missing in the index fall back to a linear scan.
+*/
+
+#define DISKFS_INDEX_MAGIC 0xabcd4400
+#define DISKFS_INDEX_PARTIAL 1
+#define DISKFS_INDEX_ENTRIES_PER_SLOT 3
+#define DISKFS_INDEX_MAX ((DISKFS_ITEMS_PER_BLOCK-1)*DISKFS_INDEX_ENTRIES_PER_SLOT)
+
+#pragma pack(1)
+struct diskfs_index_entry {
+	uint32_t hash;
+	uint32_t block;
+};
+
+struct diskfs_index_header {
+	uint32_t magic;
+	uint8_t  type;
+	uint8_t  reserved[3];
+	uint32_t count;
+	uint32_t flags;
+	uint8_t  unused[16];
+};
+
+struct diskfs_index_slot {
+	uint32_t reserved;
+	uint8_t  type;
+	uint8_t  unused[3];
+	struct diskfs_index_entry entries[DISKFS_INDEX_ENTRIES_PER_SLOT];
+};
+#pragma pack()
+
 struct diskfs_block {
 	union {
 		struct diskfs_superblock superblock;
 		struct diskfs_inode inodes[DISKFS_INODES_PER_BLOCK];
 		struct diskfs_item items[DISKFS_ITEMS_PER_BLOCK];
+		struct {
+			struct diskfs_index_header index_header;
+			struct diskfs_index_slot index_slots[DISKFS_ITEMS_PER_BLOCK-1];
+		};
 		uint32_t pointers[DISKFS_POINTERS_PER_BLOCK];
+		struct {
+			struct diskfs_extent_header extent_header;
+			struct diskfs_extent extents[DISKFS_EXTENTS_PER_BLOCK];
+		};
 		char     data[DISKFS_BLOCK_SIZE];
 	};
 };
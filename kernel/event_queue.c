@@ -2,7 +2,7 @@
 #include "interrupt.h"
 #include "process.h"
 #include "list.h"
-#include "kmalloc.h"
+#include "slab.h"
 
 #define EVENT_BUFFER_SIZE 32
 
@@ -16,6 +16,13 @@ struct event_queue {
 
 struct event_queue event_queue_root;
 
+static void event_queue_ctor( void *q )
+{
+	memset(q,0,sizeof(struct event_queue));
+}
+
+static struct slab_cache event_queue_cache = SLAB_CACHE_INIT("event_queue", sizeof(struct event_queue), event_queue_ctor);
+
 struct event_queue * event_queue_create_root()
 {
 	memset(&event_queue_root,0,sizeof(event_queue_root));
@@ -24,14 +31,12 @@ struct event_queue * event_queue_create_root()
 
 struct event_queue * event_queue_create()
 {
-	struct event_queue *q = kmalloc(sizeof(*q));
-	memset(q,0,sizeof(*q));
-	return q;
+	return slab_alloc(&event_queue_cache);
 }
 
 void event_queue_delete( struct event_queue *q )
 {
-	kfree(q);
+	slab_free(&event_queue_cache,q);
 }
 
 /* INTERRUPT CONTEXT */
@@ -11,9 +11,21 @@ See the file LICENSE for details.
 #include "page.h"
 #include "process.h"
 #include "bcache.h"
+#include "slab.h"
 
 static struct fs *fs_list = 0;
 
+struct slab_cache fs_dirent_cache = SLAB_CACHE_INIT("fs_dirent", sizeof(struct fs_dirent), 0);
+
+/*
+Read-ahead begins at FS_READAHEAD_MIN blocks when a file is read
+sequentially, and doubles with each further sequential read up
+to FS_READAHEAD_MAX blocks.  A non-sequential read resets it.
+*/
+
+#define FS_READAHEAD_MIN 4
+#define FS_READAHEAD_MAX 16
+
 static struct kobject * find_kobject_by_tag( const char *tag )
 {
 	int i;
@@ -154,6 +166,7 @@ int fs_volume_close(struct fs_volume *v)
 	if(v->refcount==0) {
 		v->fs->ops->volume_close(v);
 		bcache_flush_device(v->device);
+		bcache_invalidate_device(v->device);
 		device_close(v->device);
 		kfree(v);
 	}
@@ -161,6 +174,26 @@ int fs_volume_close(struct fs_volume *v)
 	return 0;
 }
 
+/*
+Complete the generic part of a dirent newly returned by a filesystem,
+holding a reference to its volume and resetting read-ahead state.
+A filesystem may instead return a dirent that is already open, with
+its refcount raised, which already holds its own volume reference.
+*/
+
+static struct fs_dirent *fs_dirent_init(struct fs_dirent *d, struct fs_volume *v)
+{
+	if(d->refcount>1) return d;
+
+	d->volume = fs_volume_addref(v);
+	d->ra_last = -1;
+	d->ra_end = 0;
+	d->ra_window = 0;
+	d->generation = 0;
+	d->text_busy = 0;
+	return d;
+}
+
 struct fs_dirent *fs_volume_root(struct fs_volume *v)
 {
 	const struct fs_ops *ops = v->fs->ops;
@@ -168,7 +201,7 @@ struct fs_dirent *fs_volume_root(struct fs_volume *v)
 		return 0;
 
 	struct fs_dirent *d = v->fs->ops->volume_root(v);
-	d->volume = fs_volume_addref(v);
+	if(d) fs_dirent_init(d,v);
 	return d;
 }
 
@@ -192,7 +225,7 @@ static struct fs_dirent *fs_dirent_lookup(struct fs_dirent *d, const char *name)
 		return fs_dirent_addref(d);
 	} else {
 		struct fs_dirent *r = ops->lookup(d, name);
-		if(r) r->volume = fs_volume_addref(d->volume);
+		if(r) fs_dirent_init(r,d->volume);
 		return r;
 	}
 }
@@ -242,12 +275,41 @@ int fs_dirent_close(struct fs_dirent *d)
 		ops->close(d);
 		// This close is paired with the addref in fs_dirent_lookup
 		fs_volume_close(d->volume);
-		kfree(d);
+		slab_free(&fs_dirent_cache, d);
 	}
 
 	return 0;
 }
 
+/*
+Prefetch the blocks needed by a read of blocks [first,last], and if
+the file is being read sequentially, a window of blocks beyond it.
+Blocks already prefetched (up to ra_end) are not requested again.
+*/
+
+static void fs_dirent_readahead(struct fs_dirent *d, uint32_t first, uint32_t last)
+{
+	const struct fs_ops *ops = d->volume->fs->ops;
+	uint32_t bs = d->volume->block_size;
+	uint32_t nblocks = d->size / bs + (d->size % bs ? 1 : 0);
+	uint32_t start = first;
+
+	if(first == d->ra_last || first == d->ra_last + 1) {
+		d->ra_window = d->ra_window ? MIN(d->ra_window * 2, FS_READAHEAD_MAX) : FS_READAHEAD_MIN;
+		if(d->ra_end > start) start = d->ra_end;
+	} else {
+		d->ra_window = 0;
+	}
+
+	d->ra_last = last;
+
+	uint32_t end = MIN(last + 1 + d->ra_window, nblocks);
+	if(start < end) {
+		ops->readahead(d, start, end - start);
+		d->ra_end = end;
+	}
+}
+
 int fs_dirent_read(struct fs_dirent *d, char *buffer, uint32_t length, uint32_t offset)
 {
 	int total = 0;
@@ -265,6 +327,14 @@ int fs_dirent_read(struct fs_dirent *d, char *buffer, uint32_t length, uint32_t
 		length = d->size - offset;
 	}
 
+	if(length == 0) {
+		return 0;
+	}
+
+	if(ops->readahead) {
+		fs_dirent_readahead(d, offset / bs, (offset + length - 1) / bs);
+	}
+
 	char *temp = page_alloc(0);
 	if(!temp)
 		return -1;
@@ -315,8 +385,7 @@ struct fs_dirent * fs_dirent_mkdir(struct fs_dirent *d, const char *name)
 
 	struct fs_dirent *n = ops->mkdir(d, name);
 	if(n) {
-		n->volume = fs_volume_addref(d->volume);
-		return n;
+		return fs_dirent_init(n,d->volume);
 	}
 
 	return 0;
@@ -329,8 +398,7 @@ struct fs_dirent * fs_dirent_mkfile(struct fs_dirent *d, const char *name)
 
 	struct fs_dirent *n = ops->mkfile(d, name);
 	if(n) {
-		n->volume = fs_volume_addref(d->volume);
-		return n;
+		return fs_dirent_init(n,d->volume);
 	}
 
 	return 0;
@@ -352,6 +420,10 @@ int fs_dirent_write(struct fs_dirent *d, const char *buffer, uint32_t length, ui
 	const struct fs_ops *ops = d->volume->fs->ops;
 	if(!ops->write_block || !ops->read_block)
 		return KERROR_INVALID_REQUEST;
+	if(d->text_busy)
+		return KERROR_FILE_BUSY;
+
+	d->generation++;
 
 	char *temp = page_alloc(0);
 
@@ -10,6 +10,7 @@ See the file LICENSE for details.
 #include "fs.h"
 #include "cdromfs.h"
 #include "diskfs.h"
+#include "slab.h"
 
 struct fs {
 	char *name;
@@ -24,19 +25,52 @@ struct fs_volume {
 	int refcount;
 	union {
 		struct cdrom_volume cdrom;
-		struct diskfs_superblock disk;
+		struct {
+			struct diskfs_superblock disk;
+			struct diskfs_alloc disk_alloc;
+		};
 	};
 };
 
+/*
+ra_last and ra_end track sequential access for read-ahead:
+ra_last is the last block read, ra_end is the block following
+the last block prefetched, and ra_window is the current number
+of blocks to prefetch beyond each sequential read.
+generation is advanced by every write to the file, and when it is
+removed, so that anything cached from its contents can tell that
+it is out of date.  text_busy counts the executable images loaded
+from the file: while it is nonzero, the file may not be written,
+since running processes still fault pages in from it.
+
+An open diskfs dirent is shared by every handle to the same inode:
+it sits in a hash table by (volume,inumber) through disk_hash_next
+until its last reference is closed, and disk_dirty is set when the
+inode has changed since it was last written back.  disk_unlinked is
+set when its name is removed while it is still open: the inode and
+its blocks then remain in use until the last close, and are freed then.
+*/
+
 struct fs_dirent {
 	struct fs_volume *volume;
 	uint32_t size;
 	int inumber;
 	int refcount;
 	int isdir;
+	uint32_t ra_last;
+	uint32_t ra_end;
+	uint32_t ra_window;
+	uint32_t generation;
+	int text_busy;
 	union {
 		struct cdrom_dirent cdrom;
-		struct diskfs_inode disk;
+		struct {
+			struct diskfs_inode disk;
+			struct diskfs_map disk_map;
+			struct fs_dirent *disk_hash_next;
+			int disk_dirty;
+			int disk_unlinked;
+		};
 	};
 };
 
@@ -51,6 +85,7 @@ struct fs_ops {
 	struct fs_dirent * (*mkfile) (struct fs_dirent *d, const char *name);
 
 	int (*read_block) (struct fs_dirent *d, char *buffer, uint32_t blocknum);
+	int (*readahead) (struct fs_dirent *d, uint32_t blocknum, uint32_t nblocks);
 	int (*write_block) (struct fs_dirent *d, const char *buffer, uint32_t blocknum);
 	int (*list) (struct fs_dirent *d, char *buffer, int buffer_length);
 	int (*remove) (struct fs_dirent *d, const char *name);
@@ -58,4 +93,8 @@ struct fs_ops {
 	int (*close) (struct fs_dirent *d);
 };
 
+/* Filesystems allocate dirents from this cache; fs_dirent_close frees them. */
+
+extern struct slab_cache fs_dirent_cache;
+
 #endif
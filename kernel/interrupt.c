@@ -37,42 +37,10 @@ static const char *exception_names[] = {
 
 static void unknown_exception(int i, int code)
 {
-	unsigned vaddr; // virtual address trying to be accessed
-	unsigned paddr; // physical address
-	unsigned esp; // stack pointer
-
-	if(i==14) {
-		asm("mov %%cr2, %0" : "=r" (vaddr) ); // virtual address trying to be accessed		
-		esp  = ((struct x86_stack *)(current->kstack_top - sizeof(struct x86_stack)))->esp; // stack pointer of the process that raised the exception
-		// Check if the requested memory is in the stack or data
-		int data_access = vaddr < current->vm_data_size;
-
-		// Subtract 128 from esp because of the red-zone 
-		// According to https:gcc.gnu.org, the red zone is a 128-byte area beyond 
-		// the stack pointer that will not be modified by signal or interrupt handlers 
-		// and therefore can be used for temporary data without adjusting the stack pointer.
-		int stack_access = vaddr >= esp - 128; 
-
-		// Check if the requested memory is already in use
-		int page_already_present = pagetable_getmap(current->pagetable,vaddr,&paddr,0);
-		
-		// Check if page is already mapped (which will result from violating the permissions on page) or that
-		// we are accessing neither the stack nor the heap, or we are accessing both. If so, error
-		if (page_already_present || !(data_access ^ stack_access)) {
-			printf("interrupt: illegal page access at vaddr %x\n",vaddr);
-			process_dump(current);
-			process_exit(0);
-		} else {
-			// XXX update process->vm_stack_size when growing the stack.
-			pagetable_alloc(current->pagetable, vaddr, PAGE_SIZE, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR);
-			return;
-		}
-	} else {
-		printf("interrupt: exception %d: %s (code %x)\n", i, exception_names[i], code);
-		process_dump(current);
-	}
+	printf("interrupt: exception %d: %s (code %x)\n", i, exception_names[i], code);
 
 	if(current) {
+		process_dump(current);
 		process_exit(0);
 	} else {
 		printf("interrupt: exception in kernel code!\n");
@@ -80,6 +48,45 @@ static void unknown_exception(int i, int code)
 	}
 }
 
+/*
+Bits of the error code pushed by the processor on a page fault.
+*/
+
+#define PAGE_FAULT_PRESENT 0x01
+#define PAGE_FAULT_WRITE   0x02
+
+/*
+A page fault is either a write to a copy-on-write page shared
+after fork, which is resolved by pagetable_copy_on_write, or an
+access to an unmapped page of the heap or stack, which is
+allocated on demand by process_demand_page.  Anything else
+kills the process.
+*/
+
+static void page_fault(int i, int code)
+{
+	unsigned vaddr; // virtual address trying to be accessed
+	unsigned esp; // stack pointer
+
+	asm("mov %%cr2, %0" : "=r" (vaddr) ); // virtual address trying to be accessed		
+
+	if(!current) {
+		printf("interrupt: page fault at vaddr %x in kernel code!\n",vaddr);
+		halt();
+	}
+
+	if(code & PAGE_FAULT_PRESENT) {
+		if((code & PAGE_FAULT_WRITE) && pagetable_copy_on_write(current->pagetable,vaddr)) return;
+	} else {
+		esp  = ((struct x86_stack *)(current->kstack_top - sizeof(struct x86_stack)))->esp; // stack pointer of the process that raised the exception
+		if(process_demand_page(current,vaddr,esp)) return;
+	}
+
+	printf("interrupt: illegal page access at vaddr %x\n",vaddr);
+	process_dump(current);
+	process_exit(0);
+}
+
 static void unknown_hardware(int i, int code)
 {
 	if(!interrupt_spurious[i]) {
@@ -121,16 +128,33 @@ void interrupt_init()
 		interrupt_count[i] = 0;
 	}
 
+	interrupt_register(14, page_fault);
+
 	interrupt_unblock();
 
 	printf("interrupt: ready\n");
 }
 
+/*
+The registers saved by intr_handler lie just above the arguments
+to interrupt_handler, in the same layout as the regs1 part of
+struct x86_stack, so the code segment of the interrupted context
+shows whether the interrupt arrived while running in user mode.
+Only then may the process be switched out, once the interrupt
+has been acknowledged.
+*/
+
 void interrupt_handler(int i, int code)
 {
+	struct x86_stack *s = (struct x86_stack *) ((char *) (&code + 1) - (sizeof(struct x86_regs) + 2 * sizeof(int32_t)));
+
 	(interrupt_handler_table[i]) (i, code);
 	interrupt_acknowledge(i);
 	interrupt_count[i]++;
+
+	if(s->cs == X86_SEGMENT_USER_CODE) {
+		process_reschedule();
+	}
 }
 
 void interrupt_enable(int i)
@@ -8,12 +8,30 @@ See the file LICENSE for details.
 #include "console.h"
 #include "kernel/types.h"
 #include "memorylayout.h"
+#include "page.h"
+#include "clock.h"
+
+/*
+The kernel heap is divided into chunks, each of which begins with
+a kmalloc_chunk header and ends with a kmalloc_tag boundary tag,
+both recording the state and length of the chunk.  The tag allows
+the chunk preceding any other to be found directly, so a freed chunk
+is coalesced with both of its neighbors in constant time.
+
+Free chunks are kept on segregated free lists, where list i holds
+chunks of length [KUNIT*2^i, KUNIT*2^(i+1)).  An allocation searches
+only the list of its own size class, and then takes the first chunk
+of any larger class, so it never visits chunks in use.
+*/
 
 #define KUNIT sizeof(struct kmalloc_chunk)
+#define KTAG sizeof(struct kmalloc_tag)
 
 #define KMALLOC_STATE_FREE 0xa1a1a1a1
 #define KMALLOC_STATE_USED 0xbfbfbfbf
 
+#define KMALLOC_CLASSES 17
+
 struct kmalloc_chunk {
 	int state;
 	int length;
@@ -21,110 +39,148 @@ struct kmalloc_chunk {
 	struct kmalloc_chunk *prev;
 };
 
+struct kmalloc_tag {
+	int state;
+	int length;
+};
+
 static struct kmalloc_chunk *head = 0;
+static char *heap_end = 0;
+static struct kmalloc_chunk *free_lists[KMALLOC_CLASSES];
+
+static int kclass(int length)
+{
+	int c = 0;
+	length /= KUNIT;
+	while(length > 1 && c < KMALLOC_CLASSES - 1) {
+		length >>= 1;
+		c++;
+	}
+	return c;
+}
+
+static struct kmalloc_tag *ktag(struct kmalloc_chunk *c)
+{
+	return (struct kmalloc_tag *) ((char *) c + c->length - KTAG);
+}
+
+/* Set the state and length of a chunk in both its header and tag. */
+
+static void kset(struct kmalloc_chunk *c, int state, int length)
+{
+	c->state = state;
+	c->length = length;
+	ktag(c)->state = state;
+	ktag(c)->length = length;
+}
+
+static void klist_insert(struct kmalloc_chunk *c)
+{
+	struct kmalloc_chunk **list = &free_lists[kclass(c->length)];
+	c->prev = 0;
+	c->next = *list;
+	if(*list)
+		(*list)->prev = c;
+	*list = c;
+}
+
+static void klist_remove(struct kmalloc_chunk *c)
+{
+	if(c->prev) {
+		c->prev->next = c->next;
+	} else {
+		free_lists[kclass(c->length)] = c->next;
+	}
+	if(c->next)
+		c->next->prev = c->prev;
+	c->next = c->prev = 0;
+}
 
 /*
-Initialize the linked list by creating a single chunk at
-a given start address and length.  The chunk is initially
-free and has no next or previous chunks.
+Initialize the heap by creating a single free chunk at
+a given start address and length.
 */
 
 void kmalloc_init(char *start, int length)
 {
+	int i;
+
+	for(i = 0; i < KMALLOC_CLASSES; i++)
+		free_lists[i] = 0;
+
 	head = (struct kmalloc_chunk *) start;
-	head->state = KMALLOC_STATE_FREE;
-	head->length = length;
-	head->next = 0;
-	head->prev = 0;
+	heap_end = start + length;
+	kset(head, KMALLOC_STATE_FREE, length);
+	klist_insert(head);
 }
 
 /*
 Split a large chunk into two, such that the current chunk
-has the desired length, and the next chunk has the remainder.
+has the desired length, and the remainder is a new free chunk.
 */
 
 static void ksplit(struct kmalloc_chunk *c, int length)
 {
 	struct kmalloc_chunk *n = (struct kmalloc_chunk *) ((char *) c + length);
 
-	n->state = KMALLOC_STATE_FREE;
-	n->length = c->length - length;
-	n->prev = c;
-	n->next = c->next;
+	kset(n, KMALLOC_STATE_FREE, c->length - length);
+	klist_insert(n);
 
-	if(c->next)
-		c->next->prev = n;
-
-	c->next = n;
 	c->length = length;
 }
 
 /*
 Allocate a chunk of memory of the given length.
-To avoid fragmentation, round up the length to
-a multiple of the chunk size.  Then, search fo
-a chunk of the desired size, and split it if necessary.
+To avoid fragmentation, round up the length (plus the
+header and tag) to a multiple of the chunk size.  Then,
+search the free lists for a chunk of the desired size,
+and split it if necessary.
 */
 
 void *kmalloc(int length)
 {
+	struct kmalloc_chunk *c = 0;
+	int i;
+
+	// add room for the chunk header and tag
+	length += KUNIT + KTAG;
+
 	// round up length to a multiple of KUNIT
 	int extra = length % KUNIT;
 	if(extra)
 		length += (KUNIT - extra);
 
-	// then add one more unit to accommodate the chunk header
-	length += KUNIT;
-
-	struct kmalloc_chunk *c = head;
-
-	while(1) {
-		if(!c) {
-			printf("kmalloc: out of memory!\n");
-			return 0;
+	for(i = kclass(length); i < KMALLOC_CLASSES; i++) {
+		for(c = free_lists[i]; c; c = c->next) {
+			if(c->length >= length)
+				break;
 		}
-		if(c->state == KMALLOC_STATE_FREE && c->length >= length)
+		if(c)
 			break;
-		c = c->next;
 	}
 
+	if(!c) {
+		printf("kmalloc: out of memory!\n");
+		return 0;
+	}
+
+	klist_remove(c);
+
 	// split the chunk if the remainder is greater than two units
-	if((c->length-length) > 2 * KUNIT) {
+	if((c->length - length) > 2 * KUNIT) {
 		ksplit(c, length);
 	}
 
-	c->state = KMALLOC_STATE_USED;
+	kset(c, KMALLOC_STATE_USED, c->length);
 
 	// return a pointer to the memory following the chunk header
 	return (c + 1);
 }
 
-/*
-Attempt to merge a chunk with its successor,
-if it exists and both are in the free state.
-*/
-
-static void kmerge(struct kmalloc_chunk *c)
-{
-	if(!c)
-		return;
-
-	if(c->state != KMALLOC_STATE_FREE)
-		return;
-
-	if(c->next && c->next->state == KMALLOC_STATE_FREE) {
-		c->length += c->next->length;
-		if(c->next->next) {
-			c->next->next->prev = c;
-		}
-		c->next = c->next->next;
-	}
-
-}
-
 /*
 Free memory by marking the chunk as de-allocated,
-then attempting to merge it with the predecessor and successor.
+then merging it with the predecessor and successor
+if they are free, found via their boundary tags.
 */
 
 void kfree(void *ptr)
@@ -132,33 +188,83 @@ void kfree(void *ptr)
 	struct kmalloc_chunk *c = (struct kmalloc_chunk *) ptr;
 	c--;
 
-	if(c->state != KMALLOC_STATE_USED) {
+	if(c->state != KMALLOC_STATE_USED || ktag(c)->state != KMALLOC_STATE_USED) {
 		printf("invalid kfree(%x)\n", ptr);
 		return;
 	}
 
-	c->state = KMALLOC_STATE_FREE;
+	int length = c->length;
+
+	struct kmalloc_chunk *n = (struct kmalloc_chunk *) ((char *) c + length);
+	if((char *) n < heap_end && n->state == KMALLOC_STATE_FREE) {
+		klist_remove(n);
+		length += n->length;
+	}
 
-	kmerge(c);
-	kmerge(c->prev);
+	if(c != head) {
+		struct kmalloc_tag *t = (struct kmalloc_tag *) c - 1;
+		if(t->state == KMALLOC_STATE_FREE) {
+			struct kmalloc_chunk *p = (struct kmalloc_chunk *) ((char *) c - t->length);
+			klist_remove(p);
+			length += p->length;
+			c = p;
+		}
+	}
+
+	kset(c, KMALLOC_STATE_FREE, length);
+	klist_insert(c);
 }
 
+/*
+Display every chunk in the heap, in address order,
+followed by a summary of free space fragmentation:
+the share of free memory outside of the largest
+free chunk, and the number of free chunks per class.
+*/
+
 void kmalloc_debug()
 {
 	struct kmalloc_chunk *c;
+	int free_total = 0, free_chunks = 0, free_largest = 0;
+	int used_total = 0, used_chunks = 0;
+	int i;
 
-	printf("state ptr      prev     next     length\n");
+	printf("state ptr      length\n");
 
-	for(c = head; c; c = c->next) {
+	for(c = head; (char *) c < heap_end; c = (struct kmalloc_chunk *) ((char *) c + c->length)) {
+		if(c->length < (int) (KUNIT + KTAG) || c->state != ktag(c)->state || c->length != ktag(c)->length) {
+			printf("kmalloc heap corrupted at %x!\n", c);
+			return;
+		}
 		if(c->state == KMALLOC_STATE_FREE) {
 			printf("F");
+			free_total += c->length;
+			free_chunks++;
+			if(c->length > free_largest)
+				free_largest = c->length;
 		} else if(c->state == KMALLOC_STATE_USED) {
 			printf("U");
+			used_total += c->length;
+			used_chunks++;
 		} else {
-			printf("kmalloc list corrupted at %x!\n", c);
+			printf("kmalloc heap corrupted at %x!\n", c);
 			return;
 		}
-		printf("     %x %x %x %d\n", c, c->prev, c->next, c->length);
+		printf("     %x %d\n", c, c->length);
+	}
+
+	printf("kmalloc: %d bytes used in %d chunks\n", used_total, used_chunks);
+	printf("kmalloc: %d bytes free in %d chunks, largest %d\n", free_total, free_chunks, free_largest);
+	if(free_total > 0) {
+		printf("kmalloc: fragmentation %d%%\n", 100 - (free_largest / KUNIT) * 100 / (free_total / KUNIT));
+	}
+
+	for(i = 0; i < KMALLOC_CLASSES; i++) {
+		int n = 0;
+		for(c = free_lists[i]; c; c = c->next)
+			n++;
+		if(n > 0)
+			printf("kmalloc: class %d (%d+ bytes): %d free\n", i, KUNIT << i, n);
 	}
 }
 
@@ -179,11 +285,14 @@ static int kmalloc_test_single_alloc(void)
 	struct kmalloc_chunk *next = 0;
 	int res = (unsigned long) ptr == (unsigned long) head + sizeof(struct kmalloc_chunk);
 	res &= head->state == KMALLOC_STATE_USED;
-	res &= head->length == 128 + sizeof(struct kmalloc_chunk);
-	res &= (char *) head->next == (char *) KMALLOC_START + head->length;
-	next = head->next;
+	res &= head->length >= 128 + KUNIT + KTAG;
+	res &= head->length < 128 + KUNIT + KTAG + KUNIT;
+	res &= head->length % KUNIT == 0;
+	res &= ktag(head)->state == KMALLOC_STATE_USED;
+	next = (struct kmalloc_chunk *) ((char *) KMALLOC_START + head->length);
 	res &= next->state == KMALLOC_STATE_FREE;
 	res &= next->length == KMALLOC_LENGTH - head->length;
+	res &= free_lists[kclass(next->length)] == next;
 
 	return res;
 }
@@ -194,16 +303,207 @@ static int kmalloc_test_single_alloc_and_free(void)
 	int res;
 	kfree(ptr);
 	res = head->state == KMALLOC_STATE_FREE;
+	res &= head->length == KMALLOC_LENGTH;
+	res &= free_lists[kclass(KMALLOC_LENGTH)] == head;
 	res &= head->next == 0;
+
+	return res;
+}
+
+static int kmalloc_test_coalesce(void)
+{
+	char *a = kmalloc(100);
+	char *b = kmalloc(200);
+	char *c = kmalloc(300);
+	char *d = kmalloc(400);
+	int res;
+
+	// freeing a and c leaves two separate free chunks
+	kfree(a);
+	kfree(c);
+	res = head->state == KMALLOC_STATE_FREE;
+	res &= head->length < KMALLOC_LENGTH;
+
+	// freeing b merges a, b, and c into one chunk
+	kfree(b);
+	res &= head->state == KMALLOC_STATE_FREE;
+	res &= ((struct kmalloc_chunk *) d - 1) == (struct kmalloc_chunk *) ((char *) head + head->length);
+
+	// freeing d merges everything back into the whole heap
+	kfree(d);
 	res &= head->length == KMALLOC_LENGTH;
+	res &= free_lists[kclass(KMALLOC_LENGTH)] == head;
 
 	return res;
 }
 
+/*
+A stress benchmark comparing the segregated allocator against
+the previous design, a single address-ordered list of all chunks
+searched first-fit from the head.  Both run the same pseudo-random
+sequence of allocations and frees, and report the number of chunks
+visited while searching and the elapsed time.
+*/
+
+#define KMALLOC_BENCH_SLOTS 256
+#define KMALLOC_BENCH_OPS 20000
+#define KMALLOC_BENCH_ORDER 8
+
+static struct kmalloc_chunk *ffit_head = 0;
+static int ffit_visits = 0;
+static int kmalloc_visits = 0;
+
+static void ffit_init(char *start, int length)
+{
+	ffit_head = (struct kmalloc_chunk *) start;
+	ffit_head->state = KMALLOC_STATE_FREE;
+	ffit_head->length = length;
+	ffit_head->next = 0;
+	ffit_head->prev = 0;
+}
+
+static void *ffit_alloc(int length)
+{
+	struct kmalloc_chunk *c;
+
+	int extra = length % KUNIT;
+	if(extra)
+		length += (KUNIT - extra);
+	length += KUNIT;
+
+	for(c = ffit_head; c; c = c->next) {
+		ffit_visits++;
+		if(c->state == KMALLOC_STATE_FREE && c->length >= length)
+			break;
+	}
+	if(!c)
+		return 0;
+
+	if((c->length - length) > 2 * KUNIT) {
+		struct kmalloc_chunk *n = (struct kmalloc_chunk *) ((char *) c + length);
+		n->state = KMALLOC_STATE_FREE;
+		n->length = c->length - length;
+		n->prev = c;
+		n->next = c->next;
+		if(c->next)
+			c->next->prev = n;
+		c->next = n;
+		c->length = length;
+	}
+
+	c->state = KMALLOC_STATE_USED;
+	return (c + 1);
+}
+
+static void ffit_merge(struct kmalloc_chunk *c)
+{
+	if(c && c->state == KMALLOC_STATE_FREE && c->next && c->next->state == KMALLOC_STATE_FREE) {
+		c->length += c->next->length;
+		if(c->next->next)
+			c->next->next->prev = c;
+		c->next = c->next->next;
+	}
+}
+
+static void ffit_free(void *ptr)
+{
+	struct kmalloc_chunk *c = (struct kmalloc_chunk *) ptr - 1;
+	c->state = KMALLOC_STATE_FREE;
+	ffit_merge(c);
+	ffit_merge(c->prev);
+}
+
+/* Count the free chunks that kmalloc would visit for this length. */
+
+static void *kmalloc_counted(int length)
+{
+	int need = length + KUNIT + KTAG;
+	int i;
+	struct kmalloc_chunk *c;
+
+	if(need % KUNIT)
+		need += KUNIT - need % KUNIT;
+
+	for(i = kclass(need); i < KMALLOC_CLASSES; i++) {
+		for(c = free_lists[i]; c; c = c->next) {
+			kmalloc_visits++;
+			if(c->length >= need)
+				break;
+		}
+		if(c)
+			break;
+	}
+
+	return kmalloc(length);
+}
+
+static int kmalloc_bench_run(void *(*alloc) (int), void (*release) (void *))
+{
+	static void *slots[KMALLOC_BENCH_SLOTS];
+	uint32_t seed = 12345;
+	int i, failures = 0;
+
+	for(i = 0; i < KMALLOC_BENCH_SLOTS; i++)
+		slots[i] = 0;
+
+	for(i = 0; i < KMALLOC_BENCH_OPS; i++) {
+		seed = seed * 1103515245 + 12345;
+		int slot = (seed >> 16) % KMALLOC_BENCH_SLOTS;
+		if(slots[slot]) {
+			release(slots[slot]);
+			slots[slot] = 0;
+		} else {
+			seed = seed * 1103515245 + 12345;
+			int length = 16 + (seed >> 16) % 2048;
+			slots[slot] = alloc(length);
+			if(!slots[slot])
+				failures++;
+		}
+	}
+
+	for(i = 0; i < KMALLOC_BENCH_SLOTS; i++) {
+		if(slots[i])
+			release(slots[i]);
+	}
+
+	return failures;
+}
+
+static int kmalloc_test_benchmark(void)
+{
+	clock_t start, elapsed;
+	int failures;
+
+	char *region = page_alloc_n(KMALLOC_BENCH_ORDER, 0);
+	if(!region)
+		return 0;
+
+	ffit_init(region, PAGE_SIZE << KMALLOC_BENCH_ORDER);
+	ffit_visits = 0;
+	start = clock_read();
+	failures = kmalloc_bench_run(ffit_alloc, ffit_free);
+	elapsed = clock_diff(start, clock_read());
+	printf("\nfirst-fit:  %d chunks visited, %d failures, %d ms\n", ffit_visits, failures, elapsed.seconds * 1000 + elapsed.millis);
+
+	page_free(region);
+
+	kmalloc_visits = 0;
+	start = clock_read();
+	failures = kmalloc_bench_run(kmalloc_counted, kfree);
+	elapsed = clock_diff(start, clock_read());
+	printf("segregated: %d chunks visited, %d failures, %d ms\n", kmalloc_visits, failures, elapsed.seconds * 1000 + elapsed.millis);
+
+	kmalloc_debug();
+
+	// everything was freed, so the heap must be whole again
+	return head->state == KMALLOC_STATE_FREE && head->length == KMALLOC_LENGTH;
+}
+
 int kmalloc_test(void)
 {
 	int (*tests[]) (void) = {
-	kmalloc_test_single_alloc, kmalloc_test_single_alloc_and_free,};
+	kmalloc_test_single_alloc, kmalloc_test_single_alloc_and_free,
+	kmalloc_test_coalesce, kmalloc_test_benchmark,};
 
 	int i = 0;
 	for(i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
@@ -15,11 +15,15 @@
 #include "console.h"
 #include "pipe.h"
 
+#include "slab.h"
+
 #include "kernel/error.h"
 
+static struct slab_cache kobject_cache = SLAB_CACHE_INIT("kobject", sizeof(struct kobject), 0);
+
 static struct kobject *kobject_create()
 {
-	struct kobject *k = kmalloc(sizeof(*k));
+	struct kobject *k = slab_alloc(&kobject_cache);
 	k->refcount = 1;
 	k->offset = 0;
 	k->tag = 0;
@@ -328,7 +332,7 @@ int kobject_close(struct kobject *kobject)
 		}
 		if (kobject->tag)
 			kfree(kobject->tag);
-		kfree(kobject);
+		slab_free(&kobject_cache, kobject);
 		return 0;
 	} else if(kobject->refcount>1 ) {
 		if(kobject->type==KOBJECT_PIPE) {
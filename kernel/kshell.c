@@ -20,6 +20,9 @@ See the file LICENSE for details.
 #include "clock.h"
 #include "kernelcore.h"
 #include "bcache.h"
+#include "slab.h"
+#include "loader.h"
+#include "ata.h"
 #include "printf.h"
 
 static int kshell_mount( const char *devname, int unit, const char *fs_type)
@@ -75,6 +78,11 @@ static int kshell_automount()
 		if(kshell_mount("ata",i,"simplefs")==0) return 0;
 	}
 
+	for(i=0;i<4;i++) {
+		printf("automount: trying virtio unit %d...\n",i);
+		if(kshell_mount("virtio",i,"diskfs")==0) return 0;
+	}
+
 	printf("automount: no bootable devices available.\n");
 	return -1;
 }
@@ -123,6 +131,158 @@ int kshell_install( const char *src_device_name, int src_unit, const char *dst_d
 	return 0;
 }
 
+/*
+Report one phase of a benchmark: count operations on units in the
+given number of clock ticks, along with the data rate if kbytes
+were transferred.
+*/
+
+static void kshell_bench_report( const char *what, int count, const char *units, uint32_t kbytes, uint32_t ticks )
+{
+	uint32_t millis = ticks*1000/clock_ticks_per_second();
+	if(millis==0) millis = 1;
+	printf("%s: %d %s in %u ms, %u per second",what,count,units,millis,count*1000/millis);
+	if(kbytes) printf(", %u KB/s",kbytes*1000/millis);
+	printf("\n");
+}
+
+/*
+Measure read throughput from a device, without modifying it:
+first with synchronous device_reads of KSHELL_BENCH_BATCH blocks,
+then with KSHELL_BENCH_BATCH single-block requests in flight at once,
+and then through the buffer cache with read-ahead, each over a
+different range of blocks so that the cache does not help the others.
+*/
+
+#define KSHELL_BENCH_BATCH 16
+#define KSHELL_BENCH_ORDER 4
+
+static int kshell_disk_bench( const char *name, int unit, int nblocks )
+{
+	struct device_request requests[KSHELL_BENCH_BATCH];
+	uint32_t start;
+	int i, j, n;
+
+	struct device *d = device_open(name,unit);
+	if(!d) {
+		printf("disk_bench: couldn't open device %s unit %d\n",name,unit);
+		return KERROR_NOT_FOUND;
+	}
+
+	int bs = device_block_size(d);
+	char *buffer = page_alloc_n(KSHELL_BENCH_ORDER,0);
+
+	if(!buffer || bs>PAGE_SIZE) {
+		device_close(d);
+		return KERROR_OUT_OF_MEMORY;
+	}
+
+	if(nblocks*3>device_nblocks(d)) nblocks = device_nblocks(d)/3;
+
+	start = clock_ticks();
+	for(i=0;i<nblocks;i+=n) {
+		n = MIN(KSHELL_BENCH_BATCH,nblocks-i);
+		if(device_read(d,buffer,n,i)<1) break;
+	}
+	kshell_bench_report("device_read",i,"blocks",i*bs/1024,clock_ticks()-start);
+
+	start = clock_ticks();
+	for(i=0;i<nblocks;i+=n) {
+		n = MIN(KSHELL_BENCH_BATCH,nblocks-i);
+		for(j=0;j<n;j++) {
+			requests[j].buffer = buffer+j*bs;
+			requests[j].nblocks = 1;
+			requests[j].offset = nblocks+i+j;
+			requests[j].write = 0;
+			requests[j].complete = 0;
+			if(device_submit(d,&requests[j])<0) requests[j].done = 1;
+		}
+		for(j=0;j<n;j++) {
+			device_request_wait(&requests[j]);
+		}
+	}
+	kshell_bench_report("device_submit",i,"blocks",i*bs/1024,clock_ticks()-start);
+
+	start = clock_ticks();
+	for(i=0;i<nblocks;i+=n) {
+		n = MIN(KSHELL_BENCH_BATCH,nblocks-i);
+		bcache_readahead(d,2*nblocks+i+n,KSHELL_BENCH_BATCH);
+		if(bcache_read(d,buffer,n,2*nblocks+i)<n) break;
+	}
+	kshell_bench_report("bcache_read",i,"blocks",i*bs/1024,clock_ticks()-start);
+
+	/* Wait for the last read-ahead, and forget the blocks before closing. */
+	bcache_invalidate_device(d);
+
+	page_free(buffer);
+	device_close(d);
+
+	return 0;
+}
+
+/*
+Measure directory operations by creating, looking up, and then
+removing count empty files in the directory path, timing each phase.
+*/
+
+static void kshell_dir_bench_name( char *name, int i )
+{
+	strcpy(name,"bench");
+	uint_to_string(i,name+5);
+}
+
+static int kshell_dir_bench( const char *path, int count )
+{
+	struct fs_dirent *n;
+	char name[16];
+	uint32_t start;
+	int i;
+
+	struct fs_dirent *d = fs_resolve(path);
+	if(!d) {
+		printf("dir_bench: couldn't open %s\n",path);
+		return KERROR_NOT_FOUND;
+	}
+
+	start = clock_ticks();
+	for(i=0;i<count;i++) {
+		kshell_dir_bench_name(name,i);
+		n = fs_dirent_mkfile(d,name);
+		if(!n) {
+			printf("dir_bench: couldn't create %s\n",name);
+			break;
+		}
+		fs_dirent_close(n);
+	}
+	count = i;
+	kshell_bench_report("create",count,"entries",0,clock_ticks()-start);
+
+	start = clock_ticks();
+	for(i=0;i<count;i++) {
+		kshell_dir_bench_name(name,i);
+		n = fs_dirent_traverse(d,name);
+		if(!n) {
+			printf("dir_bench: couldn't find %s\n",name);
+			break;
+		}
+		fs_dirent_close(n);
+	}
+	kshell_bench_report("lookup",i,"entries",0,clock_ticks()-start);
+
+	start = clock_ticks();
+	for(i=0;i<count;i++) {
+		kshell_dir_bench_name(name,i);
+		if(fs_dirent_remove(d,name)<0) {
+			printf("dir_bench: couldn't remove %s\n",name);
+		}
+	}
+	kshell_bench_report("remove",count,"entries",0,clock_ticks()-start);
+
+	fs_dirent_close(d);
+
+	return 0;
+}
+
 static int kshell_printdir(const char *d, int length)
 {
 	while(length > 0) {
@@ -346,10 +506,72 @@ static int kshell_execute(int argc, const char **argv)
 			stats.read_hits,stats.read_misses,
 			stats.write_hits,stats.write_misses,
 			stats.writebacks);
+		printf("%d dirty %d fwake %d fratio %d fwrites %d fblocks\n",
+			stats.dirty_blocks,stats.flush_wakeups,
+			stats.flush_ratio_triggers,stats.flush_writes,
+			stats.flush_blocks);
+		printf("%d rablocks %d rahits %d rawasted\n",
+			stats.readahead_blocks,stats.readahead_hits,
+			stats.readahead_wasted);
+		printf("%d werrors %d wabandoned\n",
+			stats.write_errors,stats.write_abandoned);
 	} else if(!strcmp(cmd,"bcache_flush")) {
 		bcache_flush_all();
+	} else if(!strcmp(cmd,"slab_stats")) {
+		slab_debug();
+	} else if(!strcmp(cmd,"image_stats")) {
+		loader_debug();
+	} else if(!strcmp(cmd,"demand_paging")) {
+		if(argc==2 && !strcmp(argv[1],"on")) {
+			loader_set_demand_paging(1);
+		} else if(argc==2 && !strcmp(argv[1],"off")) {
+			loader_set_demand_paging(0);
+		} else if(argc!=1) {
+			printf("use: demand_paging [on|off]\n");
+		}
+		printf("demand paging is %s\n",loader_get_demand_paging() ? "on" : "off");
+	} else if(!strcmp(cmd,"disk_bench")) {
+		int unit, nblocks = 1024;
+		if((argc==3 || argc==4) && str2int(argv[2],&unit) && (argc==3 || str2int(argv[3],&nblocks))) {
+			kshell_disk_bench(argv[1],unit,nblocks);
+		} else {
+			printf("use: disk_bench <device> <unit> [blocks]\n");
+		}
+	} else if(!strcmp(cmd,"dir_bench")) {
+		int count = 2000;
+		if((argc==2 || argc==3) && (argc==2 || str2int(argv[2],&count))) {
+			kshell_dir_bench(argv[1],count);
+		} else {
+			printf("use: dir_bench <dir> [entries]\n");
+		}
+	} else if(!strcmp(cmd,"ata_dma")) {
+		if(argc==2 && !strcmp(argv[1],"on")) {
+			ata_set_dma(1);
+		} else if(argc==2 && !strcmp(argv[1],"off")) {
+			ata_set_dma(0);
+		} else if(argc!=1) {
+			printf("use: ata_dma [on|off]\n");
+		}
+		printf("ata dma is %s\n",ata_get_dma() ? "on" : "off");
+	} else if(!strcmp(cmd,"priority")) {
+		int pid, priority;
+		if(argc==3 && str2int(argv[1],&pid) && str2int(argv[2],&priority)) {
+			if(process_priority_set(0,pid,priority)<0) {
+				printf("priority: couldn't set priority of process %d\n",pid);
+			}
+		} else {
+			printf("use: priority <pid> <%d-%d>\n",PROCESS_PRIORITY_MIN,PROCESS_PRIORITY_MAX);
+		}
+	} else if(!strcmp(cmd,"timeslice")) {
+		int ticks;
+		if(argc==2 && str2int(argv[1],&ticks) && ticks>0) {
+			process_timeslice_set(ticks);
+		} else if(argc!=1) {
+			printf("use: timeslice [ticks]\n");
+		}
+		printf("timeslice is %d ticks\n",process_timeslice_get());
 	} else if(!strcmp(cmd, "help")) {
-		printf("Kernel Shell Commands:\nrun <path> <args>\nstart <path> <args>\nkill <pid>\nreap <pid>\nwait\nlist\nautomount\nmount <device> <unit> <fstype>\numount\nformat <device> <unit><fstype>\ninstall atapi <srcunit> ata <dstunit>\nmkdir <path>\nremove <path>time\nbcache_stats\nbcache_flush\nreboot\nhelp\n\n");
+		printf("Kernel Shell Commands:\nrun <path> <args>\nstart <path> <args>\nkill <pid>\nreap <pid>\nwait\nlist\nautomount\nmount <device> <unit> <fstype>\numount\nformat <device> <unit><fstype>\ninstall atapi <srcunit> ata <dstunit>\nmkdir <path>\nremove <path>time\nbcache_stats\nbcache_flush\nslab_stats\nimage_stats\ndemand_paging [on|off]\nata_dma [on|off]\ndisk_bench <device> <unit> [blocks]\ndir_bench <dir> [entries]\npriority <pid> <priority>\ntimeslice [ticks]\nreboot\nhelp\n\n");
 	} else {
 		printf("%s: command not found\n", argv[0]);
 	}
@@ -10,9 +10,301 @@ See the file LICENSE for details.
 #include "string.h"
 #include "console.h"
 #include "process.h"
+#include "pagetable.h"
+#include "kmalloc.h"
+#include "page.h"
+#include "list.h"
+#include "fs_internal.h"
 #include "kernel/syscall.h"
 #include "memorylayout.h"
 
+/*
+A loader_image records the loadable segments of an executable,
+and holds a reference to its file.  In demand paging mode,
+no segment is read at load time: each page is read from the file
+(through the buffer cache) and mapped when a process first touches it,
+so the cost of starting a program depends on the code it actually runs.
+Otherwise, all pages are read in before the process starts.
+
+Images are kept in a cache keyed by the volume and inode of the file,
+so that every process running the same executable shares one image.
+Pages covered only by read-only segments (text and rodata) are loaded
+once into the image, and the same physical pages are mapped read-only
+into each process.  Pages of writable segments are private to each
+process.  The image is evicted when the last process using it exits.
+*/
+
+#define LOADER_MAX_SEGMENTS 8
+#define LOADER_MAX_TEXT_PAGES 4096
+
+struct loader_segment {
+	uint32_t vaddr;
+	uint32_t memory_size;
+	uint32_t offset;
+	uint32_t file_size;
+	int writable;
+};
+
+struct loader_image {
+	struct list_node node;
+	struct fs_dirent *file;
+	struct fs_volume *volume;
+	int inumber;
+	uint32_t size;
+	uint32_t generation;
+	addr_t entry;
+	int cached;
+	int refcount;
+	int nsegments;
+	struct loader_segment segments[LOADER_MAX_SEGMENTS];
+	uint32_t text_start;
+	uint32_t text_pages;
+	void **text;
+	uint32_t text_resident;
+	uint32_t loads;
+	uint32_t text_faults;
+	uint32_t text_shared;
+};
+
+static struct list loader_images = LIST_INIT;
+
+static int loader_demand_paging = 1;
+
+void loader_set_demand_paging( int enable )
+{
+	loader_demand_paging = enable;
+}
+
+int loader_get_demand_paging()
+{
+	return loader_demand_paging;
+}
+
+struct loader_image *loader_image_addref( struct loader_image *image )
+{
+	if(image) image->refcount++;
+	return image;
+}
+
+void loader_image_delete( struct loader_image *image )
+{
+	uint32_t i;
+
+	if(!image) return;
+	image->refcount--;
+	if(image->refcount==0) {
+		if(image->cached) list_remove(&image->node);
+		if(image->text) {
+			for(i = 0; i < image->text_pages; i++) {
+				if(image->text[i]) page_free(image->text[i]);
+			}
+			kfree(image->text);
+		}
+		image->file->text_busy--;
+		fs_dirent_close(image->file);
+		kfree(image);
+	}
+}
+
+/*
+Find the cached image of file d.  A file cannot be written while an
+image of it is loaded (see text_busy), since running processes still
+fault pages in from it.  But if the file has been removed since the
+image was loaded (its generation has moved on), or has changed size,
+the image is stale: it is removed from the cache, and remains only
+until its current users exit.
+*/
+
+static struct loader_image *loader_image_lookup( struct fs_dirent *d )
+{
+	struct list_node *n;
+
+	for(n = loader_images.head; n; n = n->next) {
+		struct loader_image *image = (struct loader_image *) n;
+		if(image->volume == d->volume && image->inumber == d->inumber) {
+			if(image->size == d->size && image->generation == image->file->generation && image->generation == d->generation) return image;
+			list_remove(&image->node);
+			image->cached = 0;
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+Find the span of pages covered only by read-only segments,
+and allocate a table of the physical pages shared among processes.
+*/
+
+static void loader_image_text_init( struct loader_image *image )
+{
+	uint32_t start = 0xffffffff;
+	uint32_t end = 0;
+	int i;
+
+	for(i = 0; i < image->nsegments; i++) {
+		struct loader_segment *s = &image->segments[i];
+		if(s->writable) continue;
+		start = MIN(start, s->vaddr & 0xfffff000);
+		end = MAX(end, s->vaddr + s->memory_size);
+	}
+
+	image->text_start = 0;
+	image->text_pages = 0;
+	image->text = 0;
+
+	if(start >= end) return;
+
+	uint32_t npages = (end - start + PAGE_SIZE - 1) / PAGE_SIZE;
+	if(npages > LOADER_MAX_TEXT_PAGES) return;
+
+	image->text = kmalloc(npages * sizeof(void *));
+	if(!image->text) return;
+	memset(image->text, 0, npages * sizeof(void *));
+
+	image->text_start = start;
+	image->text_pages = npages;
+}
+
+static int loader_segment_overlaps( struct loader_segment *s, uint32_t vaddr )
+{
+	return vaddr < s->vaddr + s->memory_size && vaddr + PAGE_SIZE > s->vaddr;
+}
+
+/*
+Fill the page at physical address "page" with the contents of
+the image at the page-aligned virtual address vaddr: file data
+where the segments have it, and zeros elsewhere.
+*/
+
+static int loader_image_fill( struct loader_image *image, char *page, uint32_t vaddr )
+{
+	int i;
+
+	memset(page, 0, PAGE_SIZE);
+
+	for(i = 0; i < image->nsegments; i++) {
+		struct loader_segment *s = &image->segments[i];
+		if(!loader_segment_overlaps(s, vaddr)) continue;
+
+		uint32_t start = MAX(vaddr, s->vaddr);
+		uint32_t end = MIN(vaddr + PAGE_SIZE, s->vaddr + s->file_size);
+		if(start < end) {
+			uint32_t actual = fs_dirent_read(image->file, page + (start - vaddr), end - start, s->offset + (start - s->vaddr));
+			if(actual != end - start) {
+				printf("elf: unable to load page %x from disk.\n", vaddr);
+				return KERROR_NOT_EXECUTABLE;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+Return the shared page of the image at vaddr, loading it if needed.
+Another process may fault on the same page while this one waits for
+the disk, so the table is checked again once the page is filled.
+*/
+
+static void *loader_image_text_page( struct loader_image *image, uint32_t vaddr )
+{
+	uint32_t i = (vaddr - image->text_start) / PAGE_SIZE;
+
+	image->text_faults++;
+
+	if(image->text[i]) {
+		image->text_shared++;
+		return image->text[i];
+	}
+
+	void *page = page_alloc(0);
+	if(!page) return 0;
+
+	if(loader_image_fill(image, page, vaddr) < 0) {
+		page_free(page);
+		return 0;
+	}
+
+	if(image->text[i]) {
+		page_free(page);
+		image->text_shared++;
+		return image->text[i];
+	}
+
+	image->text[i] = page;
+	image->text_resident++;
+	return page;
+}
+
+/*
+Map in the page of the image containing vaddr, if any segment covers it.
+Read-only pages are shared with every other process running the image,
+while writable pages are private copies.
+Returns 1 if the page was mapped, or 0 if vaddr is not part of the image
+or the page could not be loaded.
+*/
+
+int loader_image_fault( struct loader_image *image, struct pagetable *pt, uint32_t vaddr )
+{
+	unsigned paddr;
+	int found = 0;
+	int writable = 0;
+	int i;
+
+	vaddr &= 0xfffff000;
+
+	for(i = 0; i < image->nsegments; i++) {
+		if(loader_segment_overlaps(&image->segments[i], vaddr)) {
+			found = 1;
+			writable |= image->segments[i].writable;
+		}
+	}
+	if(!found) return 0;
+
+	if(!writable && image->text && vaddr >= image->text_start && vaddr < image->text_start + image->text_pages * PAGE_SIZE) {
+		void *page = loader_image_text_page(image, vaddr);
+		if(!page) return 0;
+		page_addref(page);
+		if(!pagetable_map(pt, vaddr, (unsigned) page, PAGE_FLAG_USER | PAGE_FLAG_SHARED | PAGE_FLAG_READONLY)) {
+			page_free(page);
+			return 0;
+		}
+		return 1;
+	}
+
+	/* A private page is filled through its physical address, so it may be mapped read-only. */
+	if(!pagetable_map(pt, vaddr, 0, PAGE_FLAG_USER | PAGE_FLAG_ALLOC | (writable ? PAGE_FLAG_READWRITE : PAGE_FLAG_READONLY))) return 0;
+	pagetable_getmap(pt, vaddr, &paddr, 0);
+
+	if(loader_image_fill(image, (char *) paddr, vaddr) < 0) {
+		pagetable_free(pt, vaddr, PAGE_SIZE);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Read in every page of the image that is not already mapped. */
+
+static int loader_image_populate( struct loader_image *image, struct pagetable *pt )
+{
+	unsigned paddr;
+	int i;
+
+	for(i = 0; i < image->nsegments; i++) {
+		struct loader_segment *s = &image->segments[i];
+		uint32_t vaddr;
+		for(vaddr = s->vaddr & 0xfffff000; vaddr < s->vaddr + s->memory_size; vaddr += PAGE_SIZE) {
+			if(pagetable_getmap(pt, vaddr, &paddr, 0)) continue;
+			if(!loader_image_fault(image, pt, vaddr)) return KERROR_EXECUTION_FAILED;
+		}
+	}
+
+	return 0;
+}
+
 /* Ensure that the current process has address space up to this value. */
 
 static int loader_ensure_address_space( struct process *p, uint32_t addr )
@@ -34,6 +326,37 @@ static int loader_ensure_address_space( struct process *p, uint32_t addr )
 	/* Return zero on success. */
 }
 
+/*
+Replace the address space of p with the given image,
+taking over the caller's reference to the image.
+*/
+
+static int loader_image_attach( struct process *p, struct loader_image *image )
+{
+	int i;
+
+	process_data_size_set(p, 0);
+	loader_image_delete(p->image);
+	p->image = image;
+
+	for(i = 0; i < image->nsegments; i++) {
+		struct loader_segment *s = &image->segments[i];
+		if(loader_ensure_address_space(p, s->vaddr + s->memory_size)!=0) {
+			printf("elf: unable to allocate memory for segment %d vaddr %x size %x\n",i,s->vaddr,s->memory_size);
+			return KERROR_EXECUTION_FAILED;
+		}
+	}
+
+	/* Without demand paging, read in the whole image now. */
+	if(!loader_demand_paging) {
+		if(loader_image_populate(image, p->pagetable)<0) {
+			return KERROR_EXECUTION_FAILED;
+		}
+	}
+
+	return 0;
+}
+
 /* Load an ELF executable into user space. */
 
 int loader_load_process(struct process *p, struct fs_dirent *d, addr_t * entry)
@@ -43,6 +366,15 @@ int loader_load_process(struct process *p, struct fs_dirent *d, addr_t * entry)
 	int i;
 	uint32_t actual;
 
+	/* If this executable is already running, share its image. */
+	struct loader_image *image = loader_image_lookup(d);
+	if(image) {
+		loader_image_addref(image);
+		image->loads++;
+		*entry = image->entry;
+		return loader_image_attach(p, image);
+	}
+
 	/* Load the overall ELF header from the beginning of the file. */
 	actual = fs_dirent_read(d, (char *) &header, sizeof(header), 0);
 	if(actual != sizeof(header)) {
@@ -56,6 +388,10 @@ int loader_load_process(struct process *p, struct fs_dirent *d, addr_t * entry)
 		return KERROR_NOT_EXECUTABLE;
 	}
 
+	image = kmalloc(sizeof(*image));
+	if(!image) return KERROR_OUT_OF_MEMORY;
+	memset(image, 0, sizeof(*image));
+
 	/* An elf file contains a sequence of "program headers" that correspond to loadable segments. */
 	for(i = 0; i < header.phnum; i++) {
 
@@ -63,6 +399,7 @@ int loader_load_process(struct process *p, struct fs_dirent *d, addr_t * entry)
 		actual = fs_dirent_read(d, (char *) &program, sizeof(program), header.program_offset + i * header.phentsize);
 		if(actual != sizeof(program)) {
 			printf("elf: unable to load segment header %d.\n",i);
+			kfree(image);
 			return KERROR_NOT_EXECUTABLE;
 		}
 
@@ -74,40 +411,59 @@ int loader_load_process(struct process *p, struct fs_dirent *d, addr_t * entry)
 		/* Each segment must be within the expected userspace range. */
 		if(program.vaddr < PROCESS_ENTRY_POINT || program.memory_size > 0x8000000) {
 			printf("elf: segment %d is invalid: vaddr %x size %x lies outside of user address space.\n",i,program.vaddr,program.memory_size);
+			kfree(image);
 			return KERROR_NOT_EXECUTABLE;
 		}
 
 		/* Check for unexpected segment configuration. */
 		if(program.file_size > program.memory_size) {
 			printf("elf: segment %d has unexpected file size %x smaller than memory size %x.\n",program.file_size,program.memory_size);
+			kfree(image);
 			return KERROR_NOT_EXECUTABLE;
 		}
 
-
-		/* Expand the user address space if needed for this segment. */
-		if(loader_ensure_address_space(p,program.vaddr + program.memory_size)!=0) {
-			printf("elf: unable to allocate memory for segment %d vaddr %x size %x\n",i,program.vaddr,program.memory_size);
-			return KERROR_OUT_OF_MEMORY;
-		}
-
-		/* If some (or all) of this segment is on disk, load it in. */
-		if(program.file_size>0) {
-			actual = fs_dirent_read(d, (char *) program.vaddr, program.file_size, program.offset);
-			if(actual != program.file_size) {
-				printf("elf: unable to load segment %d from disk.\n");
-				return KERROR_NOT_EXECUTABLE;
-			}
+		if(image->nsegments == LOADER_MAX_SEGMENTS) {
+			printf("elf: too many loadable segments.\n");
+			kfree(image);
+			return KERROR_NOT_EXECUTABLE;
 		}
 
-		/* If the remainder (or all) of this segment is BSS, initialize it. */
-		if(program.memory_size>program.file_size) {
-			memset( (char*) (program.vaddr+program.file_size), program.memory_size-program.file_size, 0 );
-		}
-		
-		/* XXX Set page table bits here. */
+		struct loader_segment *s = &image->segments[image->nsegments++];
+		s->vaddr = program.vaddr;
+		s->memory_size = program.memory_size;
+		s->offset = program.offset;
+		s->file_size = program.file_size;
+		s->writable = (program.flags & ELF_PROGRAM_FLAGS_WRITE) ? 1 : 0;
 	}
 
+	image->file = fs_dirent_addref(d);
+	image->file->text_busy++;
+	image->volume = d->volume;
+	image->inumber = d->inumber;
+	image->size = d->size;
+	image->generation = d->generation;
+	image->entry = header.entry;
+	image->refcount = 1;
+	image->loads = 1;
+	loader_image_text_init(image);
+
+	image->cached = 1;
+	list_push_head(&loader_images, &image->node);
+
 	/* Capture the program entry point for the caller to use. */
 	*entry = header.entry;
-	return 0;
+	return loader_image_attach(p, image);
+}
+
+void loader_debug()
+{
+	struct list_node *n;
+
+	for(n = loader_images.head; n; n = n->next) {
+		struct loader_image *image = (struct loader_image *) n;
+		printf("inode %d: %d users %d loads %d/%d text pages %d faults %d shared\n",
+			image->inumber, image->refcount, image->loads,
+			image->text_resident, image->text_pages,
+			image->text_faults, image->text_shared);
+	}
 }
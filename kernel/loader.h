@@ -20,4 +20,25 @@ in the argument "entry".
 
 int loader_load_process(struct process *p, struct fs_dirent *d, addr_t * entry);
 
+/*
+The image of the executable loaded into a process is kept
+in p->image, so that its pages can be faulted in on demand
+by loader_image_fault.  Images are cached and shared by all
+processes running the same executable, and so are their
+read-only pages.
+loader_set_demand_paging selects whether programs are loaded
+on demand (the default) or read completely before starting.
+*/
+
+int  loader_image_fault( struct loader_image *image, struct pagetable *pt, uint32_t vaddr );
+struct loader_image *loader_image_addref( struct loader_image *image );
+void loader_image_delete( struct loader_image *image );
+
+void loader_set_demand_paging( int enable );
+int  loader_get_demand_paging();
+
+/* Display the cached executable images and how their text pages are shared. */
+
+void loader_debug();
+
 #endif
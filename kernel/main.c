@@ -26,6 +26,10 @@ See the file LICENSE for details.
 #include "cdromfs.h"
 #include "diskfs.h"
 #include "serial.h"
+#include "bcache.h"
+#include "virtio_blk.h"
+#include "pci.h"
+#include "cpu.h"
 
 /*
 This is the C initialization point of the kernel.
@@ -44,13 +48,17 @@ int kernel_main()
 
 	page_init();
 	kmalloc_init((char *) KMALLOC_START, KMALLOC_LENGTH);
+	cpu_init();
 	interrupt_init();
 	mouse_init();
 	keyboard_init();
 	rtc_init();
 	clock_init();
 	process_init();
+	bcache_init();
+	pci_init();
 	ata_init();
+	virtio_blk_init();
 	cdrom_init();
 	diskfs_init();
 
@@ -8,47 +8,125 @@ See the file LICENSE for details.
 #include "kernel/types.h"
 #include "page.h"
 #include "string.h"
+#include "list.h"
 #include "memorylayout.h"
 #include "kernelcore.h"
 
+/*
+Physical pages are managed by a binary buddy allocator.
+Free memory is kept as blocks of 2^order pages, each aligned
+to its own size, on one free list per order.  An allocation
+takes a block from the smallest non-empty list of sufficient
+order, splitting it in half repeatedly as needed.  A free
+block is merged with its buddy (the other half of the block
+it was split from) whenever the buddy is also free.
+
+The list node of a free block is stored in the first bytes
+of the block itself, so the only other state is one byte per
+page, recording the order of the block that begins there and
+whether it is free, and a reference count per allocated block,
+so that pages can be shared between address spaces.
+*/
+
+#define PAGE_ORDER_FREE 0x80
+#define PAGE_ORDER_MASK 0x7f
+
+/*
+The first few pages of main memory are never handed out:
+vmware doesn't like the use of a particular page close to 1MB,
+but what it is used for I don't know.
+*/
+
+#define PAGE_RESERVED_MIN 32
+
 static uint32_t pages_free = 0;
 static uint32_t pages_total = 0;
 
-static uint32_t *freemap = 0;
-static uint32_t freemap_bits = 0;
-static uint32_t freemap_bytes = 0;
-static uint32_t freemap_cells = 0;
-static uint32_t freemap_pages = 0;
+static uint8_t *page_order = 0;
+static uint16_t *page_refs = 0;
+static uint32_t page_map_pages = 0;
+
+static struct list free_lists[PAGE_MAX_ORDER + 1];
 
 static void *main_memory_start = (void *) MAIN_MEMORY_START;
 
-#define CELL_BITS (8*sizeof(*freemap))
+static void *page_number_to_addr(uint32_t pagenumber)
+{
+	return (pagenumber << PAGE_BITS) + main_memory_start;
+}
+
+static uint32_t page_addr_to_number(void *pageaddr)
+{
+	return (pageaddr - main_memory_start) >> PAGE_BITS;
+}
+
+/* Place the block beginning at pagenumber on the free list for order. */
+
+static void page_block_insert(uint32_t pagenumber, int order)
+{
+	page_order[pagenumber] = PAGE_ORDER_FREE | order;
+	list_push_head(&free_lists[order], page_number_to_addr(pagenumber));
+}
+
+/* Take the block beginning at pagenumber off its free list. */
+
+static void page_block_remove(uint32_t pagenumber)
+{
+	list_remove(page_number_to_addr(pagenumber));
+	page_order[pagenumber] = 0;
+}
+
+/*
+Free the block of 2^order pages beginning at pagenumber,
+merging it with its buddy for as long as the buddy is free.
+*/
+
+static void page_block_free(uint32_t pagenumber, int order)
+{
+	while(order < PAGE_MAX_ORDER) {
+		uint32_t buddy = pagenumber ^ (1 << order);
+		if(buddy >= pages_total || page_order[buddy] != (PAGE_ORDER_FREE | order))
+			break;
+		page_block_remove(buddy);
+		pagenumber &= ~(1 << order);
+		order++;
+	}
+
+	page_block_insert(pagenumber, order);
+}
 
 void page_init()
 {
-	int i;
+	uint32_t i;
+	int order;
 
 	pages_total = (total_memory * 1024 * 1024 - MAIN_MEMORY_START) / PAGE_SIZE;
-	pages_free = pages_total;
-	printf("memory: %d MB (%d KB) total\n", (pages_free * PAGE_SIZE) / MEGA, (pages_free * PAGE_SIZE) / KILO);
+	printf("memory: %d MB (%d KB) total\n", (pages_total * PAGE_SIZE) / MEGA, (pages_total * PAGE_SIZE) / KILO);
 
-	freemap = main_memory_start;
-	freemap_bits = pages_total;
-	freemap_bytes = 1 + freemap_bits / 8;
-	freemap_cells = 1 + freemap_bits / CELL_BITS;
-	freemap_pages = 1 + freemap_bytes / PAGE_SIZE;
+	page_order = main_memory_start;
+	page_refs = (uint16_t *) (page_order + pages_total + pages_total % 2);
+	page_map_pages = 1 + (pages_total * 3 + 1) / PAGE_SIZE;
 
-	printf("memory: %d bits %d bytes %d cells %d pages\n", freemap_bits, freemap_bytes, freemap_cells, freemap_pages);
+	printf("memory: %d pages, %d pages of page map\n", pages_total, page_map_pages);
 
-	memset(freemap, 0xff, freemap_bytes);
-	for(i = 0; i < freemap_pages; i++)
-		page_alloc(0);
+	memset(page_order, 0, page_map_pages * PAGE_SIZE);
 
-	// This is ahack that I don't understand yet.
-	// vmware doesn't like the use of a particular page
-	// close to 1MB, but what it is used for I don't know.
+	/*
+	Carve the remaining memory into the largest aligned blocks
+	that fit, and place each on the appropriate free list.
+	*/
 
-	freemap[0] = 0x0;
+	i = MAX(page_map_pages, PAGE_RESERVED_MIN);
+
+	while(i < pages_total) {
+		order = PAGE_MAX_ORDER;
+		while(order > 0 && ((i & ((1 << order) - 1)) || i + (1 << order) > pages_total)) {
+			order--;
+		}
+		page_block_insert(i, order);
+		pages_free += 1 << order;
+		i += 1 << order;
+	}
 
 	printf("memory: %d MB (%d KB) available\n", (pages_free * PAGE_SIZE) / MEGA, (pages_free * PAGE_SIZE) / KILO);
 }
@@ -59,49 +137,85 @@ void page_stats( uint32_t *nfree, uint32_t *ntotal )
 	*ntotal = pages_total;
 }
 
-void *page_alloc(bool zeroit)
+void *page_alloc_n(int order, bool zeroit)
 {
-	uint32_t i, j;
-	uint32_t cellmask;
 	uint32_t pagenumber;
 	void *pageaddr;
+	int o;
 
-	if(!freemap) {
+	if(!page_order) {
 		printf("memory: not initialized yet!\n");
 		return 0;
 	}
 
-	for(i = 0; i < freemap_cells; i++) {
-		if(freemap[i] != 0) {
-			for(j = 0; j < CELL_BITS; j++) {
-				cellmask = (1 << j);
-				if(freemap[i] & cellmask) {
-					freemap[i] &= ~cellmask;
-					pagenumber = i * CELL_BITS + j;
-					pageaddr = (pagenumber << PAGE_BITS) + main_memory_start;
-					if(zeroit)
-						memset(pageaddr, 0, PAGE_SIZE);
-					pages_free--;
-					//printf("page: alloc %d\n",pages_free);
-					return pageaddr;
-				}
-			}
-		}
+	if(order < 0 || order > PAGE_MAX_ORDER)
+		return 0;
+
+	for(o = order; o <= PAGE_MAX_ORDER; o++) {
+		if(free_lists[o].head)
+			break;
+	}
+
+	if(o > PAGE_MAX_ORDER)
+		return 0;
+
+	pageaddr = list_pop_head(&free_lists[o]);
+	pagenumber = page_addr_to_number(pageaddr);
+
+	/* Split off and free the upper half until the block is the right size. */
+
+	while(o > order) {
+		o--;
+		page_block_insert(pagenumber + (1 << o), o);
+	}
+
+	page_order[pagenumber] = order;
+	page_refs[pagenumber] = 1;
+	pages_free -= 1 << order;
+
+	if(zeroit)
+		memset(pageaddr, 0, PAGE_SIZE << order);
+
+	return pageaddr;
+}
+
+void *page_alloc(bool zeroit)
+{
+	void *pageaddr = page_alloc_n(0, zeroit);
+	if(!pageaddr && page_order) {
+		printf("memory: WARNING: everything allocated\n");
+		halt();
 	}
+	return pageaddr;
+}
 
-	printf("memory: WARNING: everything allocated\n");
-	halt();
+void page_addref(void *pageaddr)
+{
+	page_refs[page_addr_to_number(pageaddr)]++;
+}
 
-	return 0;
+int page_refcount(void *pageaddr)
+{
+	return page_refs[page_addr_to_number(pageaddr)];
 }
 
 void page_free(void *pageaddr)
 {
-	uint32_t pagenumber = (pageaddr - main_memory_start) >> PAGE_BITS;
-	uint32_t cellnumber = pagenumber / CELL_BITS;
-	uint32_t celloffset = pagenumber % CELL_BITS;
-	uint32_t cellmask = (1 << celloffset);
-	freemap[cellnumber] |= cellmask;
-	pages_free++;
-	//printf("page: free %d\n",pages_free);
+	uint32_t pagenumber = page_addr_to_number(pageaddr);
+
+	if(page_order[pagenumber] & PAGE_ORDER_FREE) {
+		printf("memory: WARNING: page %x freed twice\n", pageaddr);
+		return;
+	}
+
+	if(page_refs[pagenumber] > 1) {
+		page_refs[pagenumber]--;
+		return;
+	}
+
+	page_refs[pagenumber] = 0;
+
+	int order = page_order[pagenumber] & PAGE_ORDER_MASK;
+	pages_free += 1 << order;
+	page_block_free(pagenumber, order);
 }
@@ -9,9 +9,23 @@ See the file LICENSE for details.
 
 #include "kernel/types.h"
 
+/*
+page_alloc_n returns a physically contiguous block of 2^order
+pages, aligned to its size, or null if no such block is free.
+Blocks of any order are returned with page_free.
+
+An allocated block may be shared: page_addref adds a reference,
+and page_free only releases the block when the last is dropped.
+*/
+
+#define PAGE_MAX_ORDER 10
+
 void  page_init();
 void *page_alloc(bool zeroit);
+void *page_alloc_n(int order, bool zeroit);
 void  page_free(void *addr);
+void  page_addref(void *addr);
+int   page_refcount(void *addr);
 void  page_stats( uint32_t *nfree, uint32_t *ntotal );
 
 #endif
@@ -11,6 +11,16 @@ See the file LICENSE for details.
 
 #define ENTRIES_PER_TABLE (PAGE_SIZE/4)
 
+/*
+The avail bits of a page entry record how the page is owned:
+PAGE_AVAIL_ALLOC if the page was allocated for this mapping
+(and must be freed with it), and PAGE_AVAIL_COW if it is shared
+read-only with another address space, to be copied on write.
+*/
+
+#define PAGE_AVAIL_ALLOC 0x01
+#define PAGE_AVAIL_COW   0x02
+
 struct pageentry {
 	unsigned present:1;	// 1 = present
 	unsigned readwrite:1;	// 1 = writable
@@ -74,7 +84,7 @@ int pagetable_getmap(struct pagetable *p, unsigned vaddr, unsigned *paddr, int *
 		*flags = 0;
 		if(e->readwrite)
 			*flags |= PAGE_FLAG_READWRITE;
-		if(e->avail & 0x01)
+		if(e->avail & PAGE_AVAIL_ALLOC)
 			*flags |= PAGE_FLAG_ALLOC;
 		if(!e->user)
 			*flags |= PAGE_FLAG_KERNEL;
@@ -83,6 +93,11 @@ int pagetable_getmap(struct pagetable *p, unsigned vaddr, unsigned *paddr, int *
 	return 1;
 }
 
+/*
+With PAGE_FLAG_SHARED, paddr is an allocated page whose reference
+is handed over to the pagetable, and released when it is unmapped.
+*/
+
 int pagetable_map(struct pagetable *p, unsigned vaddr, unsigned paddr, int flags)
 {
 	struct pagetable *q;
@@ -130,7 +145,7 @@ int pagetable_map(struct pagetable *p, unsigned vaddr, unsigned paddr, int flags
 	e->dirty = 0;
 	e->pagesize = 0;
 	e->globalpage = !e->user;
-	e->avail = (flags & PAGE_FLAG_ALLOC) ? 1 : 0;
+	e->avail = (flags & (PAGE_FLAG_ALLOC | PAGE_FLAG_SHARED)) ? PAGE_AVAIL_ALLOC : 0;
 	e->addr = (paddr >> 12);
 
 	return 1;
@@ -180,10 +195,7 @@ void pagetable_delete(struct pagetable *p)
 
 void pagetable_alloc(struct pagetable *p, unsigned vaddr, unsigned length, int flags)
 {
-	unsigned npages = length / PAGE_SIZE;
-
-	if(length % PAGE_SIZE)
-		npages++;
+	unsigned npages = (length + (vaddr & 0xfff) + PAGE_SIZE - 1) / PAGE_SIZE;
 
 	vaddr &= 0xfffff000;
 
@@ -199,10 +211,7 @@ void pagetable_alloc(struct pagetable *p, unsigned vaddr, unsigned length, int f
 
 void pagetable_free(struct pagetable *p, unsigned vaddr, unsigned length)
 {
-	unsigned npages = length / PAGE_SIZE;
-
-	if(length % PAGE_SIZE)
-		npages++;
+	unsigned npages = (length + (vaddr & 0xfff) + PAGE_SIZE - 1) / PAGE_SIZE;
 
 	vaddr &= 0xfffff000;
 
@@ -233,13 +242,26 @@ void pagetable_refresh()
 	asm("mov %eax, %cr3");
 }
 
+/*
+Enable paging, along with write protection in supervisor mode,
+so that kernel writes to copy-on-write pages fault as well.
+*/
+
 void pagetable_enable()
 {
 	asm("movl %cr0, %eax");
-	asm("orl $0x80000000, %eax");
+	asm("orl $0x80010000, %eax");
 	asm("movl %eax, %cr0");
 }
 
+/*
+Duplicate an address space for fork.  Rather than copying each
+allocated page, the page is shared between both tables and its
+reference count raised.  A writable page is made read-only and
+marked copy-on-write in both tables, so the first write from
+either side faults into pagetable_copy_on_write.
+*/
+
 struct pagetable *pagetable_duplicate(struct pagetable *sp)
 {
 	unsigned i, j;
@@ -267,23 +289,21 @@ struct pagetable *pagetable_duplicate(struct pagetable *sp)
 				e = &q->entry[j];
 				newe = &newq->entry[j];
 				memcpy(newe, e, sizeof(struct pageentry));
-				if(e->present) {
-					void *paddr;
-					paddr = (void *) (e->addr << 12);
-					void *new_paddr = 0;
-					if(e->avail) {
-						new_paddr = page_alloc(0);
-						if(!new_paddr)
-							goto cleanup;
-						memcpy(new_paddr, paddr, PAGE_SIZE);
-					} else {
-						new_paddr = paddr;
+				if(e->present && (e->avail & PAGE_AVAIL_ALLOC)) {
+					if(e->readwrite) {
+						e->readwrite = 0;
+						e->avail |= PAGE_AVAIL_COW;
+						memcpy(newe, e, sizeof(struct pageentry));
 					}
-					newe->addr = (((unsigned) new_paddr) >> 12);
+					page_addref((void *) (e->addr << 12));
 				}
 			}
 		}
 	}
+
+	/* Some entries in sp are now read-only, so flush stale TLB entries. */
+	pagetable_refresh();
+
 	return newp;
       cleanup:
 	printf("Pagetable duplicate errors\n");
@@ -293,4 +313,48 @@ struct pagetable *pagetable_duplicate(struct pagetable *sp)
 	return 0;
 }
 
+/*
+Resolve a write fault on a copy-on-write page.  If other address
+spaces still share the page, give this one a private copy, otherwise
+simply take ownership of it.  Either way the page becomes writable.
+Returns 1 if the fault was handled, or 0 if vaddr is not a
+copy-on-write page.
+*/
+
+int pagetable_copy_on_write(struct pagetable *p, unsigned vaddr)
+{
+	struct pagetable *q;
+	struct pageentry *e;
+
+	unsigned a = vaddr >> 22;
+	unsigned b = (vaddr >> 12) & 0x3ff;
+
+	e = &p->entry[a];
+	if(!e->present)
+		return 0;
+
+	q = (struct pagetable *) (e->addr << 12);
+	e = &q->entry[b];
+	if(!e->present || !(e->avail & PAGE_AVAIL_COW))
+		return 0;
+
+	void *paddr = (void *) (e->addr << 12);
+
+	if(page_refcount(paddr) > 1) {
+		void *new_paddr = page_alloc(0);
+		if(!new_paddr)
+			return 0;
+		memcpy(new_paddr, paddr, PAGE_SIZE);
+		page_free(paddr);
+		e->addr = ((unsigned) new_paddr) >> 12;
+	}
+
+	e->readwrite = 1;
+	e->avail &= ~PAGE_AVAIL_COW;
+
+	asm("invlpg (%0)"::"r"(vaddr):"memory");
+
+	return 1;
+}
+
 void pagetable_copy(struct pagetable *sp, unsigned saddr, struct pagetable *tp, unsigned taddr, unsigned length);
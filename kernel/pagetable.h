@@ -17,6 +17,7 @@ See the file LICENSE for details.
 #define PAGE_FLAG_READWRITE   4
 #define PAGE_FLAG_NOCLEAR     0
 #define PAGE_FLAG_CLEAR       8
+#define PAGE_FLAG_SHARED      16
 
 struct pagetable *pagetable_create();
 void pagetable_init(struct pagetable *p);
@@ -27,6 +28,7 @@ void pagetable_alloc(struct pagetable *p, unsigned vaddr, unsigned length, int f
 void pagetable_free(struct pagetable *p, unsigned vaddr, unsigned length);
 void pagetable_delete(struct pagetable *p);
 struct pagetable *pagetable_duplicate(struct pagetable *p);
+int pagetable_copy_on_write(struct pagetable *p, unsigned vaddr);
 struct pagetable *pagetable_load(struct pagetable *p);
 void pagetable_enable();
 void pagetable_refresh();
@@ -0,0 +1,107 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "pci.h"
+#include "ioports.h"
+#include "console.h"
+
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA    0xcfc
+
+#define PCI_MAX_DEVICES 32
+
+static struct pci_device devices[PCI_MAX_DEVICES];
+static int ndevices = 0;
+
+static uint32_t pci_config_address( int bus, int slot, int func, int offset )
+{
+	return 0x80000000 | (bus << 16) | (slot << 11) | (func << 8) | (offset & 0xfc);
+}
+
+static uint32_t pci_read( int bus, int slot, int func, int offset )
+{
+	outl(pci_config_address(bus, slot, func, offset), PCI_CONFIG_ADDRESS);
+	return inl(PCI_CONFIG_DATA);
+}
+
+uint32_t pci_config_read( struct pci_device *d, int offset )
+{
+	return pci_read(d->bus, d->slot, d->func, offset);
+}
+
+void pci_config_write( struct pci_device *d, int offset, uint32_t value )
+{
+	outl(pci_config_address(d->bus, d->slot, d->func, offset), PCI_CONFIG_ADDRESS);
+	outl(value, PCI_CONFIG_DATA);
+}
+
+static void pci_probe( int bus, int slot, int func )
+{
+	uint32_t id = pci_read(bus, slot, func, PCI_CONFIG_VENDOR);
+	if((id & 0xffff) == 0xffff) return;
+
+	uint32_t class = pci_read(bus, slot, func, PCI_CONFIG_CLASS);
+
+	if(ndevices >= PCI_MAX_DEVICES) return;
+
+	struct pci_device *d = &devices[ndevices++];
+	d->bus = bus;
+	d->slot = slot;
+	d->func = func;
+	d->vendor = id & 0xffff;
+	d->device = id >> 16;
+	d->class = class >> 24;
+	d->subclass = (class >> 16) & 0xff;
+	d->progif = (class >> 8) & 0xff;
+
+	printf("pci: %d.%d.%d vendor %x device %x class %x.%x\n", bus, slot, func, d->vendor, d->device, d->class, d->subclass);
+}
+
+void pci_init()
+{
+	int bus, slot, func;
+
+	for(bus = 0; bus < 256; bus++) {
+		for(slot = 0; slot < 32; slot++) {
+			uint32_t id = pci_read(bus, slot, 0, PCI_CONFIG_VENDOR);
+			if((id & 0xffff) == 0xffff) continue;
+
+			/* Only multi-function devices have functions beyond 0. */
+			uint32_t header = pci_read(bus, slot, 0, PCI_CONFIG_HEADER);
+			int nfuncs = (header & 0x800000) ? 8 : 1;
+
+			for(func = 0; func < nfuncs; func++) {
+				pci_probe(bus, slot, func);
+			}
+		}
+	}
+
+	printf("pci: %d devices\n", ndevices);
+}
+
+struct pci_device *pci_find( uint8_t class, uint8_t subclass )
+{
+	int i;
+	for(i = 0; i < ndevices; i++) {
+		if(devices[i].class == class && devices[i].subclass == subclass) {
+			return &devices[i];
+		}
+	}
+	return 0;
+}
+
+/* Return the index'th device with the given vendor and device ids. */
+
+struct pci_device *pci_find_id( uint16_t vendor, uint16_t device, int index )
+{
+	int i;
+	for(i = 0; i < ndevices; i++) {
+		if(devices[i].vendor == vendor && devices[i].device == device) {
+			if(index-- == 0) return &devices[i];
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,52 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef PCI_H
+#define PCI_H
+
+#include "kernel/types.h"
+
+#define PCI_CONFIG_VENDOR   0x00
+#define PCI_CONFIG_COMMAND  0x04
+#define PCI_CONFIG_CLASS    0x08
+#define PCI_CONFIG_HEADER   0x0c
+#define PCI_CONFIG_BAR0     0x10
+#define PCI_CONFIG_BAR4     0x20
+#define PCI_CONFIG_IRQ      0x3c
+
+#define PCI_COMMAND_IO         0x01
+#define PCI_COMMAND_MEMORY     0x02
+#define PCI_COMMAND_BUS_MASTER 0x04
+
+#define PCI_CLASS_STORAGE     0x01
+#define PCI_SUBCLASS_IDE      0x01
+
+struct pci_device {
+	uint8_t bus;
+	uint8_t slot;
+	uint8_t func;
+	uint16_t vendor;
+	uint16_t device;
+	uint8_t class;
+	uint8_t subclass;
+	uint8_t progif;
+};
+
+/*
+pci_init enumerates the devices on the PCI buses through
+configuration mechanism #1, and keeps a table of them.
+Drivers find their hardware with pci_find, and then use
+pci_config_read and pci_config_write to set it up.
+*/
+
+void pci_init();
+struct pci_device *pci_find( uint8_t class, uint8_t subclass );
+struct pci_device *pci_find_id( uint16_t vendor, uint16_t device, int index );
+
+uint32_t pci_config_read( struct pci_device *d, int offset );
+void     pci_config_write( struct pci_device *d, int offset, uint32_t value );
+
+#endif
@@ -18,9 +18,9 @@ See the file LICENSE for details.
 #include "main.h"
 #include "keyboard.h"
 #include "clock.h"
+#include "loader.h"
+#include "spinlock.h"
 
-struct process *current = 0;
-struct list ready_list = { 0, 0 };
 struct list grave_list = { 0, 0 };
 struct list grave_watcher_list = { 0, 0 };	// parent processes are put here to wait for their children
 struct process *process_table[PROCESS_MAX_PID] = { 0 };
@@ -125,6 +125,7 @@ void process_inherit(struct process *parent, struct process *child)
 {
 	/* Child inherits everything parent inherits */
 	int i;
+	child->priority = parent->priority;
 	int * fds = kmalloc(sizeof(int)*PROCESS_MAX_OBJECTS);
 	for (i = 0; i < PROCESS_MAX_OBJECTS; i++)
 	{
@@ -138,27 +139,29 @@ void process_inherit(struct process *parent, struct process *child)
 	kfree(fds);
 }
 
+/*
+Growing the data or stack segment only extends the range of
+addresses the process may use.  Each page is allocated and
+zeroed when first touched, by process_demand_page, so the cost
+of growth is independent of its size.  Shrinking a segment
+releases whatever pages were touched in the removed range.
+*/
+
 int process_data_size_set(struct process *p, unsigned size)
 {
 	// XXX check valid ranges
-	// XXX round up to page size
 
 	if(size % PAGE_SIZE) {
 		size += (PAGE_SIZE - size % PAGE_SIZE);
 	}
 
-	if(size > p->vm_data_size) {
-		uint32_t start = PROCESS_ENTRY_POINT + p->vm_data_size;
-		pagetable_alloc(p->pagetable, start, size, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR);
-	} else if(size < p->vm_data_size) {
+	if(size < p->vm_data_size) {
 		uint32_t start = PROCESS_ENTRY_POINT + size;
-		pagetable_free(p->pagetable, start, p->vm_data_size);
-	} else {
-		// requested size is equal to current.
+		pagetable_free(p->pagetable, start, p->vm_data_size - size);
+		pagetable_refresh();
 	}
 
 	p->vm_data_size = size;
-	pagetable_refresh();
 
 	return 0;
 }
@@ -166,26 +169,79 @@ int process_data_size_set(struct process *p, unsigned size)
 int process_stack_size_set(struct process *p, unsigned size)
 {
 	// XXX check valid ranges
-	// XXX round up to page size
 
-	if(size > p->vm_stack_size) {
-		uint32_t start = -size;
-		pagetable_alloc(p->pagetable, start, size - p->vm_stack_size, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR);
-	} else {
+	if(size % PAGE_SIZE) {
+		size += (PAGE_SIZE - size % PAGE_SIZE);
+	}
+
+	if(size < p->vm_stack_size) {
 		uint32_t start = -p->vm_stack_size;
 		pagetable_free(p->pagetable, start, p->vm_stack_size - size);
+		pagetable_refresh();
 	}
 
 	p->vm_stack_size = size;
-	pagetable_refresh();
 
 	return 0;
 }
 
+/*
+Reset the stack to the given size, and populate and clear it
+immediately, since the arguments are written to it before the
+process runs, and possibly while it is not the current process.
+*/
+
 void process_stack_reset(struct process *p, unsigned size)
 {
 	process_stack_size_set(p, size);
-	memset((void *) -size, size, 0);
+	pagetable_alloc(p->pagetable, -size, size, PAGE_FLAG_USER | PAGE_FLAG_READWRITE);
+	memset((void *) -size, 0, size);
+}
+
+/*
+Resolve a fault on an unmapped page of process p.  A page of the
+program image is loaded from the executable.  Any other page within
+the data segment, within the stack segment, or just below the stack
+pointer (growing the stack) is allocated and zeroed on demand.
+Returns 1 if the fault was resolved, or 0 if the access is illegal.
+*/
+
+int process_demand_page(struct process *p, unsigned vaddr, unsigned esp)
+{
+	unsigned paddr;
+	unsigned data_end = PROCESS_ENTRY_POINT + p->vm_data_size;
+	unsigned stack_start = -p->vm_stack_size;
+
+	if(pagetable_getmap(p->pagetable, vaddr, &paddr, 0))
+		return 0;
+
+	if(p->image && loader_image_fault(p->image, p->pagetable, vaddr))
+		return 1;
+
+	if(vaddr >= PROCESS_ENTRY_POINT && vaddr < data_end) {
+		pagetable_alloc(p->pagetable, vaddr, PAGE_SIZE, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR);
+		return 1;
+	}
+
+	if(vaddr < data_end)
+		return 0;
+
+	if(p->vm_stack_size > 0 && vaddr >= stack_start) {
+		pagetable_alloc(p->pagetable, vaddr, PAGE_SIZE, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR);
+		return 1;
+	}
+
+	// Subtract 128 from esp because of the red-zone 
+	// According to https:gcc.gnu.org, the red zone is a 128-byte area beyond 
+	// the stack pointer that will not be modified by signal or interrupt handlers 
+	// and therefore can be used for temporary data without adjusting the stack pointer.
+	if(vaddr >= esp - 128) {
+		p->vm_stack_size = -(vaddr & 0xfffff000);
+		pagetable_alloc(p->pagetable, vaddr, PAGE_SIZE, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR);
+		return 1;
+	}
+
+	return 0;
 }
 
 struct process *process_create()
@@ -202,6 +258,13 @@ struct process *process_create()
 
 	p->vm_data_size = 0;
 	p->vm_stack_size = 0;
+	p->image = 0;
+
+	p->priority = PROCESS_PRIORITY_DEFAULT;
+	p->priority_floor = PROCESS_PRIORITY_MIN;
+	p->bonus = 0;
+	p->timeslice = 0;
+	p->timer.node.list = 0;
 
 	process_data_size_set(p, 2 * PAGE_SIZE);
 	process_stack_size_set(p, 2 * PAGE_SIZE);
@@ -223,6 +286,37 @@ struct process *process_create()
 	return p;
 }
 
+/*
+Create a process that runs the given function entirely in kernel mode,
+for use by kernel services that need to block (such as the bcache flusher).
+The initial frame is the same as a user process, except that the code and
+data segments are those of the kernel, so that the iret in intr_return
+stays at the same privilege level and begins executing entry on the
+kernel stack.  The entry function must never return.
+*/
+
+struct process *process_create_kthread( void (*entry)() )
+{
+	struct process *p = process_create();
+
+	struct x86_stack *s = (struct x86_stack *) p->kstack_ptr;
+	s->es = X86_SEGMENT_KERNEL_DATA;
+	s->ds = X86_SEGMENT_KERNEL_DATA;
+	s->cs = X86_SEGMENT_KERNEL_CODE;
+	s->eip = (uint32_t) entry;
+	s->eflags.iopl = 0;
+
+	/*
+	Kernel threads do the block I/O that everything else waits on,
+	so they run at the highest priority and may not be demoted.
+	*/
+
+	p->priority = PROCESS_PRIORITY_MAX;
+	p->priority_floor = PROCESS_PRIORITY_MAX;
+
+	return p;
+}
+
 void process_delete(struct process *p)
 {
 	int i;
@@ -231,15 +325,76 @@ void process_delete(struct process *p)
 			kobject_close(p->ktable[i]);
 		}
 	}
+	list_remove(&p->timer.node);
+	loader_image_delete(p->image);
 	pagetable_delete(p->pagetable);
 	page_free(p->kstack);
-	page_free(p);
 	process_table[p->pid] = 0;
+	page_free(p);
+}
+
+/*
+Ready processes are kept in one queue per priority level, along with
+a bitmap of the non-empty queues, so that the next process to run is
+found in constant time.  A process runs at its base priority plus a
+dynamic bonus: using up a whole timeslice lowers the bonus, while
+blocking (for I/O, a pipe, or a timer) raises it, so that interactive
+processes run ahead of CPU-bound ones of the same base priority.
+The queues and bitmap are shared by all processors and protected by
+ready_lock, which may be taken from interrupt handlers that wake up
+a process.  ready_bitmap is also read without the lock, as a hint of
+whether another process is waiting to run.
+*/
+
+static struct list ready_queue[PROCESS_PRIORITY_LEVELS];
+static uint32_t ready_bitmap = 0;
+static struct spinlock ready_lock = SPINLOCK_INIT;
+static int process_timeslice = PROCESS_TIMESLICE_DEFAULT;
+
+static int process_effective_priority(struct process *p)
+{
+	int pri = p->priority + p->bonus;
+	if(pri < PROCESS_PRIORITY_MIN) pri = PROCESS_PRIORITY_MIN;
+	if(pri > PROCESS_PRIORITY_MAX) pri = PROCESS_PRIORITY_MAX;
+	return pri;
+}
+
+static void process_ready(struct process *p)
+{
+	int pri = process_effective_priority(p);
+	p->state = PROCESS_STATE_READY;
+	spinlock_acquire(&ready_lock);
+	list_push_tail(&ready_queue[pri], &p->node);
+	ready_bitmap |= 1 << pri;
+	spinlock_release(&ready_lock);
+}
+
+/*
+A ready process may have been removed from its queue by process_kill,
+so an empty queue found through the bitmap is cleared and skipped.
+*/
+
+static struct process *process_ready_pop()
+{
+	struct process *p = 0;
+
+	spinlock_acquire(&ready_lock);
+	while(ready_bitmap) {
+		int pri = 31 - __builtin_clz(ready_bitmap);
+		p = (struct process *) list_pop_head(&ready_queue[pri]);
+		if(!ready_queue[pri].head)
+			ready_bitmap &= ~(1 << pri);
+		if(p)
+			break;
+	}
+	spinlock_release(&ready_lock);
+
+	return p;
 }
 
 void process_launch(struct process *p)
 {
-	list_push_tail(&ready_list, &p->node);
+	process_ready(p);
 }
 
 static void process_switch( process_state_t newstate )
@@ -262,7 +417,7 @@ static void process_switch( process_state_t newstate )
 		current->state = newstate;
 
 		if(newstate == PROCESS_STATE_READY) {
-			list_push_tail(&ready_list, &current->node);
+			process_ready(current);
 		}
 		if(newstate == PROCESS_STATE_GRAVE) {
 			list_push_tail(&grave_list, &current->node);
@@ -272,7 +427,7 @@ static void process_switch( process_state_t newstate )
 	current = 0;
 
 	while(1) {
-		current = (struct process *) list_pop_head(&ready_list);
+		current = process_ready_pop();
 		if(current)
 			break;
 
@@ -282,6 +437,7 @@ static void process_switch( process_state_t newstate )
 	}
 
 	current->state = PROCESS_STATE_RUNNING;
+	current->timeslice = process_timeslice;
 	interrupt_stack_pointer = current->kstack_top;
 
 	asm("movl %0, %%cr3"::"r"(current->pagetable));
@@ -298,15 +454,98 @@ static void process_switch( process_state_t newstate )
 	interrupt_unblock();
 }
 
-int allow_preempt = 0;
-
 void process_preempt()
 {
-	if(allow_preempt && current && ready_list.head) {
+	if(current && ready_bitmap) {
 		process_switch(PROCESS_STATE_READY);
 	}
 }
 
+/*
+Called on every clock tick to charge the running process,
+or to count the tick as idle on this processor if no process is running.
+*/
+
+void process_tick()
+{
+	if(!current) {
+		cpu_self()->idle_ticks++;
+	} else if(current->timeslice > 0) {
+		current->timeslice--;
+	}
+}
+
+/* Idle ticks are summed over all processors. */
+
+uint32_t process_idle_ticks()
+{
+	uint32_t idle_ticks = 0;
+	int i;
+
+	for(i = 0; i < cpu_count(); i++) {
+		idle_ticks += cpu_get(i)->idle_ticks;
+	}
+
+	return idle_ticks;
+}
+
+/*
+Called on return from an interrupt that arrived in user mode.
+(The kernel itself is not preemptible.)  The running process is
+switched out if its timeslice is used up, or if a process of higher
+priority has become ready, such as one woken up by the interrupt.
+*/
+
+void process_reschedule()
+{
+	if(!current) return;
+
+	if(current->timeslice == 0) {
+		if(current->bonus > -PROCESS_BONUS_MAX) current->bonus--;
+		current->timeslice = process_timeslice;
+		process_preempt();
+	} else if(ready_bitmap >> (process_effective_priority(current) + 1)) {
+		process_preempt();
+	}
+}
+
+/*
+Set the base priority of a process on behalf of caller, which may
+only change its own priority or that of its children.  A null caller
+is the kernel itself, which may change any process.  No process may
+be set below its priority floor, which keeps kernel threads at the
+priority they were created with.
+*/
+
+int process_priority_set( struct process *caller, uint32_t pid, int priority )
+{
+	if(priority < PROCESS_PRIORITY_MIN || priority > PROCESS_PRIORITY_MAX)
+		return KERROR_INVALID_REQUEST;
+	if(pid == 0 || pid >= PROCESS_MAX_PID || !process_table[pid])
+		return KERROR_NOT_FOUND;
+
+	struct process *p = process_table[pid];
+	if(caller && p != caller && p->ppid != caller->pid)
+		return KERROR_PERMISSION_DENIED;
+	if(priority < p->priority_floor)
+		return KERROR_PERMISSION_DENIED;
+
+	int old = p->priority;
+	p->priority = priority;
+	p->bonus = 0;
+	return old;
+}
+
+void process_timeslice_set( int ticks )
+{
+	if(ticks > 0) process_timeslice = ticks;
+}
+
+int process_timeslice_get()
+{
+	return process_timeslice;
+}
+
 void process_yield()
 {
 	/* no-op if process module not yet initialized. */
@@ -325,6 +564,7 @@ void process_exit(int code)
 
 void process_wait(struct list *q)
 {
+	if(current->bonus < PROCESS_BONUS_MAX) current->bonus++;
 	list_push_tail(q, &current->node);
 	process_switch(PROCESS_STATE_BLOCKED);
 }
@@ -334,8 +574,7 @@ void process_wakeup(struct list *q)
 	struct process *p;
 	p = (struct process *) list_pop_head(q);
 	if(p) {
-		p->state = PROCESS_STATE_READY;
-		list_push_tail(&ready_list, &p->node);
+		process_ready(p);
 	}
 }
 
@@ -354,10 +593,9 @@ void process_wakeup_parent(struct list *q)
 	// Loop through all the waiting parents to see if one needs to be woken up
 	while(p) {
 		if(p->pid == current->ppid && (p->waiting_for_child_pid == 0 || p->waiting_for_child_pid == current->pid)) {
-			p->state = PROCESS_STATE_READY;
 			p->waiting_for_child_pid = 0;
 			list_remove(&p->node);
-			list_push_tail(&ready_list, &p->node);
+			process_ready(p);
 			break;
 		}
 		p = (struct process *) (&p->node)->next;
@@ -368,8 +606,17 @@ void process_wakeup_all(struct list *q)
 {
 	struct process *p;
 	while((p = (struct process *) list_pop_head(q))) {
-		p->state = PROCESS_STATE_READY;
-		list_push_tail(&ready_list, &p->node);
+		process_ready(p);
+	}
+}
+
+/* Wake up process p, if it is blocked on any queue. */
+
+void process_wakeup_process(struct process *p)
+{
+	if(p->state == PROCESS_STATE_BLOCKED) {
+		list_remove(&p->node);
+		process_ready(p);
 	}
 }
 
@@ -426,6 +673,8 @@ void process_make_dead(struct process *dead)
 	if(dead == current) {
 		process_switch(PROCESS_STATE_GRAVE);
 	} else {
+		list_remove(&dead->timer.node);
+		dead->state = PROCESS_STATE_GRAVE;
 		list_remove(&dead->node);
 		list_push_tail(&grave_list, &dead->node);
 	}
@@ -449,15 +698,12 @@ int process_kill(uint32_t pid)
 
 int process_wait_child(uint32_t pid, struct process_info *info, int timeout)
 {
-	clock_t start, elapsed;
-	uint32_t total;
+	uint32_t deadline = clock_ticks() + clock_millis_to_ticks(timeout);
 
 	if(!info)
 		return -1;
 
-	start = clock_read();
-
-	do {
+	while(1) {
 		struct process *p = (struct process *) (grave_list.head);
 		while(p) {
 			struct process *next = (struct process *) p->node.next;
@@ -471,12 +717,15 @@ int process_wait_child(uint32_t pid, struct process_info *info, int timeout)
 		}
 
 		current->waiting_for_child_pid = pid;
-		process_wait(&grave_watcher_list);
 
-		elapsed = clock_diff(start, clock_read());
-		total = elapsed.millis + elapsed.seconds * 1000;
-	} while(total < timeout || timeout < 0);
+		if(timeout < 0) {
+			process_wait(&grave_watcher_list);
+		} else if(!clock_wait_until(&grave_watcher_list, deadline)) {
+			break;
+		}
+	}
 
+	current->waiting_for_child_pid = 0;
 	return 0;
 }
 
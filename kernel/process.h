@@ -14,6 +14,8 @@ See the file LICENSE for details.
 #include "kobject.h"
 #include "x86.h"
 #include "fs.h"
+#include "clock.h"
+#include "cpu.h"
 
 typedef enum {
 	PROCESS_STATE_CRADLE,
@@ -23,12 +25,18 @@ typedef enum {
 	PROCESS_STATE_GRAVE,
 } process_state_t;
 
+struct loader_image;
+
 #define PROCESS_MAX_OBJECTS 32
 #define PROCESS_MAX_PID 1024
 
 #define PROCESS_EXIT_NORMAL   0
 #define PROCESS_EXIT_KILLED   1
 
+#define PROCESS_PRIORITY_LEVELS (PROCESS_PRIORITY_MAX+1)
+#define PROCESS_BONUS_MAX 2
+#define PROCESS_TIMESLICE_DEFAULT 5
+
 struct process {
 	struct list_node node;
 	process_state_t state;
@@ -45,11 +53,18 @@ struct process {
 	uint32_t vm_data_size;
 	uint32_t vm_stack_size;
 	uint32_t waiting_for_child_pid;
+	struct loader_image *image;
+	int priority;
+	int priority_floor;
+	int bonus;
+	int timeslice;
+	struct clock_timer timer;
 };
 
 void process_init();
 
 struct process *process_create();
+struct process *process_create_kthread( void (*entry)() );
 void process_delete(struct process *p);
 void process_launch(struct process *p);
 void process_pass_arguments(struct process *p, int argc, char **argv);
@@ -62,12 +77,19 @@ void process_kstack_copy(struct process *parent, struct process *child);
 
 int process_data_size_set(struct process *p, unsigned size);
 int process_stack_size_set(struct process *p, unsigned size);
+int process_demand_page(struct process *p, unsigned vaddr, unsigned esp);
 
 int process_available_fd(struct process *p);
 int process_object_max(struct process *p);
 
 void process_yield();
 void process_preempt();
+void process_tick();
+uint32_t process_idle_ticks();
+void process_reschedule();
+int  process_priority_set( struct process *caller, uint32_t pid, int priority );
+void process_timeslice_set( int ticks );
+int  process_timeslice_get();
 void process_exit(int code);
 void process_dump(struct process *p);
 
@@ -75,6 +97,7 @@ void process_wait(struct list *q);
 void process_wakeup(struct list *q);
 void process_wakeup_parent(struct list *q);
 void process_wakeup_all(struct list *q);
+void process_wakeup_process(struct process *p);
 void process_reap_all();
 
 int process_kill(uint32_t pid);
@@ -83,6 +106,8 @@ int process_reap(uint32_t pid);
 
 int process_stats(int pid, struct process_stats *stat);
 
-extern struct process *current;
+/* The process running on this processor. */
+
+#define current (cpu_self()->current)
 
 #endif
@@ -0,0 +1,158 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "slab.h"
+#include "page.h"
+#include "console.h"
+#include "kernel/types.h"
+
+/*
+Each slab is a single page, beginning with a struct slab header
+and followed by as many objects as will fit.  Free objects are
+chained through their first word, so allocation and free are
+constant time, and the slab of any object is found by rounding
+its address down to the page boundary.
+
+A cache keeps its slabs on three lists: partial slabs (some objects
+free) are allocated from first, then a single empty slab is kept in
+reserve, and full slabs are set aside until an object is freed.
+Any further empty slab is returned to the page allocator.
+*/
+
+struct slab {
+	struct list_node node;
+	struct slab_cache *cache;
+	void *free;
+	int used;
+	int total;
+};
+
+#define SLAB_ALIGN 8
+#define SLAB_ROUND(x) (((x)+SLAB_ALIGN-1) & ~(SLAB_ALIGN-1))
+#define SLAB_HEADER_SIZE SLAB_ROUND(sizeof(struct slab))
+
+static struct list slab_caches = LIST_INIT;
+
+static int slab_object_size( struct slab_cache *c )
+{
+	return SLAB_ROUND(MAX(c->object_size,(int)sizeof(void*)));
+}
+
+static struct slab * slab_create( struct slab_cache *c )
+{
+	int size = slab_object_size(c);
+	int i;
+
+	if(SLAB_HEADER_SIZE+size>PAGE_SIZE) {
+		printf("slab: %s objects are too large!\n",c->name);
+		return 0;
+	}
+
+	struct slab *s = page_alloc(0);
+	if(!s) return 0;
+
+	s->cache = c;
+	s->free = 0;
+	s->used = 0;
+	s->total = (PAGE_SIZE-SLAB_HEADER_SIZE)/size;
+
+	char *objects = (char*)s + SLAB_HEADER_SIZE;
+	for(i=s->total-1;i>=0;i--) {
+		void **o = (void**)&objects[i*size];
+		*o = s->free;
+		s->free = o;
+	}
+
+	c->slabs++;
+	c->objects_total += s->total;
+
+	return s;
+}
+
+static void slab_delete( struct slab *s )
+{
+	struct slab_cache *c = s->cache;
+	c->slabs--;
+	c->objects_total -= s->total;
+	page_free(s);
+}
+
+void *slab_alloc( struct slab_cache *c )
+{
+	if(!c->registered) {
+		list_push_tail(&slab_caches,&c->node);
+		c->registered = 1;
+	}
+
+	struct slab *s = (struct slab *) c->partial.head;
+	if(!s) {
+		s = (struct slab *) list_pop_head(&c->empty);
+		if(!s) s = slab_create(c);
+		if(!s) return 0;
+		list_push_head(&c->partial,&s->node);
+	}
+
+	void **o = s->free;
+	s->free = *o;
+	s->used++;
+
+	if(s->used==s->total) {
+		list_remove(&s->node);
+		list_push_head(&c->full,&s->node);
+	}
+
+	c->objects_used++;
+	c->allocs++;
+
+	if(c->ctor) c->ctor(o);
+
+	return o;
+}
+
+void slab_free( struct slab_cache *c, void *object )
+{
+	if(!object) return;
+
+	struct slab *s = (struct slab *) ((uint32_t)object & ~(PAGE_SIZE-1));
+	if(s->cache!=c) {
+		printf("slab: invalid free of %x to %s\n",object,c->name);
+		return;
+	}
+
+	if(s->used==s->total) {
+		list_remove(&s->node);
+		list_push_head(&c->partial,&s->node);
+	}
+
+	*(void**)object = s->free;
+	s->free = object;
+	s->used--;
+
+	c->objects_used--;
+	c->frees++;
+
+	if(s->used==0) {
+		list_remove(&s->node);
+		if(c->empty.head) {
+			slab_delete(s);
+		} else {
+			list_push_head(&c->empty,&s->node);
+		}
+	}
+}
+
+void slab_debug()
+{
+	struct list_node *n;
+
+	for(n=slab_caches.head;n;n=n->next) {
+		struct slab_cache *c = (struct slab_cache *) n;
+		printf("%s: %d bytes %d slabs %d/%d used %d allocs %d frees\n",
+			c->name,c->object_size,c->slabs,
+			c->objects_used,c->objects_total,
+			c->allocs,c->frees);
+	}
+}
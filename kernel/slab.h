@@ -0,0 +1,43 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "kernel/types.h"
+#include "list.h"
+
+/*
+A slab cache hands out fixed-size objects of a single type,
+carved from pages obtained from the page allocator.  A cache
+is declared statically with SLAB_CACHE_INIT, and registers
+itself with the list of caches on first use.  If ctor is not
+null, it is applied to each object as it is allocated.
+*/
+
+struct slab_cache {
+	struct list_node node;
+	const char *name;
+	int object_size;
+	void (*ctor) (void *object);
+	struct list partial;
+	struct list full;
+	struct list empty;
+	int registered;
+	uint32_t slabs;
+	uint32_t objects_used;
+	uint32_t objects_total;
+	uint32_t allocs;
+	uint32_t frees;
+};
+
+#define SLAB_CACHE_INIT(name,size,ctor) { {0,0,0,0}, name, size, ctor, LIST_INIT, LIST_INIT, LIST_INIT, 0, 0, 0, 0, 0, 0 }
+
+void *slab_alloc( struct slab_cache *c );
+void  slab_free( struct slab_cache *c, void *object );
+void  slab_debug();
+
+#endif
@@ -0,0 +1,33 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "spinlock.h"
+
+#define EFLAGS_INTERRUPT 0x200
+
+void spinlock_acquire( struct spinlock *l )
+{
+	uint32_t eflags;
+
+	asm volatile("pushfl; popl %0; cli" : "=r"(eflags) : : "memory");
+
+	while(__sync_lock_test_and_set(&l->locked, 1)) {
+		asm volatile("pause");
+	}
+
+	l->eflags = eflags;
+}
+
+void spinlock_release( struct spinlock *l )
+{
+	uint32_t eflags = l->eflags;
+
+	__sync_lock_release(&l->locked);
+
+	if(eflags & EFLAGS_INTERRUPT) {
+		asm volatile("sti");
+	}
+}
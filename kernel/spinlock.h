@@ -0,0 +1,31 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "kernel/types.h"
+
+/*
+A spinlock protects a short critical section that must not block,
+such as the scheduler's ready queues.  Acquiring the lock disables
+interrupts on this processor and then spins on an atomic exchange,
+so it excludes both interrupt handlers and other processors.
+Releasing the lock restores the interrupt state saved on acquire.
+A process must never sleep while holding a spinlock.
+*/
+
+struct spinlock {
+	volatile uint32_t locked;
+	uint32_t eflags;
+};
+
+#define SPINLOCK_INIT {0,0}
+
+void spinlock_acquire( struct spinlock *l );
+void spinlock_release( struct spinlock *l );
+
+#endif
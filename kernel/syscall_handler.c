@@ -245,6 +245,9 @@ int sys_process_fork()
 	p->ppid = current->pid;
 	pagetable_delete(p->pagetable);
 	p->pagetable = pagetable_duplicate(current->pagetable);
+	p->vm_data_size = current->vm_data_size;
+	p->vm_stack_size = current->vm_stack_size;
+	p->image = loader_image_addref(current->image);
 	process_inherit(current, p);
 	process_kstack_copy(current, p);
 	process_launch(p);
@@ -295,6 +298,11 @@ int sys_process_heap(int delta)
 	return PROCESS_ENTRY_POINT + current->vm_data_size;
 }
 
+int sys_process_priority(int pid, int priority)
+{
+	return process_priority_set(current, pid, priority);
+}
+
 int sys_object_list( int fd, char *buffer, int length)
 {
 	if(!is_valid_object(fd)) return KERROR_INVALID_OBJECT;
@@ -535,6 +543,16 @@ int sys_system_time( uint32_t *tm )
 	return 0;
 }
 
+/* Milliseconds since boot, with the resolution of the clock tick. */
+
+int sys_system_clock( uint32_t *millis )
+{
+	if(!is_valid_pointer(millis,sizeof(*millis))) return KERROR_INVALID_ADDRESS;
+	clock_t t = clock_read();
+	*millis = t.seconds*1000 + t.millis;
+	return 0;
+}
+
 int sys_system_rtc( struct rtc_time *t )
 {
 	if(!is_valid_pointer(t,sizeof(*t))) return KERROR_INVALID_ADDRESS;
@@ -587,6 +605,8 @@ int32_t syscall_handler(syscall_t n, uint32_t a, uint32_t b, uint32_t c, uint32_
 		return sys_process_stats((struct process_stats *) a, b);
 	case SYSCALL_PROCESS_HEAP:
 		return sys_process_heap(a);
+	case SYSCALL_PROCESS_PRIORITY:
+		return sys_process_priority(a, b);
 	case SYSCALL_OPEN_FILE:
 		return sys_open_file(a, (const char *)b, c, d);
 	case SYSCALL_OPEN_DIR:
@@ -633,6 +653,8 @@ int32_t syscall_handler(syscall_t n, uint32_t a, uint32_t b, uint32_t c, uint32_
 		return sys_system_rtc((struct rtc_time *) a);
 	case SYSCALL_DEVICE_DRIVER_STATS:
 		return sys_device_driver_stats((char *) a, (struct device_driver_stats *) b);
+	case SYSCALL_SYSTEM_CLOCK:
+		return sys_system_clock((uint32_t *) a);
 	default:
 		return KERROR_INVALID_SYSCALL;
 	}
@@ -0,0 +1,453 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "virtio_blk.h"
+#include "device.h"
+#include "pci.h"
+#include "ioports.h"
+#include "interrupt.h"
+#include "process.h"
+#include "mutex.h"
+#include "page.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "console.h"
+#include "memorylayout.h"
+#include "kernel/error.h"
+
+/*
+A driver for virtio block devices (as presented by qemu with
+-drive if=virtio) through the legacy PCI transport.  Each device has
+a single virtqueue shared with the host.  A request occupies a chain
+of three descriptors: a header naming the operation and sector, the
+data buffer, and a status byte written back by the host.  Requests
+are placed in the available ring and the host is notified, without
+waiting, so that many requests can be in flight at once.  When the
+host interrupts, a kernel worker process collects the finished
+requests from the used ring and completes them.
+*/
+
+#define VIRTIO_PCI_VENDOR	0x1af4
+#define VIRTIO_PCI_DEVICE_BLK	0x1001
+
+/* Registers of the legacy transport, relative to BAR0. */
+
+#define VIRTIO_DEVICE_FEATURES	0x00
+#define VIRTIO_GUEST_FEATURES	0x04
+#define VIRTIO_QUEUE_ADDRESS	0x08
+#define VIRTIO_QUEUE_SIZE	0x0c
+#define VIRTIO_QUEUE_SELECT	0x0e
+#define VIRTIO_QUEUE_NOTIFY	0x10
+#define VIRTIO_DEVICE_STATUS	0x12
+#define VIRTIO_ISR_STATUS	0x13
+#define VIRTIO_BLK_CAPACITY	0x14	/* in 512-byte sectors */
+
+#define VIRTIO_STATUS_ACKNOWLEDGE	0x01
+#define VIRTIO_STATUS_DRIVER		0x02
+#define VIRTIO_STATUS_DRIVER_OK		0x04
+#define VIRTIO_STATUS_FAILED		0x80
+
+#define VIRTQ_DESC_F_NEXT	1
+#define VIRTQ_DESC_F_WRITE	2	/* written by the device */
+#define VIRTQ_ALIGN		4096
+
+#define VIRTIO_BLK_T_IN		0
+#define VIRTIO_BLK_T_OUT	1
+#define VIRTIO_BLK_S_OK		0
+
+#define VIRTIO_BLK_DESCS_PER_REQUEST	3
+#define VIRTIO_BLK_MAX_UNITS		4
+
+/*
+Transfers to or from user-space buffers, which need not be resident
+or physically contiguous, go through a bounce buffer of 2^order pages.
+*/
+
+#define VIRTIO_BLK_BOUNCE_ORDER	4
+#define VIRTIO_BLK_BOUNCE_BLOCKS ((PAGE_SIZE << VIRTIO_BLK_BOUNCE_ORDER) / VIRTIO_BLK_BLOCKSIZE)
+
+struct virtq_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+struct virtq_avail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+};
+
+struct virtq_used_elem {
+	uint32_t id;
+	uint32_t len;
+};
+
+struct virtq_used {
+	uint16_t flags;
+	uint16_t idx;
+	struct virtq_used_elem ring[];
+};
+
+struct virtio_blk_header {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+};
+
+/* Request slot i uses descriptors 3i, 3i+1, and 3i+2. */
+
+struct virtio_blk_slot {
+	struct virtio_blk_header header;
+	uint8_t status;
+	struct device_request *request;
+};
+
+struct virtio_blk {
+	int base;
+	int irq;
+	int nblocks;
+	int qsize;
+	struct virtq_desc *desc;
+	struct virtq_avail *avail;
+	volatile struct virtq_used *used;
+	uint16_t last_used;
+	struct virtio_blk_slot *slots;
+	int *free_slots;
+	int nfree;
+	struct list slot_waiters;
+	char *bounce;
+	struct mutex bounce_mutex;
+};
+
+static struct virtio_blk units[VIRTIO_BLK_MAX_UNITS];
+static int nunits = 0;
+
+static struct list completion_queue = LIST_INIT;
+static int interrupt_pending = 0;
+
+static struct device_driver virtio_blk_driver;
+
+#define virtio_barrier() asm volatile("" ::: "memory")
+
+static void virtio_blk_interrupt(int intr, int code)
+{
+	int i;
+
+	/* Reading the ISR status register acknowledges the interrupt. */
+	for(i = 0; i < nunits; i++) {
+		inb(units[i].base + VIRTIO_ISR_STATUS);
+	}
+
+	virtio_blk_driver.stats.interrupts++;
+	interrupt_pending = 1;
+	process_wakeup_all(&completion_queue);
+}
+
+/*
+Take a free request slot, waiting for one if all are in flight,
+then fill in its descriptors and make it available to the host.
+The buffer must be in kernel memory, which is identity mapped.
+*/
+
+int virtio_blk_submit(int unit, struct device_request *r)
+{
+	struct virtio_blk *v;
+	struct virtio_blk_slot *slot;
+	int s, d;
+
+	if(unit < 0 || unit >= nunits)
+		return KERROR_NOT_FOUND;
+
+	v = &units[unit];
+
+	interrupt_block();
+	while(v->nfree == 0) {
+		process_wait(&v->slot_waiters);
+		interrupt_block();
+	}
+	s = v->free_slots[--v->nfree];
+
+	slot = &v->slots[s];
+	slot->request = r;
+	slot->header.type = r->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	slot->header.reserved = 0;
+	slot->header.sector = (uint32_t) r->sector;
+	slot->status = 0xff;
+
+	d = s * VIRTIO_BLK_DESCS_PER_REQUEST;
+
+	v->desc[d].addr = (uint32_t) &slot->header;
+	v->desc[d].len = sizeof(slot->header);
+	v->desc[d].flags = VIRTQ_DESC_F_NEXT;
+	v->desc[d].next = d + 1;
+
+	v->desc[d + 1].addr = (uint32_t) r->buffer;
+	v->desc[d + 1].len = r->count * VIRTIO_BLK_BLOCKSIZE;
+	v->desc[d + 1].flags = VIRTQ_DESC_F_NEXT | (r->write ? 0 : VIRTQ_DESC_F_WRITE);
+	v->desc[d + 1].next = d + 2;
+
+	v->desc[d + 2].addr = (uint32_t) &slot->status;
+	v->desc[d + 2].len = 1;
+	v->desc[d + 2].flags = VIRTQ_DESC_F_WRITE;
+	v->desc[d + 2].next = 0;
+
+	v->avail->ring[v->avail->idx % v->qsize] = d;
+	virtio_barrier();
+	v->avail->idx++;
+	virtio_barrier();
+	outw(0, v->base + VIRTIO_QUEUE_NOTIFY);
+
+	interrupt_unblock();
+
+	return 0;
+}
+
+/* Complete every request that the host has returned in the used ring. */
+
+static void virtio_blk_reap(struct virtio_blk *v)
+{
+	while(v->last_used != v->used->idx) {
+		virtio_barrier();
+		volatile struct virtq_used_elem *e = &v->used->ring[v->last_used % v->qsize];
+		int s = e->id / VIRTIO_BLK_DESCS_PER_REQUEST;
+		struct virtio_blk_slot *slot = &v->slots[s];
+		struct device_request *r = slot->request;
+		int ok = (slot->status == VIRTIO_BLK_S_OK);
+
+		v->last_used++;
+		slot->request = 0;
+		v->free_slots[v->nfree++] = s;
+		process_wakeup(&v->slot_waiters);
+
+		device_request_complete(r, ok ? r->count : 0);
+	}
+}
+
+static void virtio_blk_worker()
+{
+	int i;
+
+	while(1) {
+		interrupt_block();
+		while(!interrupt_pending) {
+			process_wait(&completion_queue);
+			interrupt_block();
+		}
+		interrupt_pending = 0;
+		interrupt_unblock();
+
+		for(i = 0; i < nunits; i++) {
+			virtio_blk_reap(&units[i]);
+		}
+	}
+}
+
+static int virtio_blk_request(int unit, void *buffer, int nblocks, int offset, int write)
+{
+	struct device_request r;
+
+	r.buffer = buffer;
+	r.nblocks = r.count = nblocks;
+	r.offset = r.sector = offset;
+	r.write = write;
+	r.complete = 0;
+	r.arg = 0;
+	r.driver = &virtio_blk_driver;
+	r.unit = unit;
+	r.multiplier = 1;
+	r.result = 0;
+	r.done = 0;
+
+	if(virtio_blk_submit(unit, &r) < 0)
+		return 0;
+	device_request_wait(&r);
+
+	return r.result;
+}
+
+/*
+A synchronous transfer sleeps until its request completes.
+User-space buffers are copied through the bounce buffer by the
+calling process, so that any page faults are taken normally.
+*/
+
+static int virtio_blk_transfer(int unit, void *buffer, int nblocks, int offset, int write)
+{
+	struct virtio_blk *v;
+	int done, n;
+
+	if(unit < 0 || unit >= nunits)
+		return 0;
+
+	if((uint32_t) buffer < PROCESS_ENTRY_POINT)
+		return virtio_blk_request(unit, buffer, nblocks, offset, write);
+
+	v = &units[unit];
+	if(!v->bounce)
+		return 0;
+
+	mutex_lock(&v->bounce_mutex);
+	for(done = 0; done < nblocks; done += n) {
+		n = nblocks - done;
+		if(n > VIRTIO_BLK_BOUNCE_BLOCKS)
+			n = VIRTIO_BLK_BOUNCE_BLOCKS;
+		if(write)
+			memcpy(v->bounce, (char *) buffer + done * VIRTIO_BLK_BLOCKSIZE, n * VIRTIO_BLK_BLOCKSIZE);
+		if(virtio_blk_request(unit, v->bounce, n, offset + done, write) < n)
+			break;
+		if(!write)
+			memcpy((char *) buffer + done * VIRTIO_BLK_BLOCKSIZE, v->bounce, n * VIRTIO_BLK_BLOCKSIZE);
+	}
+	mutex_unlock(&v->bounce_mutex);
+
+	return done == nblocks ? nblocks : 0;
+}
+
+int virtio_blk_read(int unit, void *buffer, int nblocks, int offset)
+{
+	int result = virtio_blk_transfer(unit, buffer, nblocks, offset, 0);
+	if (current) {
+		current->stats.blocks_read += nblocks;
+		current->stats.bytes_read += nblocks * VIRTIO_BLK_BLOCKSIZE;
+	}
+	return result;
+}
+
+int virtio_blk_write(int unit, const void *buffer, int nblocks, int offset)
+{
+	int result = virtio_blk_transfer(unit, (void *) buffer, nblocks, offset, 1);
+	if (current) {
+		current->stats.blocks_written += nblocks;
+		current->stats.bytes_written += nblocks * VIRTIO_BLK_BLOCKSIZE;
+	}
+	return result;
+}
+
+int virtio_blk_probe(int unit, int *nblocks, int *blocksize, char *name)
+{
+	if(unit < 0 || unit >= nunits)
+		return 0;
+
+	*nblocks = units[unit].nblocks;
+	*blocksize = VIRTIO_BLK_BLOCKSIZE;
+	strcpy(name, "virtio block device");
+
+	return 1;
+}
+
+static struct device_driver virtio_blk_driver = {
+	.name          = "virtio",
+	.probe         = virtio_blk_probe,
+	.read          = virtio_blk_read,
+	.read_nonblock = virtio_blk_read,
+	.write         = virtio_blk_write,
+	.submit        = virtio_blk_submit,
+	.multiplier    = 8
+};
+
+static uint32_t virtio_align(uint32_t x)
+{
+	return (x + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1);
+}
+
+/*
+Reset the device, negotiate no optional features, and give it
+queue 0 in a physically contiguous, zeroed block of pages laid out
+as the legacy transport expects: descriptors, then the available
+ring, then the used ring on the next page boundary.
+*/
+
+static int virtio_blk_setup(struct pci_device *d, struct virtio_blk *v)
+{
+	uint32_t bar = pci_config_read(d, PCI_CONFIG_BAR0);
+	if(!(bar & 1)) {
+		printf("virtio: device has no i/o ports\n");
+		return 0;
+	}
+
+	uint32_t command = pci_config_read(d, PCI_CONFIG_COMMAND) & 0xffff;
+	pci_config_write(d, PCI_CONFIG_COMMAND, command | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+	v->base = bar & 0xfffc;
+
+	outb(0, v->base + VIRTIO_DEVICE_STATUS);
+	outb(VIRTIO_STATUS_ACKNOWLEDGE, v->base + VIRTIO_DEVICE_STATUS);
+	outb(VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER, v->base + VIRTIO_DEVICE_STATUS);
+
+	inl(v->base + VIRTIO_DEVICE_FEATURES);
+	outl(0, v->base + VIRTIO_GUEST_FEATURES);
+
+	outw(0, v->base + VIRTIO_QUEUE_SELECT);
+	v->qsize = inw(v->base + VIRTIO_QUEUE_SIZE);
+	if(v->qsize < VIRTIO_BLK_DESCS_PER_REQUEST) {
+		printf("virtio: device has no usable queue\n");
+		outb(VIRTIO_STATUS_FAILED, v->base + VIRTIO_DEVICE_STATUS);
+		return 0;
+	}
+
+	uint32_t avail_offset = v->qsize * sizeof(struct virtq_desc);
+	uint32_t used_offset = virtio_align(avail_offset + sizeof(struct virtq_avail) + (v->qsize + 1) * sizeof(uint16_t));
+	uint32_t length = used_offset + virtio_align(sizeof(struct virtq_used) + v->qsize * sizeof(struct virtq_used_elem) + sizeof(uint16_t));
+
+	int order = 0;
+	while((PAGE_SIZE << order) < length)
+		order++;
+
+	char *queue = page_alloc_n(order, 1);
+	int nslots = v->qsize / VIRTIO_BLK_DESCS_PER_REQUEST;
+	v->slots = kmalloc(nslots * sizeof(struct virtio_blk_slot));
+	v->free_slots = kmalloc(nslots * sizeof(int));
+	if(!queue || !v->slots || !v->free_slots) {
+		printf("virtio: couldn't allocate queue\n");
+		outb(VIRTIO_STATUS_FAILED, v->base + VIRTIO_DEVICE_STATUS);
+		return 0;
+	}
+
+	v->desc = (struct virtq_desc *) queue;
+	v->avail = (struct virtq_avail *) (queue + avail_offset);
+	v->used = (struct virtq_used *) (queue + used_offset);
+	v->last_used = 0;
+
+	for(v->nfree = 0; v->nfree < nslots; v->nfree++) {
+		v->free_slots[v->nfree] = v->nfree;
+	}
+	v->slot_waiters = (struct list) LIST_INIT;
+	v->bounce_mutex = (struct mutex) MUTEX_INIT;
+	v->bounce = page_alloc_n(VIRTIO_BLK_BOUNCE_ORDER, 0);
+
+	outl((uint32_t) queue / PAGE_SIZE, v->base + VIRTIO_QUEUE_ADDRESS);
+
+	v->nblocks = inl(v->base + VIRTIO_BLK_CAPACITY);
+
+	v->irq = pci_config_read(d, PCI_CONFIG_IRQ) & 0xff;
+	interrupt_register(32 + v->irq, virtio_blk_interrupt);
+	interrupt_enable(32 + v->irq);
+
+	outb(VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK, v->base + VIRTIO_DEVICE_STATUS);
+
+	printf("virtio unit %d: disk %u sectors %u MB queue %d irq %d\n", nunits, v->nblocks, v->nblocks / 2048, v->qsize, v->irq);
+
+	return 1;
+}
+
+void virtio_blk_init()
+{
+	struct pci_device *d;
+	int i;
+
+	for(i = 0; nunits < VIRTIO_BLK_MAX_UNITS && (d = pci_find_id(VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEVICE_BLK, i)); i++) {
+		if(virtio_blk_setup(d, &units[nunits]))
+			nunits++;
+	}
+
+	if(nunits == 0)
+		return;
+
+	process_launch(process_create_kthread(virtio_blk_worker));
+	device_driver_register(&virtio_blk_driver);
+}
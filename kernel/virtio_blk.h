@@ -0,0 +1,21 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#define VIRTIO_BLK_BLOCKSIZE 512
+
+#include "device.h"
+
+void virtio_blk_init();
+
+int virtio_blk_probe(int unit, int *nblocks, int *blocksize, char *name);
+int virtio_blk_read(int unit, void *buffer, int nblocks, int offset);
+int virtio_blk_write(int unit, const void *buffer, int nblocks, int offset);
+int virtio_blk_submit(int unit, struct device_request *r);
+
+#endif
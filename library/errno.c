@@ -50,6 +50,8 @@ const char * strerror( kernel_error_t err_code) {
 			return "Out of Objects";
 		case KERROR_OUT_OF_SPACE:
 			return "Out of Space";
+		case KERROR_FILE_BUSY:
+			return "File Busy";
 		default:
 			return "Unknown error";
 	}
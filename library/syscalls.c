@@ -83,6 +83,11 @@ extern void *syscall_process_heap(int a)
 	return (void *) syscall(SYSCALL_PROCESS_HEAP, a, 0, 0, 0, 0);
 }
 
+int syscall_process_priority(unsigned int pid, int priority)
+{
+	return syscall(SYSCALL_PROCESS_PRIORITY, pid, priority, 0, 0, 0);
+}
+
 int syscall_open_file( int fd, const char *path, int mode, kernel_flags_t flags)
 {
 	return syscall(SYSCALL_OPEN_FILE, fd, (uint32_t) path, mode, flags, 0);
@@ -188,6 +193,11 @@ int syscall_system_time( uint32_t *t )
 	return syscall(SYSCALL_SYSTEM_TIME, (uint32_t)t, 0, 0, 0, 0);
 }
 
+int syscall_system_clock( uint32_t *millis )
+{
+	return syscall(SYSCALL_SYSTEM_CLOCK, (uint32_t)millis, 0, 0, 0, 0);
+}
+
 int syscall_system_rtc( struct rtc_time *time )
 {
 	return syscall(SYSCALL_SYSTEM_RTC, (uint32_t)time, 0, 0, 0, 0);
@@ -200,6 +200,22 @@ int extract_statistic(struct stat_args * args) {
       return ((struct bcache_stats *)args->statistics)->write_misses;
     } else if (!strcmp(args->stat_name, "writebacks")) {
       return ((struct bcache_stats *)args->statistics)->writebacks;
+    } else if (!strcmp(args->stat_name, "dirty_blocks")) {
+      return ((struct bcache_stats *)args->statistics)->dirty_blocks;
+    } else if (!strcmp(args->stat_name, "flush_writes")) {
+      return ((struct bcache_stats *)args->statistics)->flush_writes;
+    } else if (!strcmp(args->stat_name, "flush_blocks")) {
+      return ((struct bcache_stats *)args->statistics)->flush_blocks;
+    } else if (!strcmp(args->stat_name, "readahead_blocks")) {
+      return ((struct bcache_stats *)args->statistics)->readahead_blocks;
+    } else if (!strcmp(args->stat_name, "readahead_hits")) {
+      return ((struct bcache_stats *)args->statistics)->readahead_hits;
+    } else if (!strcmp(args->stat_name, "readahead_wasted")) {
+      return ((struct bcache_stats *)args->statistics)->readahead_wasted;
+    } else if (!strcmp(args->stat_name, "write_errors")) {
+      return ((struct bcache_stats *)args->statistics)->write_errors;
+    } else if (!strcmp(args->stat_name, "write_abandoned")) {
+      return ((struct bcache_stats *)args->statistics)->write_abandoned;
     }
   }
   else if (args->stat_type == PROCESS_LIVE) {
@@ -220,6 +236,14 @@ int extract_statistic(struct stat_args * args) {
         return ((struct device_driver_stats *)args->statistics)->blocks_read;
       } else if (!strcmp(args->stat_name, "blocks_written")) {
         return ((struct device_driver_stats *)args->statistics)->blocks_written;
+      } else if (!strcmp(args->stat_name, "interrupts")) {
+        return ((struct device_driver_stats *)args->statistics)->interrupts;
+      } else if (!strcmp(args->stat_name, "io_wait_ticks")) {
+        return ((struct device_driver_stats *)args->statistics)->io_wait_ticks;
+      } else if (!strcmp(args->stat_name, "io_idle_ticks")) {
+        return ((struct device_driver_stats *)args->statistics)->io_idle_ticks;
+      } else if (!strcmp(args->stat_name, "requests_merged")) {
+        return ((struct device_driver_stats *)args->statistics)->requests_merged;
       }
   }
   else if (args->stat_type == SYSTEM_LIVE) {
@@ -359,7 +383,15 @@ void help() {
   printf("    read_misses\n");
   printf("    write_hits\n");
   printf("    write_misses\n");
-  printf("    writebacks\n\n");
+  printf("    writebacks\n");
+  printf("    dirty_blocks\n");
+  printf("    flush_writes\n");
+  printf("    flush_blocks\n");
+  printf("    readahead_blocks\n");
+  printf("    readahead_hits\n");
+  printf("    readahead_wasted\n");
+  printf("    write_errors\n");
+  printf("    write_abandoned\n\n");
 
   printf("\nProcess STAT_NAME options:\n");
   printf("    blocks_read\n");
@@ -370,7 +402,11 @@ void help() {
 
   printf("\nDriver STAT_NAME options:\n");
   printf("    blocks_read\n");
-  printf("    blocks_written\n\n");
+  printf("    blocks_written\n");
+  printf("    interrupts\n");
+  printf("    io_wait_ticks\n");
+  printf("    io_idle_ticks\n");
+  printf("    requests_merged\n\n");
 
   printf("\nSystem STAT_NAME options:\n");
   printf("    time\n");
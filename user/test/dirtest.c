@@ -0,0 +1,87 @@
+#include "library/syscalls.h"
+#include "library/string.h"
+
+/*
+Check directory lookup across index splits: create count (1000 by
+default) subdirectories of the given directory, whose names share a
+long prefix and differ only in their last few characters, so that the
+directory is indexed and its leaves split many times.  Then look each
+one up by name, check that the listing holds every one, and remove them.
+*/
+
+#define DIR_TEST_COUNT 1000
+#define DIR_TEST_PREFIX "shared_prefix_"
+
+static void dir_test_name(char *name, int i)
+{
+	strcpy(name, DIR_TEST_PREFIX);
+	uint_to_string(i, name + strlen(DIR_TEST_PREFIX));
+}
+
+int main(int argc, const char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "/";
+	int count = DIR_TEST_COUNT;
+	char name[32];
+	int i, fd, failures = 0;
+
+	if(argc > 2 && !str2int(argv[2], &count)) {
+		printf("use: dirtest <dir> [count]\n");
+		return 1;
+	}
+
+	int dir = syscall_open_dir(KNO_STDDIR, path, 0);
+	if(dir < 0) {
+		printf("couldn't open %s\n", path);
+		return 1;
+	}
+
+	for(i = 0; i < count; i++) {
+		dir_test_name(name, i);
+		fd = syscall_open_dir(dir, name, KERNEL_FLAGS_CREATE);
+		if(fd < 0) {
+			printf("couldn't create %s\n", name);
+			break;
+		}
+		syscall_object_close(fd);
+	}
+	count = i;
+
+	for(i = 0; i < count; i++) {
+		dir_test_name(name, i);
+		fd = syscall_open_dir(dir, name, 0);
+		if(fd < 0) {
+			printf("couldn't find %s\n", name);
+			failures++;
+		} else {
+			syscall_object_close(fd);
+		}
+	}
+
+	int length = count * 32 + 4096;
+	char *buffer = (char *) syscall_process_heap(length) - length;
+	int total = syscall_object_list(dir, buffer, length);
+	int found = 0;
+	for(i = 0; i < total; i += strlen(&buffer[i]) + 1) {
+		if(!strncmp(&buffer[i], DIR_TEST_PREFIX, strlen(DIR_TEST_PREFIX)))
+			found++;
+	}
+	if(found != count) {
+		printf("listing has %d of %d entries\n", found, count);
+		failures++;
+	}
+
+	for(i = 0; i < count; i++) {
+		dir_test_name(name, i);
+		if(syscall_object_remove(dir, name) < 0) {
+			printf("couldn't remove %s\n", name);
+			failures++;
+		}
+	}
+
+	syscall_object_close(dir);
+
+	printf("dirtest: %d entries, %d failures\n", count, failures);
+
+	return failures ? 1 : 0;
+}
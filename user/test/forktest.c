@@ -1,6 +1,48 @@
 #include "library/syscalls.h"
 #include "library/string.h"
 
+/*
+After a simple fork, measure fork latency: the parent grows its
+heap by FORK_BENCH_HEAP_PAGES pages and touches each of them, then
+forks FORK_BENCH_ITERATIONS children that exit immediately, and
+again with children that write to every heap page first, so that
+both the cost of fork itself and of the copies it defers are shown.
+*/
+
+#define FORK_BENCH_ITERATIONS 100
+#define FORK_BENCH_HEAP_PAGES 256
+#define FORK_BENCH_PAGE_SIZE 4096
+
+static void fork_bench(const char *name, char *heap, int touch)
+{
+	uint32_t start, stop;
+	int i, j;
+
+	syscall_system_clock(&start);
+
+	for(i = 0; i < FORK_BENCH_ITERATIONS; i++) {
+		int pid = syscall_process_fork();
+		if(pid == 0) {
+			if(touch) {
+				for(j = 0; j < FORK_BENCH_HEAP_PAGES; j++) {
+					heap[j * FORK_BENCH_PAGE_SIZE] = j;
+				}
+			}
+			syscall_process_exit(0);
+		} else if(pid < 0) {
+			printf("fork failed\n");
+			return;
+		}
+		struct process_info info;
+		syscall_process_wait(&info, -1);
+		syscall_process_reap(info.pid);
+	}
+
+	syscall_system_clock(&stop);
+
+	printf("%s: %d forks in %d ms (%d us per fork)\n", name, FORK_BENCH_ITERATIONS, stop - start, (stop - start) * 1000 / FORK_BENCH_ITERATIONS);
+}
+
 int main(int argc, char *argv[])
 {
 	printf("hello world, I am %d.\n", syscall_process_self());
@@ -13,5 +55,22 @@ int main(int argc, char *argv[])
 	for(i = 0; i < 5; ++i) {
 		printf("%d\n", i);
 	}
+
+	if(x == 0) {
+		return 0;
+	}
+
+	struct process_info info;
+	syscall_process_wait(&info, -1);
+	syscall_process_reap(info.pid);
+
+	int length = FORK_BENCH_HEAP_PAGES * FORK_BENCH_PAGE_SIZE;
+	char *heap = (char *) syscall_process_heap(length) - length;
+	memset(heap, 1, length);
+
+	printf("fork benchmark with a %d KB heap:\n", length / 1024);
+	fork_bench("fork+exit", heap, 0);
+	fork_bench("fork+write+exit", heap, 1);
+
 	return 0;
 }
@@ -0,0 +1,43 @@
+#include "library/syscalls.h"
+#include "library/string.h"
+
+/*
+Measure process start latency: run the given program (sysstat.exe
+by default) START_BENCH_ITERATIONS times, waiting for each to exit.
+Use the kernel shell command "demand_paging on|off" to compare
+demand-paged loading against reading the whole image up front.
+*/
+
+#define START_BENCH_ITERATIONS 50
+
+int main(int argc, const char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "sysstat.exe";
+	uint32_t start, stop;
+	int i;
+
+	int fd = syscall_open_file(KNO_STDDIR, path, 0, 0);
+	if(fd < 0) {
+		printf("couldn't open %s\n", path);
+		return 1;
+	}
+
+	syscall_system_clock(&start);
+
+	for(i = 0; i < START_BENCH_ITERATIONS; i++) {
+		int pid = syscall_process_run(fd, 1, &path);
+		if(pid < 0) {
+			printf("couldn't run %s\n", path);
+			return 1;
+		}
+		struct process_info info;
+		syscall_process_wait(&info, -1);
+		syscall_process_reap(info.pid);
+	}
+
+	syscall_system_clock(&stop);
+
+	printf("%s: %d starts in %d ms (%d ms per start)\n", path, START_BENCH_ITERATIONS, stop - start, (stop - start) / START_BENCH_ITERATIONS);
+
+	return 0;
+}